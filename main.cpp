@@ -7,6 +7,37 @@
 #include <iostream>
 #include <vector>
 #include <cmath> 
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include <numeric>
+#include <cfloat>
+#include <climits>
+#include <cerrno>
+#include <cctype>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <fstream>
+#include <deque>
+#include <map>
+#include <filesystem>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 using namespace std;
 
 struct Camera {
@@ -26,6 +57,24 @@ float g_extinction = 0.1f;
 float g_orbitSpeed = 0.7f; 
 int   g_numSamples = 64;
 
+//Phase Function
+// Henyey-Greenstein in-scattering, a forward lobe (g_phaseG) mixed with a
+// back lobe (g_phaseBackG) by g_phaseBackBlend. 0 = isotropic, 1 = evaluated
+// per sample, 2 = looked up in a LUT rebuilt when the parameters change
+int   g_phaseMode = 2;
+float g_phaseG = 0.6f;
+float g_phaseBackG = -0.3f;
+float g_phaseBackBlend = 0.2f;
+
+//Multiple Scattering
+// Octave approximation: octave i carries g_msScattering^i of the light,
+// sees g_msExtinction^i of the extinction and flattens g by g_msPhase^i;
+// 1 octave = single scattering only
+int   g_scatterOctaves = 3;
+float g_msExtinction = 0.5f;
+float g_msScattering = 0.5f;
+float g_msPhase = 0.5f;
+
 //Global Ambient Dimmer
 float g_fogAmbient = 0.02f; 
 
@@ -33,9 +82,180 @@ float g_fogAmbient = 0.02f;
 bool  g_useDithering = false; 
 
 //Map Analysis Toggle
-// 0 = Normal, 1 = Transmission Map, 2 = Depth Map
+// 0 = Normal, 1 = Transmission Map, 2 = Depth Map, 3 = March Step Count,
+// 4 = Shadow Lookups
 int   g_showMapMode = 0; 
 
+//Depth Pre-pass Toggle (march only runs for the visible surface)
+bool  g_depthPrepass = false;
+
+//Temporal Accumulation
+// Jitter rotates per frame and a reprojected history absorbs the noise,
+// so the march can run with far fewer samples
+bool  g_temporal = false;
+int   g_temporalSamples = 12;
+float g_temporalBlend = 0.1f;        // weight of the current frame
+float g_temporalLightReject = 0.02f; // cone-axis rotation (rad/frame) that drops history
+
+//Spotlight Cone Clipping (march samples only inside the cone)
+bool  g_coneClip = true;
+
+//Shadow Min/Max Hierarchy (skip shadow lookups on fully lit/shadowed segments)
+bool  g_shadowHierarchy = true;
+
+//Shadow Cache
+// The light frustum is fixed (straight down, wide enough for the whole orbit)
+// so the map only changes with the light or the occluders. Static geometry is
+// kept in its own layer; dynamic objects are redrawn over a copy of it.
+bool  g_shadowCache = true;
+float g_shadowUpdateHz = 0.0f; // cap on shadow re-renders per second, 0 = none
+bool  g_movingCube = false;    // dynamic occluder, exercises the dynamic layer
+
+//Culling
+// Each pass draws only the objects its view can see: the camera frustum for
+// the colour pass, the light frustum and spotlight cone for the shadow pass
+bool  g_culling = true;
+
+//Adaptive Step Count
+// Steps follow the marched length (one per g_stepTarget metres, clamped to
+// [g_stepMin, g_stepMax]) and the loop stops once transmittance < g_transmittanceEps
+bool  g_adaptiveSteps = false;
+int   g_stepMin = 4;
+int   g_stepMax = 128;
+float g_stepTarget = 0.04f;
+float g_transmittanceEps = 0.01f;
+
+//Fog Engine
+// 0 = Ray march (FOG_FRAG / deferred), 1 = Froxel grid (needs GL 4.3 compute),
+// 2 = Epipolar sampling (deferred, marches a sparse set of samples)
+int   g_fogMode = 0;
+bool  g_hasCompute = false;
+
+//Volumetric Resolution
+// 1 = full-res march in FOG_FRAG, 2 = half-res, 4 = quarter-res deferred pass
+int   g_volumeDownsample = 1;
+
+//Frame Stats Toggle (prints once per second)
+bool  g_showStats = false;
+
+//Heterogeneous Fog
+// A baked, tileable fbm volume scrolled by the wind scales the marched
+// density around g_fogDensity by up to +-g_noiseStrength
+bool  g_heterogeneousFog = true;
+float g_noiseStrength = 0.6f;
+float g_noiseScale = 0.15f;              // volume repeats per metre
+glm::vec3 g_wind(0.8f, 0.0f, 0.24f);     // m/s
+
+//Height Fog
+// Density falls off exponentially above g_heightFogBase and is clamped to
+// full below it; a thin haze layer with its own, slower falloff sits on top.
+// Transmittance comes from the closed-form integral via a LUT, see
+// buildHeightFogLUT()
+bool  g_heightFog = true;
+float g_heightFogBase = 1.0f;  // m
+float g_heightFalloff = 0.8f;  // 1/m
+float g_hazeAmount = 0.1f;     // share of the density in the haze layer
+float g_hazeFalloff = 0.1f;    // 1/m
+
+//Shader Specialization
+// Fog programs are compiled per sample count, dither, map mode and fog
+// engine so their branches fold; off = one program branching at run time
+bool  g_specializeShaders = true;
+
+//Profiler Overlay
+// CPU scopes and GPU timestamps per frame, averaged in a text overlay;
+// g_profilerDump asks the loop to write the recent frames as a Chrome trace
+bool  g_profiler = false;
+bool  g_profilerDump = false;
+
+//Quality Governor
+// Holds the frame time under g_frameBudgetMs by lowering the fog samples,
+// volumetric resolution and shadow map size, and raising them back when
+// there is room; see QualityGovernor
+bool  g_governor = false;
+float g_frameBudgetMs = 16.6f;
+int   g_shadowRes = 1024;       // power of two, reallocated when it changes
+
+//Terrain
+// shadertoy.glsl's terrain in place of the room, streamed in tiles around
+// the camera and ray cast through a max-mip quadtree; see TerrainMap
+bool  g_terrain = false;
+int   g_terrainTraversal = 1;   // 0 = fixed-step march, 1 = quadtree
+
+// Scene settings by name, for --set name=value on the command line
+struct Param { const char* name; float* f; int* i; bool* b; };
+static const vector<Param>& paramTable() {
+    static const vector<Param> params = {
+        {"fogDensity", &g_fogDensity, nullptr, nullptr},
+        {"extinction", &g_extinction, nullptr, nullptr},
+        {"fogAmbient", &g_fogAmbient, nullptr, nullptr},
+        {"phaseMode", nullptr, &g_phaseMode, nullptr},
+        {"phaseG", &g_phaseG, nullptr, nullptr},
+        {"phaseBackG", &g_phaseBackG, nullptr, nullptr},
+        {"phaseBackBlend", &g_phaseBackBlend, nullptr, nullptr},
+        {"scatterOctaves", nullptr, &g_scatterOctaves, nullptr},
+        {"msExtinction", &g_msExtinction, nullptr, nullptr},
+        {"msScattering", &g_msScattering, nullptr, nullptr},
+        {"msPhase", &g_msPhase, nullptr, nullptr},
+        {"numSamples", nullptr, &g_numSamples, nullptr},
+        {"dithering", nullptr, nullptr, &g_useDithering},
+        {"coneClip", nullptr, nullptr, &g_coneClip},
+        {"adaptiveSteps", nullptr, nullptr, &g_adaptiveSteps},
+        {"stepMin", nullptr, &g_stepMin, nullptr},
+        {"stepMax", nullptr, &g_stepMax, nullptr},
+        {"stepTarget", &g_stepTarget, nullptr, nullptr},
+        {"transmittanceEps", &g_transmittanceEps, nullptr, nullptr},
+        {"shadowHierarchy", nullptr, nullptr, &g_shadowHierarchy},
+        {"shadowCache", nullptr, nullptr, &g_shadowCache},
+        {"movingCube", nullptr, nullptr, &g_movingCube},
+        {"culling", nullptr, nullptr, &g_culling},
+        {"fogMode", nullptr, &g_fogMode, nullptr},
+        {"volumeDownsample", nullptr, &g_volumeDownsample, nullptr},
+        {"temporal", nullptr, nullptr, &g_temporal},
+        {"depthPrepass", nullptr, nullptr, &g_depthPrepass},
+        {"showMapMode", nullptr, &g_showMapMode, nullptr},
+        {"specializeShaders", nullptr, nullptr, &g_specializeShaders},
+        {"heterogeneousFog", nullptr, nullptr, &g_heterogeneousFog},
+        {"noiseStrength", &g_noiseStrength, nullptr, nullptr},
+        {"noiseScale", &g_noiseScale, nullptr, nullptr},
+        {"heightFog", nullptr, nullptr, &g_heightFog},
+        {"heightFogBase", &g_heightFogBase, nullptr, nullptr},
+        {"heightFalloff", &g_heightFalloff, nullptr, nullptr},
+        {"hazeAmount", &g_hazeAmount, nullptr, nullptr},
+        {"hazeFalloff", &g_hazeFalloff, nullptr, nullptr},
+        {"governor", nullptr, nullptr, &g_governor},
+        {"frameBudget", &g_frameBudgetMs, nullptr, nullptr},
+        {"shadowRes", nullptr, &g_shadowRes, nullptr},
+        {"terrain", nullptr, nullptr, &g_terrain},
+        {"terrainTraversal", nullptr, &g_terrainTraversal, nullptr},
+    };
+    return params;
+}
+
+static bool setParam(const string& name, const string& value) {
+    for (const Param& p : paramTable()) {
+        if (name != p.name) continue;
+        if (p.f) *p.f = float(atof(value.c_str()));
+        if (p.i) *p.i = atoi(value.c_str());
+        if (p.b) *p.b = value == "1" || value == "on" || value == "true";
+        return true;
+    }
+    return false;
+}
+
+// A setting's current value as setParam() reads it back, empty if unknown
+static string getParam(const string& name) {
+    for (const Param& p : paramTable()) {
+        if (name != p.name) continue;
+        char value[32];
+        if (p.f) snprintf(value, sizeof(value), "%.9g", *p.f);
+        if (p.i) snprintf(value, sizeof(value), "%d", *p.i);
+        if (p.b) snprintf(value, sizeof(value), "%d", int(*p.b));
+        return value;
+    }
+    return "";
+}
+
 void cursorpos(GLFWwindow* w, double x, double y) 
 {
     if (!cam.mouseCaptured) return;
@@ -66,11 +286,159 @@ void key_callback(GLFWwindow* w, int key, int scancode, int action, int mods)
         
         // [TOGGLE 2] Map Analysis
         if (key == GLFW_KEY_M && action == GLFW_PRESS) {
-            g_showMapMode = (g_showMapMode + 1) % 3;
-            string modeName = (g_showMapMode == 0) ? "Normal Render" : (g_showMapMode == 1 ? "Transmission Map (t)" : "Depth Map (d) [Heatmap]");
+            g_showMapMode = (g_showMapMode + 1) % 5;
+            const char* modeNames[5] = {"Normal Render", "Transmission Map (t)", "Depth Map (d) [Heatmap]", "March Steps [Heatmap]", "Shadow Lookups [Heatmap]"};
+            string modeName = modeNames[g_showMapMode];
             cout << "visual " << modeName << endl;
         }
 
+        // [TOGGLE 3] Depth Pre-pass
+        if (key == GLFW_KEY_P && action == GLFW_PRESS) {
+            g_depthPrepass = !g_depthPrepass;
+            cout << "depth pre-pass " << (g_depthPrepass ? "ON" : "OFF") << endl;
+        }
+
+        // [TOGGLE 4] Frame Stats
+        if (key == GLFW_KEY_I && action == GLFW_PRESS) {
+            g_showStats = !g_showStats;
+            cout << "stats " << (g_showStats ? "ON" : "OFF") << endl;
+        }
+
+        // [TOGGLE 5] Volumetric Resolution
+        if (key == GLFW_KEY_R && action == GLFW_PRESS) {
+            g_volumeDownsample = (g_volumeDownsample == 1) ? 2 : (g_volumeDownsample == 2 ? 4 : 1);
+            string resName = (g_volumeDownsample == 1) ? "Full (per-fragment)" : (g_volumeDownsample == 2 ? "Half (deferred)" : "Quarter (deferred)");
+            cout << "volume res " << resName << endl;
+        }
+
+        // [TOGGLE 6] Temporal Accumulation
+        if (key == GLFW_KEY_Y && action == GLFW_PRESS) {
+            g_temporal = !g_temporal;
+            cout << "temporal " << (g_temporal ? "ON" : "OFF") << " (" << (g_temporal ? g_temporalSamples : g_numSamples) << " samples)" << endl;
+        }
+
+        // [TOGGLE 7] Fog Engine
+        if (key == GLFW_KEY_V && action == GLFW_PRESS) {
+            g_fogMode = (g_fogMode + 1) % 3;
+            if (g_fogMode == 1 && !g_hasCompute) {
+                cout << "froxel grid needs GL 4.3 compute" << endl;
+                g_fogMode = 2;
+            }
+            string engineName = (g_fogMode == 0) ? "Ray March" : (g_fogMode == 1 ? "Froxel Grid" : "Epipolar");
+            cout << "fog engine " << engineName << endl;
+        }
+
+        // [TOGGLE 8] Cone Clipping
+        if (key == GLFW_KEY_K && action == GLFW_PRESS) {
+            g_coneClip = !g_coneClip;
+            cout << "cone clip " << (g_coneClip ? "ON" : "OFF") << endl;
+        }
+
+        // [TOGGLE 9] Adaptive Step Count
+        if (key == GLFW_KEY_N && action == GLFW_PRESS) {
+            g_adaptiveSteps = !g_adaptiveSteps;
+            if (g_adaptiveSteps) {
+                cout << "adaptive steps ON (" << g_stepMin << ".." << g_stepMax << ", " << g_stepTarget << " m, eps " << g_transmittanceEps << ")" << endl;
+            } else {
+                cout << "adaptive steps OFF" << endl;
+            }
+        }
+
+        // [TOGGLE 10] Shadow Min/Max Hierarchy
+        if (key == GLFW_KEY_H && action == GLFW_PRESS) {
+            g_shadowHierarchy = !g_shadowHierarchy;
+            cout << "shadow hierarchy " << (g_shadowHierarchy ? "ON" : "OFF") << endl;
+        }
+
+        // [TOGGLE 11] Shadow Cache
+        if (key == GLFW_KEY_C && action == GLFW_PRESS) {
+            g_shadowCache = !g_shadowCache;
+            cout << "shadow cache " << (g_shadowCache ? "ON" : "OFF") << endl;
+        }
+
+        // [TOGGLE 12] Shadow Update Cap
+        if (key == GLFW_KEY_U && action == GLFW_PRESS) {
+            g_shadowUpdateHz = (g_shadowUpdateHz == 0.0f) ? 30.0f : (g_shadowUpdateHz == 30.0f ? 10.0f : 0.0f);
+            if (g_shadowUpdateHz > 0.0f) cout << "shadow updates capped at " << g_shadowUpdateHz << " Hz" << endl;
+            else cout << "shadow updates uncapped" << endl;
+        }
+
+        // [TOGGLE 13] Moving Cube
+        if (key == GLFW_KEY_B && action == GLFW_PRESS) {
+            g_movingCube = !g_movingCube;
+            cout << "moving cube " << (g_movingCube ? "ON" : "OFF") << endl;
+        }
+
+        // [TOGGLE 14] BVH Culling
+        if (key == GLFW_KEY_L && action == GLFW_PRESS) {
+            g_culling = !g_culling;
+            cout << "culling " << (g_culling ? "ON" : "OFF") << endl;
+        }
+
+        // [TOGGLE 15] Profiler Overlay
+        if (key == GLFW_KEY_O && action == GLFW_PRESS) {
+            g_profiler = !g_profiler;
+            cout << "profiler " << (g_profiler ? "ON" : "OFF") << endl;
+        }
+
+        // [TOGGLE 16] Shader Specialization
+        if (key == GLFW_KEY_J && action == GLFW_PRESS) {
+            g_specializeShaders = !g_specializeShaders;
+            cout << "shader specialization " << (g_specializeShaders ? "ON" : "OFF") << endl;
+        }
+
+        // [TOGGLE 17] Heterogeneous Fog
+        if (key == GLFW_KEY_Z && action == GLFW_PRESS) {
+            g_heterogeneousFog = !g_heterogeneousFog;
+            cout << "heterogeneous fog " << (g_heterogeneousFog ? "ON" : "OFF") << endl;
+        }
+
+        // [TOGGLE 18] Height Fog
+        if (key == GLFW_KEY_4 && action == GLFW_PRESS) {
+            g_heightFog = !g_heightFog;
+            cout << "height fog " << (g_heightFog ? "ON" : "OFF") << endl;
+        }
+
+        // [TOGGLE 19] Phase Function
+        if (key == GLFW_KEY_5 && action == GLFW_PRESS) {
+            g_phaseMode = (g_phaseMode + 1) % 3;
+            const char* names[] = {"ISOTROPIC", "HG (evaluated)", "HG (LUT)"};
+            cout << "phase function " << names[g_phaseMode] << endl;
+        }
+
+        // [TOGGLE 20] Multiple Scattering Octaves
+        if (key == GLFW_KEY_6 && action == GLFW_PRESS) {
+            g_scatterOctaves = g_scatterOctaves % 4 + 1;
+            cout << "scattering octaves " << g_scatterOctaves << (g_scatterOctaves == 1 ? " (single scattering)" : "") << endl;
+        }
+
+        // [TOGGLE 21] Quality Governor
+        if (key == GLFW_KEY_7 && action == GLFW_PRESS) {
+            g_governor = !g_governor;
+            cout << "quality governor " << (g_governor ? "ON" : "OFF") << " (" << g_frameBudgetMs << " ms budget)" << endl;
+        }
+
+        // [TOGGLE 22] Frame Budget (60 / 120 Hz)
+        if (key == GLFW_KEY_8 && action == GLFW_PRESS) {
+            g_frameBudgetMs = g_frameBudgetMs > 12.0f ? 8.3f : 16.6f;
+            cout << "frame budget " << g_frameBudgetMs << " ms" << endl;
+        }
+
+        // [TOGGLE 23] Terrain View
+        if (key == GLFW_KEY_9 && action == GLFW_PRESS) {
+            g_terrain = !g_terrain;
+            cout << "terrain view " << (g_terrain ? "ON" : "OFF") << endl;
+        }
+
+        // [TOGGLE 24] Terrain Traversal (Fixed Step / Quadtree)
+        if (key == GLFW_KEY_0 && action == GLFW_PRESS) {
+            g_terrainTraversal = 1 - g_terrainTraversal;
+            cout << "terrain traversal " << (g_terrainTraversal ? "max-mip quadtree" : "fixed-step march") << endl;
+        }
+
+        // [PROFILER TRACE DUMP]
+        if (key == GLFW_KEY_X && action == GLFW_PRESS) g_profilerDump = true;
+
         // [DIMMER CONTROLS]
         if (key == GLFW_KEY_RIGHT_BRACKET) { // ']' key
             g_fogAmbient += 0.01f;
@@ -81,7 +449,110 @@ void key_callback(GLFWwindow* w, int key, int scancode, int action, int mods)
             if(g_fogAmbient < 0.0f) g_fogAmbient = 0.0f;
             cout << "Global Dimmer DOWN: " << g_fogAmbient << endl;
         }
+
+        // [HEIGHT FOG FALLOFF CONTROLS]
+        if (key == GLFW_KEY_EQUAL) { // '=' key
+            g_heightFalloff += 0.1f;
+            cout << "Height Falloff UP: " << g_heightFalloff << endl;
+        }
+        if (key == GLFW_KEY_MINUS) { // '-' key
+            g_heightFalloff -= 0.1f;
+            if (g_heightFalloff < 0.0f) g_heightFalloff = 0.0f;
+            cout << "Height Falloff DOWN: " << g_heightFalloff << endl;
+        }
+    }
+}
+
+// Texture units and the FrameData binding, fixed at link time
+static const GLint UNIT_SHADOW_MAP = 3;
+static const GLint UNIT_FROXEL_VOLUME = 5;
+static const GLint UNIT_SHADOW_MINMAX = 6;
+static const GLint UNIT_OBJECTS = 7;
+static const GLint UNIT_NOISE_VOLUME = 8;
+static const GLint UNIT_HEIGHT_FOG_LUT = 9;
+static const GLint UNIT_PHASE_LUT = 10;
+static const GLint UNIT_TERRAIN_HEIGHTS = 11;
+static const GLint UNIT_TERRAIN_MAXIMA = 12;
+static const GLint UNIT_TERRAIN_PAGES = 13;
+static const GLint UNIT_TERRAIN_COARSE = 14;
+static const GLuint FRAME_UBO_BINDING = 0;
+
+// Fullscreen passes' inputs, bound just before each draw
+static const GLint UNIT_PASS_COLOR = 0;
+static const GLint UNIT_PASS_DEPTH = 1;
+static const GLint UNIT_PASS_AUX = 2;
+static const GLint UNIT_PASS_FOG = 4;
+
+// Epipolar sampling: 1024 lines x 512 samples, every 16th sample marched
+// (plus depth breaks, where the ray length jumps by more than 5%)
+static const int EPI_LINES = 1024, EPI_SAMPLES = 512, EPI_STEP = 16;
+static const float EPI_DEPTH_BREAK = 0.05f;
+
+// Camera clip planes: the projection, the passes' depth linearisation and
+// the CPU reference's rays all clip here
+static const float VIEW_NEAR = 0.1f, VIEW_FAR = 50.0f;
+
+// Pass uniforms that change at runtime; everything else is either in
+// FrameData or set once at link time
+enum PassUniform {
+    U_FROM_DEPTH, U_EPI_LIGHT, U_EPI_SCREEN, U_INV_VIEW_PROJ, U_PREV_VIEW_PROJ, U_VIEW_POS, U_DOWNSAMPLE, U_BLEND,
+    U_TERRAIN_TRAVERSAL, PASS_UNIFORM_COUNT
+};
+static const char* PASS_UNIFORM_NAMES[PASS_UNIFORM_COUNT] = {
+    "uFromDepth", "uEpiLight", "uEpiScreen", "uInvViewProj", "uPrevViewProj", "uViewPos", "uDownsample", "uBlend",
+    "uTerrainTraversal",
+};
+
+// A linked program and the locations of its pass uniforms (-1 where the
+// program has none, which glUniform* ignores)
+struct Program {
+    GLuint id = 0;
+    GLint uniforms[PASS_UNIFORM_COUNT];
+};
+
+// Point the FrameData block and every sampler of a freshly linked program
+// at their fixed bindings, set its constants and resolve its pass
+// uniforms, so draws never look anything up by name
+static void bindProgramResources(Program& program)
+{
+    GLuint p = program.id;
+    GLuint block = glGetUniformBlockIndex(p, "FrameData");
+    if (block != GL_INVALID_INDEX) glUniformBlockBinding(p, block, FRAME_UBO_BINDING);
+    const struct { const char* name; GLint unit; } samplers[] = {
+        {"uShadowMap", UNIT_SHADOW_MAP},
+        {"uFroxelVolume", UNIT_FROXEL_VOLUME},
+        {"uShadowMinMax", UNIT_SHADOW_MINMAX},
+        {"uObjects", UNIT_OBJECTS},
+        {"uNoiseVolume", UNIT_NOISE_VOLUME},
+        {"uHeightFogLUT", UNIT_HEIGHT_FOG_LUT},
+        {"uPhaseLUT", UNIT_PHASE_LUT},
+        {"uTerrainHeights", UNIT_TERRAIN_HEIGHTS},
+        {"uTerrainMaxima", UNIT_TERRAIN_MAXIMA},
+        {"uTerrainPages", UNIT_TERRAIN_PAGES},
+        {"uTerrainCoarse", UNIT_TERRAIN_COARSE},
+        {"uSource", UNIT_PASS_COLOR},
+        {"uCurrent", UNIT_PASS_COLOR},
+        {"uSceneColor", UNIT_PASS_COLOR},
+        {"uEpiScatter", UNIT_PASS_COLOR},
+        {"uText", UNIT_PASS_COLOR},
+        {"uSceneDepth", UNIT_PASS_DEPTH},
+        {"uHistory", UNIT_PASS_AUX},
+        {"uVolume", UNIT_PASS_AUX},
+        {"uEpiCoords", UNIT_PASS_AUX},
+        {"uEpiFog", UNIT_PASS_FOG},
+    };
+    glUseProgram(p);
+    for (const auto& s : samplers) {
+        GLint loc = glGetUniformLocation(p, s.name);
+        if (loc >= 0) glUniform1i(loc, s.unit);
     }
+    glUniform1i(glGetUniformLocation(p, "uEpiLines"), EPI_LINES);
+    glUniform1i(glGetUniformLocation(p, "uEpiSamples"), EPI_SAMPLES);
+    glUniform1i(glGetUniformLocation(p, "uEpiStep"), EPI_STEP);
+    glUniform1f(glGetUniformLocation(p, "uEpiDepthBreak"), EPI_DEPTH_BREAK);
+    glUniform2f(glGetUniformLocation(p, "uNearFar"), VIEW_NEAR, VIEW_FAR);
+    for (int u = 0; u < PASS_UNIFORM_COUNT; ++u) program.uniforms[u] = glGetUniformLocation(p, PASS_UNIFORM_NAMES[u]);
+    glUseProgram(0);
 }
 
 static GLuint compile(GLenum type, const char* src) 
@@ -99,12 +570,12 @@ static GLuint compile(GLenum type, const char* src)
     }
     return s;
 }
-static GLuint linkProgram(GLuint vs, GLuint fs) 
+// Links the shaders into p, logging the error if it fails
+static bool linkProgram(GLuint p, const vector<GLuint>& shaders)
 {
-    GLuint p = glCreateProgram();
-    glAttachShader(p, vs);
-    glAttachShader(p, fs);
+    for (GLuint sh : shaders) glAttachShader(p, sh);
     glLinkProgram(p);
+    for (GLuint sh : shaders) glDetachShader(p, sh);
     GLint ok; 
     glGetProgramiv(p, GL_LINK_STATUS, &ok);
     if (!ok) {
@@ -113,78 +584,377 @@ static GLuint linkProgram(GLuint vs, GLuint fs)
         glGetProgramInfoLog(p, len, nullptr, log.data());
         cerr << "Link error: " << log << endl;
     }
-    return p;
+    return ok;
+}
+
+static uint64_t fnv1a(const string& data, uint64_t hash = 14695981039346656037ull)
+{
+    for (unsigned char c : data) hash = (hash ^ c) * 1099511628211ull;
+    return hash;
+}
+
+// Programs by name, each a list of stage sources. A variant is a program
+// with a block of #defines injected after its #version lines; it is built
+// the first time it is asked for and kept for the run. With a cache
+// directory, linked variants are stored as <dir>/<hash>.bin, the hash
+// covering the driver strings and the final sources, so an edited shader
+// or a driver update misses the cache and relinks.
+struct ProgramCache {
+    struct Stage { GLenum type; string source; };
+
+    string dir;
+    int built = 0, loaded = 0;
+
+    void add(const string& name, vector<Stage> stages) { sources[name] = move(stages); }
+
+    const Program& get(const string& name, const string& defines = "") {
+        string key = name + "\n" + defines;
+        auto found = programs.find(key);
+        if (found != programs.end()) return found->second;
+
+        if (driver.empty()) {
+            GLint formats = 0;
+            glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+            if (formats == 0) dir.clear();
+            for (GLenum e : {GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION}) driver += string((const char*)glGetString(e)) + "\n";
+            if (!dir.empty()) {
+                error_code ec;
+                filesystem::create_directories(dir, ec);
+            }
+        }
+
+        vector<Stage> stages = sources.at(name);
+        uint64_t hash = fnv1a(driver);
+        for (Stage& stage : stages) {
+            size_t eol = stage.source.find('\n') + 1;
+            stage.source.insert(eol, defines);
+            hash = fnv1a(to_string(stage.type) + "\n" + stage.source, hash);
+        }
+        char file[32];
+        snprintf(file, sizeof(file), "%016llx.bin", (unsigned long long)hash);
+        string path = dir.empty() ? "" : dir + "/" + file;
+
+        GLuint p = glCreateProgram();
+        if (path.empty() || !loadBinary(p, path)) {
+            vector<GLuint> shaders;
+            for (const Stage& stage : stages) shaders.push_back(compile(stage.type, stage.source.c_str()));
+            if (!path.empty()) glProgramParameteri(p, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+            bool ok = linkProgram(p, shaders);
+            for (GLuint sh : shaders) glDeleteShader(sh);
+            if (!ok) cerr << "  in program " << name << endl;
+            else if (!path.empty()) saveBinary(p, path);
+            built++;
+        } else {
+            loaded++;
+        }
+        Program& program = programs[key];
+        program.id = p;
+        bindProgramResources(program);
+        return program;
+    }
+
+    // For lookups made every frame: the slot keeps the program of one
+    // variant key, so the map is only searched when the key changes
+    struct Slot {
+        const Program* program = nullptr;
+        uint64_t variant = 0;
+    };
+
+    const Program& get(Slot& slot, const char* name, uint64_t variant = 0, const string& defines = "") {
+        if (!slot.program || slot.variant != variant) {
+            slot.program = &get(name, defines);
+            slot.variant = variant;
+        }
+        return *slot.program;
+    }
+
+private:
+    static bool loadBinary(GLuint p, const string& path) {
+        ifstream file(path, ios::binary);
+        GLenum format = 0;
+        if (!file.read((char*)&format, sizeof(format))) return false;
+        vector<char> binary((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        if (binary.empty()) return false;
+        glProgramBinary(p, format, binary.data(), GLsizei(binary.size()));
+        GLint ok = 0;
+        glGetProgramiv(p, GL_LINK_STATUS, &ok);
+        return ok;
+    }
+
+    static void saveBinary(GLuint p, const string& path) {
+        GLint length = 0;
+        glGetProgramiv(p, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0) return;
+        vector<char> binary(length);
+        GLenum format = 0;
+        glGetProgramBinary(p, length, &length, &format, binary.data());
+        ofstream file(path, ios::binary);
+        file.write((const char*)&format, sizeof(format));
+        file.write(binary.data(), length);
+    }
+
+    map<string, vector<Stage>> sources;
+    map<string, Program> programs;
+    string driver;
+};
+
+static const char* GLSL_410 = "#version 410 core\n";
+static const char* GLSL_430 = "#version 430 core\n";
+
+// Per-frame data shared by every scene and fog program: one std140 block,
+// uploaded once per frame. Must match struct FrameData below.
+static const char* FRAME_DATA = R"(
+layout(std140) uniform FrameData {
+    mat4 uView;
+    mat4 uProj;
+    mat4 uLightVP;
+    mat4 uInvViewProj;
+    vec3 uViewPos;      float uLightPower;
+    vec3 uLightPos;     float uShadowBias;
+    vec3 uLightColor;   float uFogDensity;
+    vec3 uWindowCenter; float uExtinction;
+    float uFogAmbient;
+    float uConeAngleInner;
+    float uConeAngleOuter;
+    float uStepTarget;
+    float uTransmittanceEps; // march stops once transmittance drops below this
+    int uNumSamples;
+    int uJitterFrame;   // rotates the dither pattern per frame, 0 = static
+    int uShowMapMode;   // 0=Normal, 1=Transmission, 2=Depth, 3=Step count, 4=Shadow lookups
+    ivec2 uStepRange;   // adaptive step count: clamp(length / uStepTarget, x, y)
+    vec2 uFroxelNearFar;
+    vec2 uScreenSize;
+    int uFroxelSlices;
+    int uShadowMinMaxLevels;
+    int uFogMode;
+    bool uDither;
+    bool uConeClip;     // march only the part of the ray inside the spotlight cone
+    bool uAdaptiveSteps;
+    bool uShadowHierarchy;
+    bool uDeferredFog;  // fog is marched in a later pass and composited
+    float uNoiseAmount; // heterogeneous density: +-this around uFogDensity, 0 = uniform
+    float uNoiseScale;  // noise volume repeats per metre
+    vec3 uWindOffset;   // noise volume scroll, in volume units
+    bool uHeightFog;
+    vec2 uHeightFogRange; // heights covered by uHeightFogLUT
+    int uPhaseMode;     // 0 = isotropic, 1 = Henyey-Greenstein, 2 = from uPhaseLUT
+    int uScatterOctaves;
+    vec2 uPhaseG;       // forward, back lobe
+    float uPhaseBackBlend;
+    vec4 uOctaveExtinction; // per octave o (component o): msExtinction^o
+    vec4 uOctaveWeight;     // msScattering^o
+    vec4 uOctaveG;          // msPhase^o, scales uPhaseG
+    vec4 uHeightFogLayers; // base, falloff, haze, haze falloff (HeightFogProfile)
+};
+
+// Settings a program can be specialized on. A variant defines them as
+// constants after the #version line so their branches fold at compile
+// time; otherwise they read the fields above.
+#ifndef NUM_SAMPLES
+#define NUM_SAMPLES uNumSamples
+#endif
+#ifndef DITHER
+#define DITHER uDither
+#endif
+#ifndef SHOW_MAP_MODE
+#define SHOW_MAP_MODE uShowMapMode
+#endif
+#ifndef FOG_MODE
+#define FOG_MODE uFogMode
+#endif
+#ifndef DEFERRED_FOG
+#define DEFERRED_FOG uDeferredFog
+#endif
+#ifndef PHASE_MODE
+#define PHASE_MODE uPhaseMode
+#endif
+#ifndef SCATTER_OCTAVES
+#define SCATTER_OCTAVES uScatterOctaves
+#endif
+)";
+
+struct FrameData {
+    glm::mat4 view, proj, lightVP, invViewProj;
+    glm::vec3 viewPos;      float lightPower;
+    glm::vec3 lightPos;     float shadowBias;
+    glm::vec3 lightColor;   float fogDensity;
+    glm::vec3 windowCenter; float extinction;
+    float fogAmbient, coneAngleInner, coneAngleOuter, stepTarget, transmittanceEps;
+    int32_t numSamples, jitterFrame, showMapMode;
+    int32_t stepRange[2];
+    float froxelNearFar[2];
+    float screenSize[2];
+    int32_t froxelSlices, shadowMinMaxLevels, fogMode;
+    int32_t dither, coneClip, adaptiveSteps, shadowHierarchy, deferredFog;
+    float noiseAmount, noiseScale;
+    glm::vec3 windOffset;
+    int32_t heightFog;
+    float heightFogRange[2];
+    int32_t phaseMode, scatterOctaves;
+    float phaseG[2];
+    float phaseBackBlend;
+    float pad0; // std140 aligns vec4 to 16 bytes
+    glm::vec4 octaveExtinction, octaveWeight, octaveG;
+    glm::vec4 heightFogLayers;
+};
+static_assert(sizeof(FrameData) == 528, "FrameData must match the std140 FrameData block");
+
+// Per-object data: model matrix columns then colour, OBJECT_TEXELS RGBA32F
+// texels per object in a buffer texture, indexed by draw ID
+static const int OBJECT_TEXELS = 5;
+struct ObjectData {
+    glm::mat4 model;
+    glm::vec4 color;
+};
+static_assert(sizeof(ObjectData) == OBJECT_TEXELS * 16, "ObjectData must be OBJECT_TEXELS texels");
+
+static const char* OBJECT_DATA = R"(
+uniform samplerBuffer uObjects;
+
+mat4 objectModel(int id) {
+    int base = id * 5;
+    return mat4(texelFetch(uObjects, base), texelFetch(uObjects, base + 1),
+                texelFetch(uObjects, base + 2), texelFetch(uObjects, base + 3));
+}
+
+vec3 objectColor(int id) {
+    return texelFetch(uObjects, id * 5 + 4).rgb;
 }
+)";
+
+// The draw ID is an instanced attribute over an identity buffer, so each
+// draw command's baseInstance selects its first object
+static const char* OBJECT_VERT = R"(
+layout(location=2) in int aDrawID;
+flat out int vDrawID;
+)";
+static const char* OBJECT_FRAG = R"(
+flat in int vDrawID;
+)";
 
-static const char* SIMPLE_VERT = R"(#version 410 core
+static const char* SIMPLE_VERT = R"(
 layout(location=0) in vec3 aPos;
-uniform mat4 uModel, uView, uProj;
-void main(){ gl_Position = uProj * uView * uModel * vec4(aPos,1.0); }
+void main(){
+    vDrawID = aDrawID;
+    gl_Position = uProj * uView * objectModel(aDrawID) * vec4(aPos,1.0);
+}
 )";
 
-static const char* SIMPLE_FRAG = R"(#version 410 core
-out vec4 FragColor; uniform vec3 uColor;
-void main(){ FragColor = vec4(uColor,1.0); }
+static const char* SIMPLE_FRAG = R"(
+out vec4 FragColor;
+void main(){ FragColor = vec4(objectColor(vDrawID),1.0); }
 )";
 
-static const char* DEPTH_VERT = R"(#version 410 core
+static const char* DEPTH_VERT = R"(
 layout(location=0) in vec3 aPos;
-uniform mat4 uModel;
-uniform mat4 uLightVP;
 void main() {
-    gl_Position = uLightVP * uModel * vec4(aPos, 1.0);
+    gl_Position = uLightVP * objectModel(aDrawID) * vec4(aPos, 1.0);
 }
 )";
 static const char* DEPTH_FRAG = R"(#version 410 core
 void main() { }
 )";
 
-static const char* FOG_VERT = R"(#version 410 core
+// One level of the shadow min/max chain: rg = min/max depth of a 2x2 block
+// of the level above (the shadow map itself for level 0). The source is
+// restricted to a single level, so lod 0 is always the level being read.
+static const char* SHADOW_MINMAX_FRAG = R"(#version 410 core
+out vec2 FragColor;
+uniform sampler2D uSource;
+uniform bool uFromDepth;
+void main() {
+    ivec2 q = ivec2(gl_FragCoord.xy) * 2;
+    vec2 a = texelFetch(uSource, q, 0).rg;
+    vec2 b = texelFetch(uSource, q + ivec2(1, 0), 0).rg;
+    vec2 c = texelFetch(uSource, q + ivec2(0, 1), 0).rg;
+    vec2 d = texelFetch(uSource, q + ivec2(1, 1), 0).rg;
+    if (uFromDepth) { a.g = a.r; b.g = b.r; c.g = c.r; d.g = d.r; }
+    FragColor = vec2(min(min(a.r, b.r), min(c.r, d.r)), max(max(a.g, b.g), max(c.g, d.g)));
+}
+)";
+
+// Depth-only pass over the fogged geometry. Must compute gl_Position exactly
+// like FOG_VERT so the colour pass can use GL_EQUAL.
+static const char* PREPASS_VERT = R"(
+layout(location=0) in vec3 aPos;
+invariant gl_Position;
+void main(){
+    vec4 world = objectModel(aDrawID) * vec4(aPos, 1.0);
+    gl_Position = uProj * uView * world;
+}
+)";
+
+static const char* FOG_VERT = R"(
 layout(location=0) in vec3 aPos;
 layout(location=1) in vec3 aNormal;
 
-uniform mat4 uModel, uView, uProj;
+invariant gl_Position;
 
 out vec3 vPos;
 out vec3 vNormal;
 
 void main(){
-    vec4 world = uModel * vec4(aPos, 1.0);
+    mat4 model = objectModel(aDrawID);
+    vDrawID = aDrawID;
+    vec4 world = model * vec4(aPos, 1.0);
     vPos = world.xyz;
-    vNormal = mat3(transpose(inverse(uModel))) * aNormal;
+    vNormal = mat3(transpose(inverse(model))) * aNormal;
     gl_Position = uProj * uView * world;
 }
 )";
 
-static const char* FOG_FRAG = R"(#version 410 core
-out vec4 FragColor;
-in vec3 vPos;
-in vec3 vNormal;
+// Exponential height fog. uHeightFogLUT holds the mean of the relative
+// density profile between two heights (the segment's start and end height,
+// texel centres spanning uHeightFogRange), so the optical depth of a straight
+// segment of any length is one filtered fetch. Segments leaving that range
+// take the closed form instead. Built by buildHeightFogLUT(); prefixed with
+// FRAME_DATA like FOG_COMMON.
+static const char* HEIGHT_FOG = R"(
+uniform sampler2D uHeightFogLUT;
+const float HEIGHT_FOG_LUT_SIZE = 128.0; // must match HEIGHT_FOG_LUT_SIZE
+const float HEIGHT_FOG_FLAT = 0.01;      // must match HEIGHT_FOG_FLAT
 
-uniform vec3 uColor;
-uniform vec3 uViewPos;
-uniform vec3 uLightPos;
-uniform vec3 uLightColor;
-uniform float uLightPower;
+// heightLayerIntegral() and heightFogIntegral() of buildHeightFogLUT()
+float heightLayerIntegral(float h, float falloff) {
+    return h <= 0.0 || falloff < 1e-6 ? h : (1.0 - exp(-falloff * h)) / falloff;
+}
 
-uniform sampler2D uShadowMap;
-uniform mat4 uLightVP;
-uniform float uShadowBias;
+float heightFogIntegral(float y) {
+    float h = y - uHeightFogLayers.x;
+    return (1.0 - uHeightFogLayers.z) * heightLayerIntegral(h, uHeightFogLayers.y) +
+           uHeightFogLayers.z * heightLayerIntegral(h, uHeightFogLayers.w);
+}
 
-uniform float uFogDensity;        
-uniform float uExtinction;       
-uniform int uNumSamples;
+float heightFogMean(float y0, float y1) {
+    vec2 h = (vec2(y0, y1) - uHeightFogRange.x) / (uHeightFogRange.y - uHeightFogRange.x);
+    if (all(greaterThanEqual(h, vec2(0.0))) && all(lessThanEqual(h, vec2(1.0)))) {
+        return textureLod(uHeightFogLUT, (0.5 + h * (HEIGHT_FOG_LUT_SIZE - 1.0)) / HEIGHT_FOG_LUT_SIZE, 0.0).r;
+    }
+    // Too flat to divide by the height change: the density at the middle
+    if (abs(y1 - y0) < HEIGHT_FOG_FLAT) {
+        float mid = max(0.5 * (y0 + y1) - uHeightFogLayers.x, 0.0);
+        return (1.0 - uHeightFogLayers.z) * exp(-uHeightFogLayers.y * mid) + uHeightFogLayers.z * exp(-uHeightFogLayers.w * mid);
+    }
+    return (heightFogIntegral(y1) - heightFogIntegral(y0)) / (y1 - y0);
+}
 
-// Ambient Dimmer
-uniform float uFogAmbient;
+// Relative density at height y, 1 without height fog
+float heightFogProfile(float y) {
+    return uHeightFog ? heightFogMean(y, y) : 1.0;
+}
 
-uniform float uConeAngleInner;    
-uniform float uConeAngleOuter;    
-uniform vec3 uWindowCenter;       
+// Length of the segment from p along dir, weighted by the profile: its
+// optical depth in units of the base density
+float heightFogDepth(vec3 p, vec3 dir, float len) {
+    return uHeightFog ? len * heightFogMean(p.y, p.y + dir.y * len) : len;
+}
+)";
 
-// Research Toggles
-uniform bool uDither;
-uniform int uShowMapMode; // 0=Normal, 1=Transmission, 2=Depth
+// Uniforms and lighting shared by every program that evaluates fog
+// (FOG_FRAG, VOLUME_FRAG, the froxel compute passes). Prefixed with a
+// GLSL_* version line, FRAME_DATA and HEIGHT_FOG at compile time.
+static const char* FOG_COMMON = R"(
+uniform sampler2D uShadowMap;
 
 // heatmap(Blue -> Green -> Red) ---
 vec3 jet(float t) {
@@ -201,7 +971,11 @@ float attenuate(float dist) {
     return 1.0 / (1.0 + 0.1 * dist + 0.05 * dist * dist);
 }
 
+// Per-sample shadow lookups made by the last march(), for the heatmap
+int gShadowLookups = 0;
+
 float shadowAtPoint(vec3 p) {
+    gShadowLookups++;
     vec4 lp = uLightVP * vec4(p,1.0);
     lp /= lp.w;
     vec2 uv = lp.xy * 0.5 + 0.5;
@@ -211,85 +985,347 @@ float shadowAtPoint(vec3 p) {
     return (sampleDepth - uShadowBias > depthTex) ? 0.0 : 1.0;
 }
 
+// Density multiplier of the heterogeneous fog at p: the baked noise volume
+// (mean 0.5) scrolled by the wind, so the multiplier averages 1
+uniform sampler3D uNoiseVolume;
+
+float fogNoise(vec3 p) {
+    if (uNoiseAmount <= 0.0) return 1.0;
+    float n = textureLod(uNoiseVolume, p * uNoiseScale + uWindOffset, 0.0).r;
+    return max(1.0 + uNoiseAmount * (2.0 * n - 1.0), 0.0);
+}
+
+// Fog density at p relative to uFogDensity: height profile times noise
+float fogDensityAt(vec3 p) {
+    return fogNoise(p) * heightFogProfile(p.y);
+}
+
+float froxelSliceDepth(float slice) {
+    return uFroxelNearFar.x * pow(uFroxelNearFar.y / uFroxelNearFar.x, slice / float(uFroxelSlices));
+}
+
+float froxelSlice(float dist) {
+    return float(uFroxelSlices) * log(max(dist, uFroxelNearFar.x) / uFroxelNearFar.x) / log(uFroxelNearFar.y / uFroxelNearFar.x);
+}
+
+// Spotlight radiance reaching p: cone falloff, distance attenuation, shadow
+// (the shadow lookup is skipped when the caller already knows p is lit)
+vec3 directLightAt(vec3 p, vec3 coneAxis, bool knownLit) {
+    vec3 dirFromLight = normalize(p - uLightPos);
+    float coneDot = dot(dirFromLight, coneAxis);
+    float directLightFactor = smoothstep(uConeAngleOuter, uConeAngleInner, coneDot);
+    if (directLightFactor <= 0.0) return vec3(0.0);
+
+    float vis = knownLit ? 1.0 : shadowAtPoint(p); 
+    float lightDistance = length(uLightPos - p);
+    float atten = attenuate(lightDistance);
+    return uLightColor * uLightPower * atten * directLightFactor * vis;
+}
+
+vec3 directLightAt(vec3 p, vec3 coneAxis) {
+    return directLightAt(p, coneAxis, false);
+}
+
+// Henyey-Greenstein phase, scaled so isotropic scattering is 1 like the
+// march without a phase term
+float hgPhase(float cosTheta, float g) {
+    float d = 1.0 + g * g - 2.0 * g * cosTheta;
+    return (1.0 - g * g) / (d * sqrt(d));
+}
+
+// uPhaseLUT row o holds octave o's weighted dual-lobe phase over
+// sin(theta / 2), which spends the texels on the forward peak. Built by
+// buildPhaseLUT().
+uniform sampler2D uPhaseLUT;
+const float PHASE_LUT_SIZE = 256.0;  // must match PHASE_LUT_SIZE
+const float PHASE_LUT_OCTAVES = 4.0; // must match PHASE_LUT_OCTAVES
+
+// Phase of scattering octave o (0 = single scattering) times its weight;
+// cosTheta is between the light's and the scattered light's direction
+float octavePhase(float cosTheta, int o) {
+    if (PHASE_MODE == 2) {
+        float s = sqrt(clamp(0.5 - 0.5 * cosTheta, 0.0, 1.0));
+        vec2 uv = vec2((0.5 + s * (PHASE_LUT_SIZE - 1.0)) / PHASE_LUT_SIZE, (float(o) + 0.5) / PHASE_LUT_OCTAVES);
+        return textureLod(uPhaseLUT, uv, 0.0).r;
+    }
+    float weight = uOctaveWeight[o];
+    if (PHASE_MODE == 0) return weight;
+    vec2 g = uPhaseG * uOctaveG[o];
+    return weight * mix(hgPhase(cosTheta, g.x), hgPhase(cosTheta, g.y), uPhaseBackBlend);
+}
+
+// All octaves at the same transmittance (the froxel grid integrates a
+// single extinction)
+float scatterPhase(float cosTheta) {
+    float phase = octavePhase(cosTheta, 0);
+    for (int o = 1; o < SCATTER_OCTAVES; ++o) phase += octavePhase(cosTheta, o);
+    return phase;
+}
+)";
+
+// Per-pixel volumetric integrator (fragment stages only: dithers on gl_FragCoord)
+static const char* FOG_MARCH = R"(
+// Part of [0, rayLen] inside the outer spotlight cone (apex uLightPos, axis
+// towards uWindowCenter). The cone is convex, so it is a single interval.
+bool coneInterval(vec3 ro, vec3 rd, float rayLen, vec3 coneAxis, out float tEnter, out float tExit) {
+    // (dot(p - apex, axis))^2 = cos^2 * |p - apex|^2  ->  a t^2 + 2 b t + c = 0
+    vec3 co = ro - uLightPos;
+    float cos2 = uConeAngleOuter * uConeAngleOuter;
+    float dv = dot(rd, coneAxis);
+    float cv = dot(co, coneAxis);
+    float a = dv * dv - cos2;
+    float b = dv * cv - cos2 * dot(rd, co);
+    float c = cv * cv - cos2 * dot(co, co);
+
+    // Roots split the segment into up to three pieces (the double cone
+    // includes the backward nappe, so each piece is tested explicitly)
+    vec4 ts = vec4(0.0, rayLen, rayLen, rayLen);
+    float disc = b * b - a * c;
+    if (abs(a) > 1e-6 && disc > 0.0) {
+        float sq = sqrt(disc);
+        float q0 = (-b - sq) / a, q1 = (-b + sq) / a;
+        ts.y = clamp(min(q0, q1), 0.0, rayLen);
+        ts.z = clamp(max(q0, q1), 0.0, rayLen);
+    } else if (abs(a) <= 1e-6 && abs(b) > 1e-9) {
+        ts.y = ts.z = clamp(-c / (2.0 * b), 0.0, rayLen);
+    }
+
+    tEnter = rayLen;
+    tExit = 0.0;
+    for (int k = 0; k < 3; ++k) {
+        if (ts[k + 1] - ts[k] <= 1e-5) continue;
+        vec3 mid = ro + rd * (0.5 * (ts[k] + ts[k + 1])) - uLightPos;
+        if (dot(mid, coneAxis) > uConeAngleOuter * length(mid)) {
+            tEnter = min(tEnter, ts[k]);
+            tExit = max(tExit, ts[k + 1]);
+        }
+    }
+    return tExit > tEnter;
+}
+
+// Min/max depth chain over uShadowMap; level 0 is half its resolution
+uniform sampler2D uShadowMinMax;
+
+// Samples classified together against the shadow hierarchy
+const int SHADOW_GROUP = 8;
+
+// Shadow state of the whole segment p0-p1: 1 = lit, 0 = shadowed, -1 = mixed
+// (or not provable). Depth along a segment is monotonic in light clip space,
+// so the endpoints bound it; the texel footprint is padded for the bilinear
+// filter of shadowAtPoint().
+int classifyShadowSegment(vec3 p0, vec3 p1) {
+    vec4 c0 = uLightVP * vec4(p0, 1.0);
+    vec4 c1 = uLightVP * vec4(p1, 1.0);
+    if (c0.w <= 0.0 || c1.w <= 0.0) return -1;
+    vec3 n0 = c0.xyz / c0.w * 0.5 + 0.5;
+    vec3 n1 = c1.xyz / c1.w * 0.5 + 0.5;
+    vec2 lo = min(n0.xy, n1.xy), hi = max(n0.xy, n1.xy);
+    if (any(lessThan(lo, vec2(0.0))) || any(greaterThan(hi, vec2(1.0)))) return -1;
+
+    vec2 shadowSize = vec2(textureSize(uShadowMap, 0));
+    ivec2 t0 = ivec2(floor(lo * shadowSize - 0.5));
+    ivec2 t1 = ivec2(floor(hi * shadowSize - 0.5)) + 1;
+    int extent = max(t1.x - t0.x, t1.y - t0.y) + 1;
+
+    // Coarsest needed level: a texel of level L spans 2^(L+1) shadow texels,
+    // so the footprint touches at most 2x2 of them
+    int level = clamp(int(ceil(log2(float(extent)))) - 1, 0, uShadowMinMaxLevels - 1);
+    ivec2 levelMax = textureSize(uShadowMinMax, level) - 1;
+    ivec2 a = clamp(t0 >> (level + 1), ivec2(0), levelMax);
+    ivec2 b = clamp(t1 >> (level + 1), ivec2(0), levelMax);
+    vec2 mm = texelFetch(uShadowMinMax, a, level).rg;
+    vec2 m1 = texelFetch(uShadowMinMax, ivec2(b.x, a.y), level).rg;
+    vec2 m2 = texelFetch(uShadowMinMax, ivec2(a.x, b.y), level).rg;
+    vec2 m3 = texelFetch(uShadowMinMax, b, level).rg;
+    float occluderMin = min(min(mm.r, m1.r), min(m2.r, m3.r));
+    float occluderMax = max(max(mm.g, m1.g), max(m2.g, m3.g));
+
+    float depthMin = min(n0.z, n1.z) - uShadowBias;
+    float depthMax = max(n0.z, n1.z) - uShadowBias;
+    if (depthMax <= occluderMin) return 1;
+    if (depthMin > occluderMax) return 0;
+    return -1;
+}
+
+// Steps taken by the last march() call, for the step-count heatmap
+int gMarchSteps = 0;
+
+// Longest step allowed in optical depth, so dense fog refines the march
+// even when uStepTarget is coarse
+const float MAX_STEP_OPTICAL_DEPTH = 0.25;
+
+int marchStepCount(float segLen) {
+    if (!uAdaptiveSteps) return max(NUM_SAMPLES, 1);
+    float stepLen = min(uStepTarget, MAX_STEP_OPTICAL_DEPTH / max(uFogDensity, 1e-4));
+    int n = int(ceil(segLen / max(stepLen, 1e-4)));
+    return clamp(n, max(uStepRange.x, 1), max(uStepRange.y, 1));
+}
+
 vec3 march(vec3 rayStart, vec3 rayDir, float rayLen) {
-    vec3 scatteredLight = vec3(0.0);
-    float stepSize = rayLen / float(max(uNumSamples,1));
-    float currentAttenuation = 1.0;
     vec3 coneAxis = normalize(uWindowCenter - uLightPos);
 
+    // 1. Ambient Fog (Global Dimmer): constant along the ray, so its
+    //    Beer-Lambert integral is closed form (the height profile's too)
+    vec3 ambientLight = uLightColor * uFogAmbient;
+    vec3 scatteredLight = ambientLight * (1.0 - exp(-uFogDensity * heightFogDepth(rayStart, rayDir, rayLen)));
+
+    // 2. Direct Spotlight: only march where the cone can contribute
+    gMarchSteps = 0;
+    gShadowLookups = 0;
+    float tEnter = 0.0, tExit = rayLen;
+    if (uConeClip && !coneInterval(rayStart, rayDir, rayLen, coneAxis, tEnter, tExit)) {
+        return scatteredLight;
+    }
+    int numSteps = marchStepCount(tExit - tEnter);
+    float stepSize = (tExit - tEnter) / float(numSteps);
+
     // Dither Calculation
     float offset = 0.5;
-    if (uDither) {
-        offset = ign(gl_FragCoord.xy);
+    if (DITHER) {
+        offset = ign(gl_FragCoord.xy + 5.588238 * float(uJitterFrame));
     }
 
-    for (int i = 0; i < uNumSamples; ++i) {
-        if (i >= uNumSamples) break; 
-        
-        float t = stepSize * (float(i) + offset);
-        vec3 p = rayStart + rayDir * t;
-        
-        // 1. Ambient Fog (Global Dimmer)
-        vec3 ambientLight = uLightColor * uFogAmbient;
-        
-        // 2. Direct Spotlight
-        vec3 directLight = vec3(0.0);
-        vec3 dirFromLight = normalize(p - uLightPos);
-        float coneDot = dot(dirFromLight, coneAxis);
-        float directLightFactor = smoothstep(uConeAngleOuter, uConeAngleInner, coneDot);
-
-        if (directLightFactor > 0.0) {
-            float vis = shadowAtPoint(p); 
-            float lightDistance = length(uLightPos - p);
-            float atten = attenuate(lightDistance);
-            directLight = uLightColor * uLightPower * atten * directLightFactor * vis;
-        }
-
-        // 3. Accumulate
-        vec3 totalStepLight = (ambientLight + directLight);
-        float scattering = uFogDensity * stepSize;
-        scatteredLight += totalStepLight * scattering * currentAttenuation;
-        
-        currentAttenuation *= exp(-scattering);
+    // Transmittance at the sample itself, not at the start of its step,
+    // so a jittered offset stays unbiased at low sample counts
+    float viewDepth = uFogDensity * heightFogDepth(rayStart, rayDir, tEnter + stepSize * offset);
+    float currentAttenuation = exp(-viewDepth);
+
+    float scattering = uFogDensity * stepSize;
+    int i = 0;
+    while (i < numSteps) {
+        // Early termination: whatever lies beyond is attenuated to nothing
+        if (uAdaptiveSteps && currentAttenuation < uTransmittanceEps) break;
+
+        // Classify the next group of samples as a whole; per-sample shadow
+        // lookups are only left for groups straddling an occluder edge
+        int groupEnd = min(i + SHADOW_GROUP, numSteps);
+        int groupShadow = -1;
+        if (uShadowHierarchy && groupEnd - i > 1) {
+            vec3 first = rayStart + rayDir * (tEnter + stepSize * (float(i) + offset));
+            vec3 last = rayStart + rayDir * (tEnter + stepSize * (float(groupEnd - 1) + offset));
+            groupShadow = classifyShadowSegment(first, last);
+        }
+        if (groupShadow == 0) {
+            // Fully shadowed: no in-scattering, only extinction. Each
+            // sample's density covers the step after it, so without noise
+            // the group is the segment from its first sample on, in one go
+            float opticalDepth = scattering * float(groupEnd - i);
+            if (uNoiseAmount <= 0.0 && uHeightFog) {
+                vec3 first = rayStart + rayDir * (tEnter + stepSize * (float(i) + offset));
+                opticalDepth = uFogDensity * heightFogDepth(first, rayDir, stepSize * float(groupEnd - i));
+            } else if (uNoiseAmount > 0.0) {
+                opticalDepth = 0.0;
+                for (int k = i; k < groupEnd; ++k) {
+                    opticalDepth += scattering * fogDensityAt(rayStart + rayDir * (tEnter + stepSize * (float(k) + offset)));
+                }
+            }
+            currentAttenuation *= exp(-opticalDepth);
+            viewDepth += opticalDepth;
+            i = groupEnd;
+            gMarchSteps = i;
+            continue;
+        }
+
+        for (; i < groupEnd; ++i) {
+            if (uAdaptiveSteps && currentAttenuation < uTransmittanceEps) break;
+            gMarchSteps = i + 1;
+
+            float t = tEnter + stepSize * (float(i) + offset);
+            vec3 p = rayStart + rayDir * t;
+            vec3 directLight = directLightAt(p, coneAxis, groupShadow == 1);
+            float stepScattering = scattering * fogDensityAt(p);
+
+            // 3. Accumulate: single scattering, then the higher octaves
+            //    through their reduced extinction
+            float cosTheta = PHASE_MODE == 0 ? 1.0 : dot(normalize(p - uLightPos), -rayDir);
+            vec3 inScattered = directLight * stepScattering;
+            scatteredLight += inScattered * currentAttenuation * octavePhase(cosTheta, 0);
+            for (int o = 1; o < SCATTER_OCTAVES; ++o) {
+                scatteredLight += inScattered * exp(-uOctaveExtinction[o] * viewDepth) * octavePhase(cosTheta, o);
+            }
+
+            currentAttenuation *= exp(-stepScattering);
+            viewDepth += stepScattering;
+        }
+        if (i < groupEnd) break;
     }
     return scatteredLight;
 }
+)";
+
+static const char* FOG_FRAG = R"(
+out vec4 FragColor;
+in vec3 vPos;
+in vec3 vNormal;
+
+// Froxel engine: fog is a single fetch from the integrated grid
+uniform sampler3D uFroxelVolume;
 
 void main() {
     // 1. Surface Lighting (Ambient term increases with global dimmer)
-    vec3 ambient = (0.1 + uFogAmbient) * uColor; 
+    vec3 albedo = objectColor(vDrawID);
+    vec3 ambient = (0.1 + uFogAmbient) * albedo; 
     vec3 norm = normalize(vNormal);
     vec3 lightDir = normalize(uLightPos - vPos);
     float diff = max(dot(norm, lightDir), 0.0);
-    vec3 diffuse = diff * uLightColor * uColor;
+    vec3 diffuse = diff * uLightColor * albedo;
     vec3 surfaceColor = ambient + diffuse;
 
+    if (DEFERRED_FOG && SHOW_MAP_MODE == 0) {
+        FragColor = vec4(surfaceColor, 1.0);
+        return;
+    }
+
     // 2. Volumetric Pass
     vec3 rd = normalize(vPos - uViewPos);
     float rayLen = length(vPos - uViewPos); // 'd(x)'
-    vec3 fog = march(uViewPos, rd, rayLen);
+    vec3 fog;
+    if (SHOW_MAP_MODE >= 3) {
+        // The heatmaps always measure the per-fragment march
+        fog = march(uViewPos, rd, rayLen);
+    } else if (FOG_MODE == 1) {
+        // Slice z holds the integral up to its far boundary, i.e. slice z + 1
+        float slice = froxelSlice(rayLen);
+        vec3 coord = vec3(gl_FragCoord.xy / uScreenSize, (slice - 0.5) / float(uFroxelSlices));
+        fog = texture(uFroxelVolume, coord).rgb * clamp(slice, 0.0, 1.0);
+    } else {
+        fog = DEFERRED_FOG ? vec3(0.0) : march(uViewPos, rd, rayLen);
+    }
 
     // 3. Transmission 't(x)'
-    float transmission = exp(-rayLen * uExtinction);
+    float transmission = exp(-uExtinction * heightFogDepth(uViewPos, rd, rayLen));
 
     // 4. Composite
     vec3 finalColor = surfaceColor * transmission + fog;
     
     // --- VISUALIZATION OUTPUT ---
-    if (uShowMapMode == 1) {
+    if (SHOW_MAP_MODE == 1) {
         // [TRANSMISSION MAP]
         // Stretch contrast using smoothstep to make cubes clearly visible vs walls
         // Low threshold 0.4, High threshold 1.0
         float contrastT = smoothstep(0.4, 1.0, transmission); 
         FragColor = vec4(vec3(contrastT), 1.0);
     } 
-    else if (uShowMapMode == 2) {
+    else if (SHOW_MAP_MODE == 2) {
         // [DEPTH MAP]
         // Rainbow Heatmap Visualization
         float normalizedDepth = clamp(rayLen / 15.0, 0.0, 1.0);
         vec3 heatmap = jet(normalizedDepth);
         FragColor = vec4(heatmap, 1.0);
     } 
+    else if (SHOW_MAP_MODE == 3) {
+        // [STEP COUNT MAP]
+        // Scaled to the fixed budget (NUM_SAMPLES = red), so the adaptive
+        // savings read directly; black = ray missed the cone
+        float normalizedSteps = clamp(float(gMarchSteps) / float(max(NUM_SAMPLES, 1)), 0.0, 1.0);
+        FragColor = vec4(gMarchSteps == 0 ? vec3(0.0) : jet(normalizedSteps), 1.0);
+    }
+    else if (SHOW_MAP_MODE == 4) {
+        // [SHADOW LOOKUP MAP]
+        // Same scale; with the min/max hierarchy only occluder edges light up
+        float normalizedLookups = clamp(float(gShadowLookups) / float(max(NUM_SAMPLES, 1)), 0.0, 1.0);
+        FragColor = vec4(gShadowLookups == 0 ? vec3(0.0) : jet(normalizedLookups), 1.0);
+    }
     else {
         // Normal Mode
         FragColor = vec4(finalColor, 1.0);
@@ -297,189 +1333,4819 @@ void main() {
 }
 )";
 
-struct Mesh {
-    GLuint vao = 0; 
-    GLuint vbo = 0; 
-    GLsizei count = 0; 
-    GLenum mode = GL_TRIANGLES; 
-};
+// Froxel engine, pass 1: in-scattered light and extinction at each froxel
+// centre. rgb = radiance * scattering coefficient, a = extinction.
+static const char* FROXEL_INJECT_COMP = R"(
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
+layout(rgba16f, binding = 0) uniform writeonly image3D uScatterOut;
 
-static Mesh makeMesh(const vector<float>& verts, GLenum mode = GL_TRIANGLES) {
-    Mesh m;
-    m.count = (GLsizei)(verts.size() / 6); 
-    m.mode = mode; 
-    glGenVertexArrays(1, &m.vao);
-    glBindVertexArray(m.vao);
-    glGenBuffers(1, &m.vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, m.vbo);
-    glBufferData(GL_ARRAY_BUFFER, verts.size() * sizeof(float), verts.data(), GL_STATIC_DRAW);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
-    glBindVertexArray(0);
-    return m;
-}
+void main() {
+    ivec3 size = imageSize(uScatterOut);
+    ivec3 id = ivec3(gl_GlobalInvocationID);
+    if (any(greaterThanEqual(id, size))) return;
 
-static Mesh makeCube() {
-    vector<float> v = {
-         0.5f, -0.5f, -0.5f, 1,0,0,  0.5f,  0.5f, -0.5f, 1,0,0,  0.5f,  0.5f,  0.5f, 1,0,0,
-         0.5f, -0.5f, -0.5f, 1,0,0,  0.5f,  0.5f,  0.5f, 1,0,0,  0.5f, -0.5f,  0.5f, 1,0,0,
-        -0.5f, -0.5f,  0.5f, -1,0,0, -0.5f,  0.5f,  0.5f, -1,0,0, -0.5f,  0.5f, -0.5f, -1,0,0,
-        -0.5f, -0.5f,  0.5f, -1,0,0, -0.5f,  0.5f, -0.5f, -1,0,0, -0.5f, -0.5f, -0.5f, -1,0,0,
-        -0.5f, 0.5f, -0.5f, 0,1,0,   0.5f, 0.5f, -0.5f, 0,1,0,   0.5f, 0.5f,  0.5f, 0,1,0,
-        -0.5f, 0.5f, -0.5f, 0,1,0,   0.5f, 0.5f,  0.5f, 0,1,0,  -0.5f, 0.5f,  0.5f, 0,1,0,
-        -0.5f, -0.5f,  0.5f, 0,-1,0,  0.5f, -0.5f,  0.5f, 0,-1,0,  0.5f, -0.5f, -0.5f, 0,-1,0,
-        -0.5f, -0.5f,  0.5f, 0,-1,0,  0.5f, -0.5f, -0.5f, 0,-1,0, -0.5f, -0.5f, -0.5f, 0,-1,0,
-        -0.5f, -0.5f, 0.5f, 0,0,1,    0.5f, -0.5f, 0.5f, 0,0,1,    0.5f,  0.5f, 0.5f, 0,0,1,
-        -0.5f, -0.5f, 0.5f, 0,0,1,    0.5f,  0.5f, 0.5f, 0,0,1,   -0.5f,  0.5f, 0.5f, 0,0,1,
-         0.5f, -0.5f,-0.5f, 0,0,-1,  -0.5f, -0.5f,-0.5f, 0,0,-1,  -0.5f,  0.5f,-0.5f, 0,0,-1,
-         0.5f, -0.5f,-0.5f, 0,0,-1,  -0.5f,  0.5f,-0.5f, 0,0,-1,   0.5f,  0.5f,-0.5f, 0,0,-1
-    };
-    return makeMesh(v);
-}
+    vec2 uv = (vec2(id.xy) + 0.5) / vec2(size.xy);
+    vec4 farPoint = uInvViewProj * vec4(uv * 2.0 - 1.0, 1.0, 1.0);
+    vec3 rayDir = normalize(farPoint.xyz / farPoint.w - uViewPos);
+    vec3 p = uViewPos + rayDir * froxelSliceDepth(float(id.z) + 0.5);
 
-int main() {
-    if (!glfwInit()) { cerr << "Failed to init GLFW\n"; return -1; }
+    vec3 coneAxis = normalize(uWindowCenter - uLightPos);
+    float cosTheta = dot(normalize(p - uLightPos), -rayDir);
+    vec3 light = uLightColor * uFogAmbient + directLightAt(p, coneAxis) * scatterPhase(cosTheta);
+    float density = uFogDensity * fogDensityAt(p);
+    imageStore(uScatterOut, id, vec4(light * density, density));
+}
+)";
+
+// Froxel engine, pass 2: front-to-back integration along each froxel column.
+// rgb = scattered light reaching the eye, a = transmittance, both at the far
+// boundary of the slice.
+static const char* FROXEL_INTEGRATE_COMP = R"(
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
+layout(rgba16f, binding = 0) uniform readonly image3D uScatterIn;
+layout(rgba16f, binding = 1) uniform writeonly image3D uIntegratedOut;
+
+void main() {
+    ivec3 size = imageSize(uScatterIn);
+    ivec2 xy = ivec2(gl_GlobalInvocationID.xy);
+    if (any(greaterThanEqual(xy, size.xy))) return;
+
+    vec3 scattered = vec3(0.0);
+    float transmittance = 1.0;
+    float sliceStart = 0.0;
+    for (int z = 0; z < size.z; ++z) {
+        vec4 s = imageLoad(uScatterIn, ivec3(xy, z));
+        float sliceEnd = froxelSliceDepth(float(z + 1));
+        float dt = sliceEnd - sliceStart;
+        sliceStart = sliceEnd;
+
+        // Integrate over the slice instead of point-sampling it
+        float sliceTransmittance = exp(-s.a * dt);
+        vec3 sliceLight = s.a > 0.0 ? s.rgb * (1.0 - sliceTransmittance) / s.a : s.rgb * dt;
+        scattered += transmittance * sliceLight;
+        transmittance *= sliceTransmittance;
+        imageStore(uIntegratedOut, ivec3(xy, z), vec4(scattered, transmittance));
+    }
+}
+)";
+
+// Fullscreen triangle, no vertex buffer needed
+static const char* FULLSCREEN_VERT = R"(#version 410 core
+out vec2 vUV;
+void main(){
+    vec2 p = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    vUV = p;
+    gl_Position = vec4(p * 2.0 - 1.0, 0.0, 1.0);
+}
+)";
+
+// Reduced-resolution march. Each low-res texel marches towards the scene
+// depth of one representative full-res texel; VOLUME_COMPOSITE_FRAG looks
+// up the same texel when it weights the upsample.
+static const char* VOLUME_FRAG = R"(
+out vec4 FragColor;
+
+uniform sampler2D uSceneDepth;
+uniform int uDownsample;
+
+void main() {
+    ivec2 fullSize = textureSize(uSceneDepth, 0);
+    ivec2 rep = min(ivec2(gl_FragCoord.xy) * uDownsample + uDownsample / 2, fullSize - 1);
+    float depth = texelFetch(uSceneDepth, rep, 0).r;
+    if (depth >= 1.0) { FragColor = vec4(0.0); return; }
+
+    vec2 uv = (vec2(rep) + 0.5) / vec2(fullSize);
+    vec4 world = uInvViewProj * vec4(uv * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+    world /= world.w;
+    vec3 toSurface = world.xyz - uViewPos;
+    float rayLen = length(toSurface);
+    FragColor = vec4(march(uViewPos, toSurface / rayLen, rayLen), 1.0);
+}
+)";
+
+// Blends this frame's march into the reprojected history. Runs at volume
+// resolution; history is clamped to the 3x3 neighbourhood of the current
+// frame so stale light (moved shafts, disocclusions) cannot linger.
+static const char* TEMPORAL_FRAG = R"(#version 410 core
+out vec4 FragColor;
+
+uniform sampler2D uCurrent;
+uniform sampler2D uHistory;
+uniform sampler2D uSceneDepth;
+uniform mat4 uInvViewProj;
+uniform mat4 uPrevViewProj;
+uniform int uDownsample;
+uniform float uBlend; // 1 = ignore history
+
+void main() {
+    ivec2 q = ivec2(gl_FragCoord.xy);
+    ivec2 lowSize = textureSize(uCurrent, 0);
+    vec3 current = texelFetch(uCurrent, q, 0).rgb;
+    vec3 lo = current, hi = current;
+    for (int j = -1; j <= 1; ++j) {
+        for (int i = -1; i <= 1; ++i) {
+            vec3 v = texelFetch(uCurrent, clamp(q + ivec2(i, j), ivec2(0), lowSize - 1), 0).rgb;
+            lo = min(lo, v);
+            hi = max(hi, v);
+        }
+    }
+    if (uBlend >= 1.0) { FragColor = vec4(current, 1.0); return; }
+
+    // Reproject the representative full-res texel with last frame's matrices
+    ivec2 fullSize = textureSize(uSceneDepth, 0);
+    ivec2 rep = min(q * uDownsample + uDownsample / 2, fullSize - 1);
+    float depth = texelFetch(uSceneDepth, rep, 0).r;
+    vec2 uv = (vec2(rep) + 0.5) / vec2(fullSize);
+    vec4 world = uInvViewProj * vec4(uv * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+    world /= world.w;
+    vec4 prevClip = uPrevViewProj * world;
+    vec2 prevUV = prevClip.xy / prevClip.w * 0.5 + 0.5;
+    if (prevClip.w <= 0.0 || any(lessThan(prevUV, vec2(0.0))) || any(greaterThan(prevUV, vec2(1.0)))) {
+        FragColor = vec4(current, 1.0);
+        return;
+    }
+
+    // Full-res pixel position -> low-res texel space (inverse of 'rep')
+    vec2 lowPos = (prevUV * vec2(fullSize) - 0.5 - float(uDownsample / 2)) / float(uDownsample);
+    vec3 history = texture(uHistory, (lowPos + 0.5) / vec2(lowSize)).rgb;
+    history = clamp(history, lo, hi);
+    FragColor = vec4(mix(history, current, uBlend), 1.0);
+}
+)";
+
+// Depth-aware upsample of the volume target over the lit surfaces
+static const char* VOLUME_COMPOSITE_FRAG = R"(
+out vec4 FragColor;
+in vec2 vUV;
+
+uniform sampler2D uSceneColor;
+uniform sampler2D uSceneDepth;
+uniform sampler2D uVolume;
+uniform int uDownsample;
+uniform vec2 uNearFar;
+
+float linearDepth(float d) {
+    float z = d * 2.0 - 1.0;
+    return 2.0 * uNearFar.x * uNearFar.y / (uNearFar.y + uNearFar.x - z * (uNearFar.y - uNearFar.x));
+}
+
+void main() {
+    ivec2 pix = ivec2(gl_FragCoord.xy);
+    vec4 scene = texelFetch(uSceneColor, pix, 0);
+    float depth = texelFetch(uSceneDepth, pix, 0).r;
+    gl_FragDepth = depth;
+    if (depth >= 1.0 || uShowMapMode != 0) { FragColor = scene; return; }
+
+    vec4 world = uInvViewProj * vec4(vUV * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+    world /= world.w;
+    float rayLen = length(world.xyz - uViewPos);
+    float transmission = exp(-uExtinction * heightFogDepth(uViewPos, (world.xyz - uViewPos) / rayLen, rayLen));
+
+    // Bilinear weights, scaled down for low-res texels from another surface
+    ivec2 fullSize = textureSize(uSceneDepth, 0);
+    ivec2 lowSize = textureSize(uVolume, 0);
+    vec2 lowPos = gl_FragCoord.xy / float(uDownsample) - 0.5;
+    ivec2 base = ivec2(floor(lowPos));
+    vec2 f = lowPos - vec2(base);
+    float zCenter = linearDepth(depth);
+
+    vec3 fog = vec3(0.0);
+    float weightSum = 0.0;
+    vec3 nearestFog = vec3(0.0);
+    float nearestDelta = 1e30;
+    for (int j = 0; j < 2; ++j) {
+        for (int i = 0; i < 2; ++i) {
+            ivec2 q = clamp(base + ivec2(i, j), ivec2(0), lowSize - 1);
+            ivec2 rep = min(q * uDownsample + uDownsample / 2, fullSize - 1);
+            float delta = abs(linearDepth(texelFetch(uSceneDepth, rep, 0).r) - zCenter);
+            vec3 v = texelFetch(uVolume, q, 0).rgb;
+            float w = (i == 0 ? 1.0 - f.x : f.x) * (j == 0 ? 1.0 - f.y : f.y);
+            w *= 1.0 / (1e-3 + delta);
+            fog += v * w;
+            weightSum += w;
+            if (delta < nearestDelta) { nearestDelta = delta; nearestFog = v; }
+        }
+    }
+    // Every neighbour is across an edge: take the closest in depth
+    fog = (nearestDelta > 0.1 * zCenter || weightSum <= 0.0) ? nearestFog : fog / weightSum;
+
+    FragColor = vec4(scene.rgb * transmission + fog, 1.0);
+}
+)";
+
+// Epipolar sampling: uEpiLines lines run from the light's screen position
+// (uEpiLight, pixels) to points spread evenly around the screen border, with
+// uEpiSamples samples each. Shafts and shadow edges radiate from the light,
+// so along a line the in-scattering only jumps at depth discontinuities.
+static const char* EPIPOLAR_COMMON = R"(
+uniform vec2 uEpiLight;
+uniform vec2 uEpiScreen;
+uniform int uEpiLines;
+uniform int uEpiSamples;
+
+// Keeps the sign of d but never divides by zero
+vec2 epiSafeDir(vec2 d) {
+    return vec2(d.x >= 0.0 ? max(d.x, 1e-6) : min(d.x, -1e-6),
+                d.y >= 0.0 ? max(d.y, 1e-6) : min(d.y, -1e-6));
+}
+
+// Border point at perimeter distance s, counter-clockwise from (0, 0)
+vec2 epiBorderPoint(float s) {
+    float W = uEpiScreen.x, H = uEpiScreen.y;
+    s = mod(s, 2.0 * (W + H));
+    if (s < W) return vec2(s, 0.0);
+    s -= W;
+    if (s < H) return vec2(W, s);
+    s -= H;
+    if (s < W) return vec2(W - s, H);
+    return vec2(0.0, H - (s - W));
+}
+
+float epiBorderParam(vec2 e) {
+    float W = uEpiScreen.x, H = uEpiScreen.y;
+    e = clamp(e, vec2(0.0), uEpiScreen);
+    vec4 dist = vec4(e.y, W - e.x, H - e.y, e.x);
+    float m = min(min(dist.x, dist.y), min(dist.z, dist.w));
+    if (m == dist.x) return e.x;
+    if (m == dist.y) return W + e.y;
+    if (m == dist.z) return W + H + (W - e.x);
+    return 2.0 * W + H + (H - e.y);
+}
+
+// On-screen part of a line: from the light (or where the line enters the
+// screen when the light is off it) to the border
+void epiLineSegment(int line, out vec2 a, out vec2 b) {
+    float perimeter = 2.0 * (uEpiScreen.x + uEpiScreen.y);
+    b = epiBorderPoint((float(line) + 0.5) * perimeter / float(uEpiLines));
+    a = uEpiLight;
+    vec2 d = epiSafeDir(b - a);
+    vec2 t0 = -a / d, t1 = (uEpiScreen - a) / d;
+    float tIn = max(max(min(t0.x, t1.x), min(t0.y, t1.y)), 0.0);
+    a += (b - a) * min(tIn, 1.0);
+}
+
+// Fractional line index through pixel p
+float epiLineOf(vec2 p) {
+    vec2 d = epiSafeDir(p - uEpiLight);
+    vec2 edge = mix(vec2(0.0), uEpiScreen, greaterThan(d, vec2(0.0)));
+    vec2 tb = (edge - p) / d;
+    vec2 e = p + d * max(min(tb.x, tb.y), 0.0);
+    float perimeter = 2.0 * (uEpiScreen.x + uEpiScreen.y);
+    return epiBorderParam(e) / perimeter * float(uEpiLines) - 0.5;
+}
+)";
+
+// Epipolar pass 1: screen pixel (xy), scene depth (z) and ray length (w) of
+// every epipolar sample. Texture is uEpiSamples x uEpiLines.
+static const char* EPIPOLAR_COORD_FRAG = R"(
+out vec4 FragColor;
+
+uniform sampler2D uSceneDepth;
+uniform mat4 uInvViewProj;
+uniform vec3 uViewPos;
+
+void main() {
+    vec2 a, b;
+    epiLineSegment(int(gl_FragCoord.y), a, b);
+    vec2 p = mix(a, b, floor(gl_FragCoord.x) / float(uEpiSamples - 1));
+    ivec2 pix = clamp(ivec2(p), ivec2(0), ivec2(uEpiScreen) - 1);
+    float depth = texelFetch(uSceneDepth, pix, 0).r;
+
+    // Sky: no fog, and far enough to count as a depth break
+    float rayLen = 1e4;
+    if (depth < 1.0) {
+        vec2 uv = (vec2(pix) + 0.5) / uEpiScreen;
+        vec4 world = uInvViewProj * vec4(uv * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+        rayLen = length(world.xyz / world.w - uViewPos);
+    }
+    FragColor = vec4(vec2(pix), depth, rayLen);
+}
+)";
+
+// Epipolar pass 2: march every uEpiStep-th sample, the line's last sample
+// and both sides of each depth break. Alpha flags the marched samples.
+static const char* EPIPOLAR_MARCH_FRAG = R"(
+out vec4 FragColor;
+
+uniform sampler2D uEpiCoords;
+uniform int uEpiStep;
+uniform float uEpiDepthBreak; // relative ray-length jump
+
+bool epiDepthBreak(float a, float b) {
+    return abs(a - b) > uEpiDepthBreak * min(a, b);
+}
+
+void main() {
+    ivec2 q = ivec2(gl_FragCoord.xy);
+    int last = uEpiSamples - 1;
+    vec4 c = texelFetch(uEpiCoords, q, 0);
+    float prevLen = texelFetch(uEpiCoords, ivec2(max(q.x - 1, 0), q.y), 0).w;
+    float nextLen = texelFetch(uEpiCoords, ivec2(min(q.x + 1, last), q.y), 0).w;
+    bool marched = q.x % uEpiStep == 0 || q.x == last ||
+                   epiDepthBreak(c.w, prevLen) || epiDepthBreak(c.w, nextLen);
+    if (!marched) { FragColor = vec4(0.0); return; }
+    if (c.z >= 1.0) { FragColor = vec4(0.0, 0.0, 0.0, 1.0); return; }
+
+    vec2 uv = (c.xy + 0.5) / uEpiScreen;
+    vec4 world = uInvViewProj * vec4(uv * 2.0 - 1.0, c.z * 2.0 - 1.0, 1.0);
+    vec3 toSurface = world.xyz / world.w - uViewPos;
+    float rayLen = length(toSurface);
+    FragColor = vec4(march(uViewPos, toSurface / rayLen, rayLen), 1.0);
+}
+)";
+
+// Epipolar pass 3: fill the unmarched samples from the marched ones on
+// either side. Depth breaks are marched on both sides, so the bracketing
+// pair always lies on one surface.
+static const char* EPIPOLAR_INTERP_FRAG = R"(#version 410 core
+out vec4 FragColor;
+
+uniform sampler2D uEpiScatter;
+uniform int uEpiStep;
+
+void main() {
+    ivec2 q = ivec2(gl_FragCoord.xy);
+    vec4 v = texelFetch(uEpiScatter, q, 0);
+    if (v.a > 0.0) { FragColor = vec4(v.rgb, 1.0); return; }
+
+    int last = textureSize(uEpiScatter, 0).x - 1;
+    int i0 = q.x, i1 = q.x;
+    vec3 v0 = vec3(0.0), v1 = vec3(0.0);
+    for (int k = 1; k <= uEpiStep; ++k) {
+        vec4 s = texelFetch(uEpiScatter, ivec2(max(q.x - k, 0), q.y), 0);
+        if (s.a > 0.0) { i0 = q.x - k; v0 = s.rgb; break; }
+    }
+    for (int k = 1; k <= uEpiStep; ++k) {
+        vec4 s = texelFetch(uEpiScatter, ivec2(min(q.x + k, last), q.y), 0);
+        if (s.a > 0.0) { i1 = q.x + k; v1 = s.rgb; break; }
+    }
+    float f = float(q.x - i0) / float(max(i1 - i0, 1));
+    FragColor = vec4(mix(v0, v1, f), 1.0);
+}
+)";
+
+// Epipolar pass 4: unwarp to the screen. Each pixel blends the two nearest
+// lines at its projected position, dropping taps from another surface; a
+// pixel with no usable tap (thin geometry between lines) is marched here.
+static const char* EPIPOLAR_COMPOSITE_FRAG = R"(
+out vec4 FragColor;
+in vec2 vUV;
+
+uniform sampler2D uSceneColor;
+uniform sampler2D uSceneDepth;
+uniform sampler2D uEpiCoords;
+uniform sampler2D uEpiFog;
+uniform float uEpiDepthBreak;
+
+void main() {
+    ivec2 pix = ivec2(gl_FragCoord.xy);
+    vec4 scene = texelFetch(uSceneColor, pix, 0);
+    float depth = texelFetch(uSceneDepth, pix, 0).r;
+    gl_FragDepth = depth;
+    if (depth >= 1.0 || SHOW_MAP_MODE != 0) { FragColor = scene; return; }
+
+    vec4 world = uInvViewProj * vec4(vUV * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+    vec3 toSurface = world.xyz / world.w - uViewPos;
+    float rayLen = length(toSurface);
+    float transmission = exp(-uExtinction * heightFogDepth(uViewPos, toSurface / rayLen, rayLen));
+
+    vec2 p = gl_FragCoord.xy;
+    float lineF = epiLineOf(p);
+    int l0 = int(floor(lineF));
+    float f = lineF - float(l0);
+
+    vec3 fog = vec3(0.0);
+    float weightSum = 0.0;
+    for (int j = 0; j < 2; ++j) {
+        int line = ((l0 + j) % uEpiLines + uEpiLines) % uEpiLines;
+        vec2 a, b;
+        epiLineSegment(line, a, b);
+        vec2 ab = b - a;
+        float t = clamp(dot(p - a, ab) / max(dot(ab, ab), 1e-6), 0.0, 1.0);
+        float sf = t * float(uEpiSamples - 1);
+        int s0 = min(int(sf), uEpiSamples - 2);
+        float g = sf - float(s0);
+        for (int i = 0; i < 2; ++i) {
+            ivec2 q = ivec2(s0 + i, line);
+            float tapLen = texelFetch(uEpiCoords, q, 0).w;
+            if (abs(tapLen - rayLen) > uEpiDepthBreak * rayLen) continue;
+            float w = (j == 0 ? 1.0 - f : f) * (i == 0 ? 1.0 - g : g) + 1e-4;
+            fog += texelFetch(uEpiFog, q, 0).rgb * w;
+            weightSum += w;
+        }
+    }
+    fog = weightSum > 0.0 ? fog / weightSum : march(uViewPos, toSurface / rayLen, rayLen);
+
+    FragColor = vec4(scene.rgb * transmission + fog, 1.0);
+}
+)";
+
+// Profiler overlay: the text bitmap over a dark panel. Rows are uploaded
+// top first, so v is flipped.
+static const char* OVERLAY_FRAG = R"(#version 410 core
+in vec2 vUV;
+out vec4 FragColor;
+uniform sampler2D uText;
+void main() {
+    float ink = texture(uText, vec2(vUV.x, 1.0 - vUV.y)).r;
+    FragColor = mix(vec4(0.0, 0.0, 0.0, 0.65), vec4(1.0, 1.0, 0.75, 1.0), ink);
+}
+)";
+
+// Terrain view: shadertoy.glsl's terrain, ray cast through the streamed
+// heightfield's max-mip quadtree (see TerrainMap) or, for comparison, with
+// its original fixed-step march. Lit and fogged as in shadertoy.glsl, with
+// the baked noise volume standing in for its fbm().
+static const char* TERRAIN_FRAG = R"(
+in vec2 vUV;
+out vec4 FragColor;
+
+uniform sampler2DArray uTerrainHeights; // per pool slot, TERRAIN_TILE + 1 samples square
+uniform sampler2DArray uTerrainMaxima;  // per pool slot, in-tile max levels as mips
+uniform isampler2D uTerrainPages;       // per map tile, its pool slot or -1
+uniform sampler2D uTerrainCoarse;       // per-tile max levels as mips
+uniform sampler3D uNoiseVolume;
+uniform int uTerrainTraversal;          // 0 = fixed-step march, 1 = quadtree
+
+// must match the C++ TERRAIN_* constants
+const int TERRAIN_TILE = 64;
+const int TERRAIN_TILE_LEVELS = 6;
+const int TERRAIN_MAP_TILES = 256;
+const int TERRAIN_TOP_LEVEL = 14;
+const int TERRAIN_MAX_STEPS = 256;
+const float TERRAIN_SPACING = 1.0 / 16.0;
+const float TERRAIN_ORIGIN = -512.0;
+const float TERRAIN_MAX_HEIGHT = 2.0;
+const float TERRAIN_FAR = 20.0;
+
+const vec3 FOG_NEAR = vec3(0.6, 0.8, 1.0);
+const vec3 FOG_FAR = vec3(0.8, 0.9, 1.0);
+const float FOG_DENSITY = 0.7;
+const float FOG_HEIGHT_FALLOFF = 2.8;
+const vec3 LIGHT_DIR = vec3(0.70710678, 0.70710678, 0.0);
+
+int gSteps = 0;
+
+vec3 jet(float t) {
+    return clamp(vec3(1.5) - abs(4.0 * vec3(t) + vec3(-3, -2, -1)), 0.0, 1.0);
+}
+
+float terrainHeight(vec2 p) {
+    return clamp(sin(p.x * 2.0) * sin(p.y) + sin(p.x) * sin(p.y * 0.5), 0.0, 2.0);
+}
+
+// Analytic gradient; flat where the height is clamped
+vec3 terrainNormal(vec2 p) {
+    float h = sin(p.x * 2.0) * sin(p.y) + sin(p.x) * sin(p.y * 0.5);
+    if (h <= 0.0 || h >= 2.0) return vec3(0.0, 1.0, 0.0);
+    float dx = 2.0 * cos(p.x * 2.0) * sin(p.y) + cos(p.x) * sin(p.y * 0.5);
+    float dz = sin(p.x * 2.0) * cos(p.y) + 0.5 * sin(p.x) * cos(p.y * 0.5);
+    return normalize(vec3(-dx, 1.0, -dz));
+}
+
+// shadertoy.glsl's castray(): fixed steps, interpolated at the crossing
+float castLinear(vec3 ro, vec3 rd, float tMin, float tMax, float stepSize) {
+    float prevHeight = 0.0, prevY = 0.0;
+    for (float t = tMin; t < tMax; t += stepSize) {
+        gSteps++;
+        vec3 p = ro + rd * t;
+        float h = terrainHeight(p.xz);
+        if (p.y < h) return t - stepSize + stepSize * (prevHeight - prevY) / (p.y - h + prevHeight - prevY);
+        prevHeight = h;
+        prevY = p.y;
+    }
+    return tMax;
+}
+
+// Highest height in a cell of the given level; -1 where the tile is not
+// resident, so rays pass through
+float terrainCellMax(int level, ivec2 cell) {
+    if (level > TERRAIN_TILE_LEVELS) return texelFetch(uTerrainCoarse, cell, level - TERRAIN_TILE_LEVELS).r;
+    ivec2 tile = cell >> (TERRAIN_TILE_LEVELS - level);
+    int slot = texelFetch(uTerrainPages, tile, 0).r;
+    if (slot < 0) return -1.0;
+    if (level == TERRAIN_TILE_LEVELS) return texelFetch(uTerrainCoarse, cell, 0).r;
+    ivec2 local = cell & ((TERRAIN_TILE >> level) - 1);
+    return texelFetch(uTerrainMaxima, ivec3(local, slot), level).r;
+}
+
+// First t in [tA, tB] where the ray meets the bilinear patch of a level 0
+// cell: along the ray the patch height is quadratic in t
+float hitPatch(vec3 ro, vec3 rd, ivec2 cell, float tA, float tB) {
+    ivec2 tile = cell / TERRAIN_TILE;
+    int slot = texelFetch(uTerrainPages, tile, 0).r;
+    ivec2 s = cell - tile * TERRAIN_TILE;
+    float h00 = texelFetch(uTerrainHeights, ivec3(s, slot), 0).r;
+    float h10 = texelFetch(uTerrainHeights, ivec3(s + ivec2(1, 0), slot), 0).r;
+    float h01 = texelFetch(uTerrainHeights, ivec3(s + ivec2(0, 1), slot), 0).r;
+    float h11 = texelFetch(uTerrainHeights, ivec3(s + ivec2(1, 1), slot), 0).r;
+
+    vec3 p = ro + rd * tA;
+    vec2 uv = (p.xz - (TERRAIN_ORIGIN + vec2(cell) * TERRAIN_SPACING)) / TERRAIN_SPACING;
+    vec2 duv = rd.xz / TERRAIN_SPACING;
+    float e1 = h10 - h00, e2 = h01 - h00, e3 = h00 - h10 - h01 + h11;
+    float a = -e3 * duv.x * duv.y;
+    float b = rd.y - e1 * duv.x - e2 * duv.y - e3 * (uv.x * duv.y + uv.y * duv.x);
+    float c = p.y - h00 - e1 * uv.x - e2 * uv.y - e3 * uv.x * uv.y;
+    if (c <= 0.0) return tA;
+    float span = tB - tA, tau = -1.0;
+    if (abs(a) < 1e-7) {
+        if (b < 0.0) tau = -c / b;
+    } else {
+        float disc = b * b - 4.0 * a * c;
+        if (disc >= 0.0) {
+            float q = -0.5 * (b + (b < 0.0 ? -sqrt(disc) : sqrt(disc)));
+            float r1 = q / a, r2 = q != 0.0 ? c / q : -1.0;
+            tau = min(r1 >= 0.0 ? r1 : 1e30, r2 >= 0.0 ? r2 : 1e30);
+        }
+    }
+    return tau >= 0.0 && tau <= span ? tA + tau : -1.0;
+}
+
+// Quadtree traversal. The current cell is tracked as integers: a ray that
+// passes above a cell moves to its neighbour, and up a level when that
+// leaves the parent; one that may dip below the cell's maximum descends
+// into the child it is in at that point.
+float castQuadtree(vec3 ro, vec3 rd, float tMin, float tMax) {
+    // The map's box, up to TERRAIN_MAX_HEIGHT. Its floor sits below the
+    // lowest height so that hits on flat ground are not clipped by rounding.
+    float size = float(TERRAIN_MAP_TILES * TERRAIN_TILE) * TERRAIN_SPACING;
+    vec3 boxMin = vec3(TERRAIN_ORIGIN, -1.0, TERRAIN_ORIGIN), boxMax = vec3(TERRAIN_ORIGIN + size, TERRAIN_MAX_HEIGHT, TERRAIN_ORIGIN + size);
+    vec3 inv = 1.0 / rd;
+    vec3 ta = (boxMin - ro) * inv, tb = (boxMax - ro) * inv;
+    vec3 tNear = min(ta, tb), tFar = max(ta, tb);
+    float t = max(tMin, max(max(tNear.x, tNear.y), tNear.z));
+    float tEnd = min(tMax, min(min(tFar.x, tFar.y), tFar.z));
+    if (t >= tEnd) return tMax;
+
+    int level = TERRAIN_TOP_LEVEL;
+    ivec2 cell = ivec2(0);
+    ivec2 dir = ivec2(rd.x >= 0.0 ? 1 : -1, rd.z >= 0.0 ? 1 : -1);
+    while (t < tEnd && gSteps < TERRAIN_MAX_STEPS) {
+        gSteps++;
+        float cellSize = TERRAIN_SPACING * float(1 << level);
+        vec2 lo = TERRAIN_ORIGIN + vec2(cell) * cellSize;
+        vec2 exits = (lo + cellSize * vec2(greaterThanEqual(rd.xz, vec2(0.0))) - ro.xz) * inv.xz;
+        float tExit = min(min(exits.x, exits.y), tEnd);
+        float hMax = terrainCellMax(level, cell);
+        float yIn = ro.y + rd.y * t, yOut = ro.y + rd.y * tExit;
+        if (min(yIn, yOut) <= hMax) {
+            float tEnter = yIn > hMax ? (hMax - ro.y) / rd.y : t;
+            if (level > 0) {
+                vec2 p = ro.xz + rd.xz * tEnter;
+                cell = cell * 2 + ivec2(greaterThanEqual(p, lo + 0.5 * cellSize));
+                level--;
+                t = tEnter;
+                continue;
+            }
+            float hit = hitPatch(ro, rd, cell, tEnter, tExit);
+            if (hit >= 0.0) return hit;
+        }
+        // On to the neighbour through the face the ray leaves by
+        ivec2 next = cell + (exits.x < exits.y ? ivec2(dir.x, 0) : ivec2(0, dir.y));
+        int cells = (TERRAIN_MAP_TILES * TERRAIN_TILE) >> level;
+        if (any(lessThan(next, ivec2(0))) || any(greaterThanEqual(next, ivec2(cells)))) break;
+        if (level < TERRAIN_TOP_LEVEL && (next >> 1) != (cell >> 1)) {
+            next >>= 1;
+            level++;
+        }
+        cell = next;
+        t = tExit;
+    }
+    return tMax;
+}
+
+void main() {
+    vec4 farPoint = uInvViewProj * vec4(vUV * 2.0 - 1.0, 1.0, 1.0);
+    vec3 rd = normalize(farPoint.xyz / farPoint.w - uViewPos);
+    vec3 ro = uViewPos;
+
+    float t = uTerrainTraversal == 0 ? castLinear(ro, rd, 0.1, TERRAIN_FAR, 0.2) : castQuadtree(ro, rd, 0.1, TERRAIN_FAR);
+    if (uShowMapMode == 3) {
+        // [STEP COUNT MAP] 64 steps = red
+        FragColor = vec4(jet(clamp(float(gSteps) / 64.0, 0.0, 1.0)), 1.0);
+        return;
+    }
+    if (t >= TERRAIN_FAR) {
+        FragColor = vec4(mix(FOG_NEAR, FOG_FAR, smoothstep(0.0, 1.0, rd.y)), 1.0);
+        return;
+    }
+
+    vec3 p = ro + rd * t;
+    vec3 normal = terrainNormal(p.xz);
+    float light = 0.2 + 0.6 * max(dot(LIGHT_DIR, normal), 0.0);
+    vec3 base = mix(vec3(0.22, 0.2, 0.16), vec3(0.32, 0.3, 0.24), textureLod(uNoiseVolume, vec3(p.xz * 0.5, 0.0), 0.0).r);
+    vec3 color = base * light;
+
+    // Beer-Lambert over the ray, thinning with height
+    float density = textureLod(uNoiseVolume, p * 0.1 + uWindOffset, 0.0).r;
+    float fog = smoothstep(0.0, 1.0, 1.0 - exp(-t * FOG_DENSITY * exp(-p.y * FOG_HEIGHT_FALLOFF) * density));
+    vec3 fogColor = mix(FOG_NEAR, FOG_FAR, smoothstep(0.0, 1.0, t / TERRAIN_FAR));
+    FragColor = vec4(mix(color, fogColor, fog), 1.0);
+}
+)";
+
+// --shader-dir: each embedded source is replaced by <dir>/<NAME>.glsl when
+// that file exists, and written there when it does not, so pointing it at
+// an empty directory exports every shader for editing
+static void useShaderDir(const string& dir) {
+    static const struct { const char* name; const char** source; } shaders[] = {
+        {"FRAME_DATA", &FRAME_DATA}, {"OBJECT_DATA", &OBJECT_DATA}, {"OBJECT_VERT", &OBJECT_VERT},
+        {"OBJECT_FRAG", &OBJECT_FRAG}, {"SIMPLE_VERT", &SIMPLE_VERT}, {"SIMPLE_FRAG", &SIMPLE_FRAG},
+        {"DEPTH_VERT", &DEPTH_VERT}, {"DEPTH_FRAG", &DEPTH_FRAG}, {"SHADOW_MINMAX_FRAG", &SHADOW_MINMAX_FRAG},
+        {"PREPASS_VERT", &PREPASS_VERT}, {"FOG_VERT", &FOG_VERT}, {"HEIGHT_FOG", &HEIGHT_FOG}, {"FOG_COMMON", &FOG_COMMON},
+        {"FOG_MARCH", &FOG_MARCH}, {"FOG_FRAG", &FOG_FRAG}, {"FROXEL_INJECT_COMP", &FROXEL_INJECT_COMP},
+        {"FROXEL_INTEGRATE_COMP", &FROXEL_INTEGRATE_COMP}, {"FULLSCREEN_VERT", &FULLSCREEN_VERT},
+        {"VOLUME_FRAG", &VOLUME_FRAG}, {"TEMPORAL_FRAG", &TEMPORAL_FRAG},
+        {"VOLUME_COMPOSITE_FRAG", &VOLUME_COMPOSITE_FRAG}, {"EPIPOLAR_COMMON", &EPIPOLAR_COMMON},
+        {"EPIPOLAR_COORD_FRAG", &EPIPOLAR_COORD_FRAG}, {"EPIPOLAR_MARCH_FRAG", &EPIPOLAR_MARCH_FRAG},
+        {"EPIPOLAR_INTERP_FRAG", &EPIPOLAR_INTERP_FRAG}, {"EPIPOLAR_COMPOSITE_FRAG", &EPIPOLAR_COMPOSITE_FRAG},
+        {"OVERLAY_FRAG", &OVERLAY_FRAG}, {"TERRAIN_FRAG", &TERRAIN_FRAG},
+    };
+    static deque<string> loaded;
+    error_code ec;
+    filesystem::create_directories(dir, ec);
+    int read = 0, written = 0;
+    for (const auto& shader : shaders) {
+        string path = dir + "/" + shader.name + ".glsl";
+        ifstream in(path, ios::binary);
+        if (in) {
+            loaded.emplace_back((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+            *shader.source = loaded.back().c_str();
+            read++;
+        } else if (ofstream(path, ios::binary) << *shader.source) {
+            written++;
+        }
+    }
+    cout << "shaders: " << read << " read from " << dir << ", " << written << " written" << endl;
+}
+
+// A range of triangles in the shared scene vertex buffer
+struct Mesh {
+    GLint first = 0;
+    GLsizei count = 0;
+};
+
+// Appends position/normal vertices to the shared buffer
+static Mesh makeMesh(vector<float>& sceneVerts, const vector<float>& verts) {
+    Mesh m;
+    m.first = (GLint)(sceneVerts.size() / 6);
+    m.count = (GLsizei)(verts.size() / 6); 
+    sceneVerts.insert(sceneVerts.end(), verts.begin(), verts.end());
+    return m;
+}
+
+// Matches the layout of DrawArraysIndirectCommand
+struct DrawCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint first;
+    GLuint baseInstance;
+};
+
+struct AABB {
+    glm::vec3 lo = glm::vec3(FLT_MAX);
+    glm::vec3 hi = glm::vec3(-FLT_MAX);
+    void grow(const AABB& b) { lo = glm::min(lo, b.lo); hi = glm::max(hi, b.hi); }
+    void grow(const glm::vec3& p) { lo = glm::min(lo, p); hi = glm::max(hi, p); }
+    glm::vec3 center() const { return (lo + hi) * 0.5f; }
+};
+
+static AABB meshBounds(const vector<float>& sceneVerts, const Mesh& m) {
+    AABB b;
+    for (GLsizei i = 0; i < m.count; ++i) {
+        const float* v = &sceneVerts[(m.first + i) * 6];
+        b.grow(glm::vec3(v[0], v[1], v[2]));
+    }
+    return b;
+}
+
+static AABB transformBounds(const AABB& b, const glm::mat4& m) {
+    glm::vec3 c = glm::vec3(m * glm::vec4(b.center(), 1.0f));
+    glm::vec3 e = glm::mat3(glm::vec3(glm::abs(m[0])), glm::vec3(glm::abs(m[1])), glm::vec3(glm::abs(m[2]))) * ((b.hi - b.lo) * 0.5f);
+    AABB r;
+    r.lo = c - e;
+    r.hi = c + e;
+    return r;
+}
+
+enum CullResult { CULL_OUTSIDE, CULL_PARTIAL, CULL_INSIDE };
+
+// The six planes of a view-projection matrix, optionally intersected with a
+// cone (the spotlight). Conservative: boxes are only ever culled if they are
+// certainly outside.
+struct CullVolume {
+    static const uint32_t CONE_TEST = 1u << 6; // bits 0-5 are the planes
+
+    glm::vec4 planes[6];
+    glm::vec3 absNormals[6];
+    bool hasCone = false;
+    glm::vec3 apex, axis;
+    float cosAngle = 1.0f, sinAngle = 0.0f, range = 0.0f;
+
+    explicit CullVolume(const glm::mat4& vp) {
+        glm::vec4 w(vp[0][3], vp[1][3], vp[2][3], vp[3][3]);
+        for (int i = 0; i < 3; ++i) {
+            glm::vec4 row(vp[0][i], vp[1][i], vp[2][i], vp[3][i]);
+            planes[i * 2] = w + row;
+            planes[i * 2 + 1] = w - row;
+        }
+        for (int i = 0; i < 6; ++i) absNormals[i] = glm::abs(glm::vec3(planes[i]));
+    }
+
+    void setCone(const glm::vec3& coneApex, const glm::vec3& coneAxis, float halfAngle, float coneRange) {
+        hasCone = true;
+        apex = coneApex;
+        axis = glm::normalize(coneAxis);
+        cosAngle = cos(halfAngle);
+        sinAngle = sin(halfAngle);
+        range = coneRange;
+    }
+
+    uint32_t allTests() const { return hasCone ? 0x7f : 0x3f; }
+
+    // Runs only the tests still set in `active` and clears the ones the box
+    // passes entirely, so children never repeat a test their parent passed
+    CullResult classify(const AABB& b, uint32_t& active) const {
+        glm::vec3 c = b.center(), e = (b.hi - b.lo) * 0.5f;
+        uint32_t outside = 0, inside = 0;
+        for (int i = 0; i < 6; ++i) {
+            // All six without branching, then only the active ones count
+            float d = planes[i].x * c.x + planes[i].y * c.y + planes[i].z * c.z + planes[i].w;
+            float r = absNormals[i].x * e.x + absNormals[i].y * e.y + absNormals[i].z * e.z;
+            outside |= uint32_t(d < -r) << i;
+            inside |= uint32_t(d >= r) << i;
+        }
+        if (outside & active) return CULL_OUTSIDE;
+        active &= ~inside;
+        if (active & CONE_TEST) {
+            // Bounding sphere against the lateral surface. Behind the apex the
+            // distance is underestimated, which only culls less.
+            glm::vec3 v = c - apex;
+            float radius = glm::length(e);
+            float t = glm::dot(v, axis);
+            float perp = sqrt(max(glm::dot(v, v) - t * t, 0.0f));
+            float dist = cosAngle * perp - t * sinAngle;
+            if (dist > radius || t < -radius || t > range + radius) return CULL_OUTSIDE;
+            if (dist <= -radius && t >= radius && t <= range - radius) active &= ~CONE_TEST;
+        }
+        return active ? CULL_PARTIAL : CULL_INSIDE;
+    }
+
+    // classify() on N boxes at once, given as centres and half extents per
+    // axis and bounding radii. Returns a bit per box that is outside;
+    // inside, when given, gets the tests each box passes entirely. Every
+    // test runs on every box and is masked afterwards, and the cone test
+    // compares squares instead of taking roots, so each loop is a few SIMD
+    // instructions.
+    template <int N>
+    uint32_t classifyN(const float* const c[3], const float* const e[3], const float* radii, uint32_t active,
+                       uint32_t* inside = nullptr) const {
+        uint32_t out[N] = {}, in[N] = {};
+        for (int i = 0; i < 6; ++i) {
+            const glm::vec4& p = planes[i];
+            const glm::vec3& a = absNormals[i];
+            for (int k = 0; k < N; ++k) {
+                float d = p.x * c[0][k] + p.y * c[1][k] + p.z * c[2][k] + p.w;
+                float r = a.x * e[0][k] + a.y * e[1][k] + a.z * e[2][k];
+                out[k] |= uint32_t(d < -r) << i;
+                in[k] |= uint32_t(d >= r) << i;
+            }
+        }
+        if (active & CONE_TEST) {
+            float cos2 = cosAngle * cosAngle;
+            for (int k = 0; k < N; ++k) {
+                float vx = c[0][k] - apex.x, vy = c[1][k] - apex.y, vz = c[2][k] - apex.z;
+                float radius = radii[k];
+                float t = vx * axis.x + vy * axis.y + vz * axis.z;
+                float perp2 = vx * vx + vy * vy + vz * vz - t * t;
+                perp2 = perp2 > 0.0f ? perp2 : 0.0f;
+                // cosAngle * perp - t * sinAngle against +-radius, squared
+                float far = radius + t * sinAngle, near = t * sinAngle - radius;
+                bool lateralOut = (far < 0.0f) | (cos2 * perp2 > far * far);
+                bool lateralIn = (near >= 0.0f) & (cos2 * perp2 <= near * near);
+                out[k] |= uint32_t(lateralOut | (t < -radius) | (t > range + radius)) << 6;
+                in[k] |= uint32_t(lateralIn & (t >= radius) & (t <= range - radius)) << 6;
+            }
+        }
+        uint32_t bits = 0;
+        for (int k = 0; k < N; ++k) {
+            bits |= uint32_t((out[k] & active) != 0) << k;
+            if (inside) inside[k] = in[k];
+        }
+        return bits;
+    }
+};
+
+struct CullStats {
+    int tested = 0; // boxes classified, nodes and objects
+    int culled = 0;
+    int drawn = 0;
+};
+
+// Object flags: a query only returns objects sharing a bit with its mask.
+// 0 hides an object from every query.
+enum : uint32_t { OBJ_STATIC = 1, OBJ_DYNAMIC = 2 };
+
+// Bounding-volume hierarchy over object AABBs, built once with median splits
+// on the longest centroid axis. Moving objects are refit in place, walking
+// up from their leaf, so the tree only loosens where they travel. Boxes and
+// flags are stored in leaf order so a query walks memory linearly.
+struct ObjectBVH {
+    struct Node {
+        AABB box;
+        int32_t first = 0, count = 0; // range in items
+        int32_t left = -1;            // children are left and left + 1; -1 for a leaf
+        int32_t parent = -1;
+        uint32_t flags = 0;           // union of the flags below
+        uint32_t common = 0;          // intersection of the flags below
+    };
+    static const int LEAF_SIZE = 8;
+
+    vector<Node> nodes;
+    vector<uint32_t> items;     // object IDs in leaf order
+    vector<AABB> itemBoxes;     // in leaf order
+    vector<uint32_t> itemFlags; // in leaf order
+    vector<float> itemCenter[3], itemExtent[3], itemRadius; // in leaf order, padded for classifyN()
+    vector<int32_t> slotOf;     // object ID -> index in items
+    vector<int32_t> leafOf;     // object ID -> leaf node
+
+    // The tree as queries walk it: every other level collapsed, so a wide
+    // node holds the boxes of up to four nodes (grandchildren, or children
+    // that are leaves) laid out per axis for CullVolume::classifyN
+    struct WideNode {
+        float center[3][4], extent[3][4], radius[4];
+        int32_t node[4]; // -1 for an empty lane
+    };
+    vector<WideNode> wide;
+    vector<int32_t> wideOf;     // node -> its wide node, -1 if it has none
+    int flagTotals[4] = {};     // objects per flag value
+
+    void build(const vector<AABB>& boxes, const vector<uint32_t>& flags) {
+        size_t n = boxes.size();
+        vector<glm::vec3> centers(n);
+        for (size_t i = 0; i < n; ++i) centers[i] = boxes[i].center();
+        items.resize(n);
+        iota(items.begin(), items.end(), 0u);
+        nodes.clear();
+        if (n > 0) {
+            nodes.reserve(2 * n + 1);
+            nodes.push_back(Node());
+            buildNode(0, 0, int32_t(n), centers);
+        }
+        itemBoxes.resize(n);
+        itemFlags.resize(n);
+        for (int a = 0; a < 3; ++a) {
+            itemCenter[a].assign(n + LEAF_SIZE, 0.0f);
+            itemExtent[a].assign(n + LEAF_SIZE, 0.0f);
+        }
+        itemRadius.assign(n + LEAF_SIZE, 0.0f);
+        slotOf.resize(n);
+        leafOf.resize(n);
+        fill(begin(flagTotals), end(flagTotals), 0);
+        for (size_t i = 0; i < n; ++i) {
+            itemBoxes[i] = boxes[items[i]];
+            itemFlags[i] = flags[items[i]];
+            setItemLanes(int32_t(i));
+            slotOf[items[i]] = int32_t(i);
+            flagTotals[flags[i] & 3]++;
+        }
+        for (int32_t ni = int32_t(nodes.size()) - 1; ni >= 0; --ni) {
+            if (nodes[ni].left < 0) {
+                for (int32_t i = nodes[ni].first; i < nodes[ni].first + nodes[ni].count; ++i) leafOf[items[i]] = ni;
+            }
+            refitNode(ni);
+        }
+        wide.clear();
+        wideOf.assign(nodes.size(), -1);
+        if (!nodes.empty() && nodes[0].left >= 0) {
+            vector<int32_t> todo = {0};
+            while (!todo.empty()) {
+                int32_t ni = todo.back();
+                todo.pop_back();
+                wideOf[ni] = int32_t(wide.size());
+                wide.push_back(WideNode());
+                int32_t lanes[4];
+                for (int k = 0, n = wideLanes(ni, lanes); k < n; ++k) {
+                    if (nodes[lanes[k]].left >= 0) todo.push_back(lanes[k]);
+                }
+            }
+            for (int32_t ni = 0; ni < int32_t(nodes.size()); ++ni) if (wideOf[ni] >= 0) writeWide(ni);
+        }
+    }
+
+    int wideLanes(int32_t ni, int32_t lanes[4]) const {
+        int n = 0;
+        for (int32_t c = nodes[ni].left; c <= nodes[ni].left + 1; ++c) {
+            if (nodes[c].left < 0) {
+                lanes[n++] = c;
+            } else {
+                lanes[n++] = nodes[c].left;
+                lanes[n++] = nodes[c].left + 1;
+            }
+        }
+        return n;
+    }
+
+    void writeWide(int32_t ni) {
+        WideNode& w = wide[wideOf[ni]];
+        int32_t lanes[4];
+        int n = wideLanes(ni, lanes);
+        for (int k = 0; k < 4; ++k) {
+            w.node[k] = k < n ? lanes[k] : -1;
+            glm::vec3 c(0.0f), e(0.0f);
+            if (k < n) {
+                const AABB& b = nodes[lanes[k]].box;
+                c = b.center();
+                e = (b.hi - b.lo) * 0.5f;
+            }
+            for (int a = 0; a < 3; ++a) {
+                w.center[a][k] = c[a];
+                w.extent[a][k] = e[a];
+            }
+            w.radius[k] = glm::length(e);
+        }
+    }
+
+    void buildNode(int32_t ni, int32_t first, int32_t count, const vector<glm::vec3>& centers) {
+        nodes[ni].first = first;
+        nodes[ni].count = count;
+        if (count <= LEAF_SIZE) return;
+        AABB bounds;
+        for (int32_t i = first; i < first + count; ++i) bounds.grow(centers[items[i]]);
+        glm::vec3 extent = bounds.hi - bounds.lo;
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        int32_t mid = first + count / 2;
+        nth_element(items.begin() + first, items.begin() + mid, items.begin() + first + count,
+                    [&](uint32_t a, uint32_t b) { return centers[a][axis] < centers[b][axis]; });
+        int32_t left = int32_t(nodes.size());
+        nodes.push_back(Node());
+        nodes.push_back(Node());
+        nodes[ni].left = left;
+        nodes[left].parent = ni;
+        nodes[left + 1].parent = ni;
+        buildNode(left, first, mid - first, centers);
+        buildNode(left + 1, mid, first + count - mid, centers);
+    }
+
+    void setItemLanes(int32_t slot) {
+        glm::vec3 c = itemBoxes[slot].center(), e = (itemBoxes[slot].hi - itemBoxes[slot].lo) * 0.5f;
+        for (int a = 0; a < 3; ++a) {
+            itemCenter[a][slot] = c[a];
+            itemExtent[a][slot] = e[a];
+        }
+        itemRadius[slot] = glm::length(e);
+    }
+
+    // Children are always after their parent, so refitting in reverse node
+    // order is bottom-up
+    void refitNode(int32_t ni) {
+        Node& n = nodes[ni];
+        n.box = AABB();
+        n.flags = 0;
+        n.common = ~0u;
+        if (n.left < 0) {
+            for (int32_t i = n.first; i < n.first + n.count; ++i) {
+                n.box.grow(itemBoxes[i]);
+                n.flags |= itemFlags[i];
+                n.common &= itemFlags[i];
+            }
+        } else {
+            for (int32_t c = n.left; c <= n.left + 1; ++c) {
+                n.box.grow(nodes[c].box);
+                n.flags |= nodes[c].flags;
+                n.common &= nodes[c].common;
+            }
+        }
+    }
+
+    // New bounds and flags for one object, refitting its path to the root
+    void update(uint32_t id, const AABB& box, uint32_t flags) {
+        int32_t slot = slotOf[id];
+        flagTotals[itemFlags[slot] & 3]--;
+        flagTotals[flags & 3]++;
+        itemBoxes[slot] = box;
+        itemFlags[slot] = flags;
+        setItemLanes(slot);
+        for (int32_t ni = leafOf[id]; ni >= 0; ni = nodes[ni].parent) {
+            refitNode(ni);
+            if (wideOf[ni] >= 0) writeWide(ni);
+        }
+    }
+
+    int countFlags(uint32_t mask) const {
+        int total = 0;
+        for (uint32_t f = 1; f < 4; ++f) if (f & mask) total += flagTotals[f];
+        return total;
+    }
+
+    // Appends every object matching mask that may intersect vol. Subtrees
+    // entirely inside are taken without testing their objects, as one copy
+    // when every object below matches. Wide nodes test their four boxes
+    // together and partial leaves test all their objects together.
+    void query(const CullVolume& vol, uint32_t mask, vector<uint32_t>& out, CullStats& stats) const {
+        size_t before = out.size();
+        struct Entry { int32_t wide; uint32_t active; };
+        Entry stack[64];
+        int sp = 0;
+        // A node that is not outside, with the tests it has not passed yet
+        auto take = [&](int32_t ni, uint32_t active) {
+            const Node& n = nodes[ni];
+            if (!active && (n.common & mask)) {
+                out.insert(out.end(), items.begin() + n.first, items.begin() + n.first + n.count);
+            } else if (!active || n.left < 0) {
+                uint32_t outside = 0;
+                if (active) {
+                    const float* c[3] = {&itemCenter[0][n.first], &itemCenter[1][n.first], &itemCenter[2][n.first]};
+                    const float* e[3] = {&itemExtent[0][n.first], &itemExtent[1][n.first], &itemExtent[2][n.first]};
+                    outside = vol.classifyN<LEAF_SIZE>(c, e, &itemRadius[n.first], active);
+                    stats.tested += n.count;
+                }
+                for (int32_t i = n.first; i < n.first + n.count; ++i) {
+                    if ((itemFlags[i] & mask) && !(outside & (1u << (i - n.first)))) out.push_back(items[i]);
+                }
+            } else {
+                stack[sp++] = {wideOf[ni], active};
+            }
+        };
+        if (!nodes.empty() && (nodes[0].flags & mask)) {
+            uint32_t active = vol.allTests();
+            stats.tested++;
+            if (vol.classify(nodes[0].box, active) != CULL_OUTSIDE) take(0, active);
+        }
+        while (sp > 0) {
+            Entry e = stack[--sp];
+            const WideNode& w = wide[e.wide];
+            const float* c[3] = {w.center[0], w.center[1], w.center[2]};
+            const float* x[3] = {w.extent[0], w.extent[1], w.extent[2]};
+            uint32_t inside[4];
+            uint32_t outside = vol.classifyN<4>(c, x, w.radius, e.active, inside);
+            for (int k = 0; k < 4; ++k) {
+                int32_t ni = w.node[k];
+                if (ni < 0 || !(nodes[ni].flags & mask)) continue;
+                stats.tested++;
+                if (!(outside & (1u << k))) take(ni, e.active & ~inside[k]);
+            }
+        }
+        int drawn = int(out.size() - before);
+        stats.drawn += drawn;
+        stats.culled += countFlags(mask) - drawn;
+    }
+
+    // Culling off: every object matching mask
+    void queryAll(uint32_t mask, vector<uint32_t>& out, CullStats& stats) const {
+        size_t before = out.size();
+        for (size_t i = 0; i < items.size(); ++i) {
+            if (itemFlags[i] & mask) out.push_back(items[i]);
+        }
+        stats.drawn += int(out.size() - before);
+    }
+
+    // Ray/box slab test over [tMin, tMax]; tNear is where the ray enters
+    static bool rayBox(const AABB& b, const glm::vec3& ro, const glm::vec3& invDir, float tMin, float tMax, float& tNear) {
+        float x0 = (b.lo.x - ro.x) * invDir.x, x1 = (b.hi.x - ro.x) * invDir.x;
+        float y0 = (b.lo.y - ro.y) * invDir.y, y1 = (b.hi.y - ro.y) * invDir.y;
+        float z0 = (b.lo.z - ro.z) * invDir.z, z1 = (b.hi.z - ro.z) * invDir.z;
+        tNear = max(max(min(x0, x1), min(y0, y1)), max(min(z0, z1), tMin));
+        float tFar = min(min(max(x0, x1), max(y0, y1)), min(max(z0, z1), tMax));
+        return tNear <= tFar;
+    }
+
+    // Walks the boxes along a ray, nearer child first, calling hitObject(id)
+    // for every object matching mask whose box the ray reaches before tMax.
+    // hitObject returns the new tMax (the closest hit so far).
+    template <class HitObject>
+    void raycast(const glm::vec3& ro, const glm::vec3& rd, float tMin, float tMax, uint32_t mask, HitObject hitObject) const {
+        if (nodes.empty()) return;
+        glm::vec3 invDir(1.0f / rd.x, 1.0f / rd.y, 1.0f / rd.z);
+        int32_t stack[64];
+        int sp = 0;
+        float tNear;
+        if (rayBox(nodes[0].box, ro, invDir, tMin, tMax, tNear)) stack[sp++] = 0;
+        while (sp > 0) {
+            const Node& n = nodes[stack[--sp]];
+            if (!(n.flags & mask) || !rayBox(n.box, ro, invDir, tMin, tMax, tNear)) continue;
+            if (n.left < 0) {
+                for (int32_t i = n.first; i < n.first + n.count; ++i) {
+                    if ((itemFlags[i] & mask) && rayBox(itemBoxes[i], ro, invDir, tMin, tMax, tNear)) {
+                        tMax = hitObject(items[i], tMax);
+                    }
+                }
+                continue;
+            }
+            float t0, t1;
+            bool hit0 = rayBox(nodes[n.left].box, ro, invDir, tMin, tMax, t0);
+            bool hit1 = rayBox(nodes[n.left + 1].box, ro, invDir, tMin, tMax, t1);
+            if (hit0 && hit1) {
+                stack[sp++] = t0 < t1 ? n.left + 1 : n.left;
+                stack[sp++] = t0 < t1 ? n.left : n.left + 1;
+            } else if (hit0) {
+                stack[sp++] = n.left;
+            } else if (hit1) {
+                stack[sp++] = n.left + 1;
+            }
+        }
+    }
+};
+
+static Mesh makeCube(vector<float>& sceneVerts) {
+    vector<float> v = {
+         0.5f, -0.5f, -0.5f, 1,0,0,  0.5f,  0.5f, -0.5f, 1,0,0,  0.5f,  0.5f,  0.5f, 1,0,0,
+         0.5f, -0.5f, -0.5f, 1,0,0,  0.5f,  0.5f,  0.5f, 1,0,0,  0.5f, -0.5f,  0.5f, 1,0,0,
+        -0.5f, -0.5f,  0.5f, -1,0,0, -0.5f,  0.5f,  0.5f, -1,0,0, -0.5f,  0.5f, -0.5f, -1,0,0,
+        -0.5f, -0.5f,  0.5f, -1,0,0, -0.5f,  0.5f, -0.5f, -1,0,0, -0.5f, -0.5f, -0.5f, -1,0,0,
+        -0.5f, 0.5f, -0.5f, 0,1,0,   0.5f, 0.5f, -0.5f, 0,1,0,   0.5f, 0.5f,  0.5f, 0,1,0,
+        -0.5f, 0.5f, -0.5f, 0,1,0,   0.5f, 0.5f,  0.5f, 0,1,0,  -0.5f, 0.5f,  0.5f, 0,1,0,
+        -0.5f, -0.5f,  0.5f, 0,-1,0,  0.5f, -0.5f,  0.5f, 0,-1,0,  0.5f, -0.5f, -0.5f, 0,-1,0,
+        -0.5f, -0.5f,  0.5f, 0,-1,0,  0.5f, -0.5f, -0.5f, 0,-1,0, -0.5f, -0.5f, -0.5f, 0,-1,0,
+        -0.5f, -0.5f, 0.5f, 0,0,1,    0.5f, -0.5f, 0.5f, 0,0,1,    0.5f,  0.5f, 0.5f, 0,0,1,
+        -0.5f, -0.5f, 0.5f, 0,0,1,    0.5f,  0.5f, 0.5f, 0,0,1,   -0.5f,  0.5f, 0.5f, 0,0,1,
+         0.5f, -0.5f,-0.5f, 0,0,-1,  -0.5f, -0.5f,-0.5f, 0,0,-1,  -0.5f,  0.5f,-0.5f, 0,0,-1,
+         0.5f, -0.5f,-0.5f, 0,0,-1,  -0.5f,  0.5f,-0.5f, 0,0,-1,   0.5f,  0.5f,-0.5f, 0,0,-1
+    };
+    return makeMesh(sceneVerts, v);
+}
+
+// Runs body(i) for every i in [0, count) on `threads` workers. Each worker
+// starts on a contiguous share and takes items from its front; once that is
+// empty it steals the back half of another worker's share. A share packs
+// (begin, end) into one word, so the owner and a thief race on a single CAS.
+static void parallelFor(int count, int threads, const function<void(int)>& body) {
+    threads = max(1, min(threads, count));
+    if (threads == 1) {
+        for (int i = 0; i < count; ++i) body(i);
+        return;
+    }
+    struct alignas(64) Share { atomic<uint64_t> range; };
+    auto pack = [](uint64_t begin, uint64_t end) { return (begin << 32) | end; };
+    vector<Share> shares(threads);
+    for (int w = 0; w < threads; ++w) {
+        shares[w].range = pack(int64_t(count) * w / threads, int64_t(count) * (w + 1) / threads);
+    }
+    auto worker = [&](int self) {
+        for (;;) {
+            uint64_t own = shares[self].range.load();
+            uint32_t begin = uint32_t(own >> 32), end = uint32_t(own);
+            if (begin < end) {
+                if (shares[self].range.compare_exchange_weak(own, pack(begin + 1, end))) body(int(begin));
+                continue;
+            }
+            bool stolen = false;
+            for (int k = 1; k < threads && !stolen; ++k) {
+                Share& victim = shares[(self + k) % threads];
+                uint64_t v = victim.range.load();
+                for (;;) {
+                    uint32_t vb = uint32_t(v >> 32), ve = uint32_t(v);
+                    if (vb >= ve) break;
+                    uint32_t mid = ve - (ve - vb + 1) / 2;
+                    if (victim.range.compare_exchange_weak(v, pack(vb, mid))) {
+                        // Only thieves write an empty share, and they skip it
+                        shares[self].range.store(pack(mid, ve));
+                        stolen = true;
+                        break;
+                    }
+                }
+            }
+            // Nothing left to steal: the remaining items are in flight
+            if (!stolen) return;
+        }
+    };
+    vector<thread> pool;
+    for (int w = 1; w < threads; ++w) pool.emplace_back(worker, w);
+    worker(0);
+    for (thread& t : pool) t.join();
+}
+
+// Heterogeneous fog density: the fbm of shadertoy.glsl (four octaves of
+// smoothstep-interpolated value noise, weights 1/2 .. 1/16) on a size^3
+// lattice. Octave k repeats every NOISE_BASE_PERIOD << k cells, so the
+// volume tiles seamlessly; the fixed rotation between octaves is dropped
+// for the same reason. Values are recentred on 0.5 and stretched until the
+// furthest one reaches 0 or 1, then stored as bytes.
+static const int NOISE_SIZE = 128;
+static const int NOISE_BASE_PERIOD = 8;
+static const uint32_t NOISE_VERSION = 1;
+
+static inline float latticeValue(int x, int y, int z, int octave) {
+    uint32_t h = uint32_t(x) * 0x8da6b343u ^ uint32_t(y) * 0xd8163841u ^ uint32_t(z) * 0xcb1ab31fu ^ uint32_t(octave) * 0x165667b1u;
+    h ^= h >> 16; h *= 0x7feb352du;
+    h ^= h >> 15; h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return float(h >> 8) * (1.0f / 16777216.0f);
+}
+
+static vector<uint8_t> bakeNoiseVolume(int size, int threads) {
+    vector<float> fbm(size_t(size) * size * size);
+    parallelFor(size, threads, [&](int z) {
+        for (int y = 0; y < size; ++y) {
+            for (int x = 0; x < size; ++x) {
+                float sum = 0.0f, weight = 0.5f;
+                for (int octave = 0; octave < 4; ++octave, weight *= 0.5f) {
+                    int period = NOISE_BASE_PERIOD << octave;
+                    float cell = float(size) / float(period);
+                    float p[3] = {(x + 0.5f) / cell, (y + 0.5f) / cell, (z + 0.5f) / cell};
+                    int i[3];
+                    float f[3];
+                    for (int a = 0; a < 3; ++a) {
+                        i[a] = int(floor(p[a]));
+                        f[a] = p[a] - float(i[a]);
+                        f[a] = f[a] * f[a] * (3.0f - 2.0f * f[a]);
+                    }
+                    float corner[8];
+                    for (int c = 0; c < 8; ++c) {
+                        corner[c] = latticeValue((i[0] + (c & 1)) % period, (i[1] + (c >> 1 & 1)) % period,
+                                                 (i[2] + (c >> 2)) % period, octave);
+                    }
+                    float x00 = corner[0] + (corner[1] - corner[0]) * f[0], x10 = corner[2] + (corner[3] - corner[2]) * f[0];
+                    float x01 = corner[4] + (corner[5] - corner[4]) * f[0], x11 = corner[6] + (corner[7] - corner[6]) * f[0];
+                    float y0 = x00 + (x10 - x00) * f[1], y1 = x01 + (x11 - x01) * f[1];
+                    sum += weight * (y0 + (y1 - y0) * f[2]);
+                }
+                fbm[(size_t(z) * size + y) * size + x] = sum / 0.9375f;
+            }
+        }
+    });
+    double mean = accumulate(fbm.begin(), fbm.end(), 0.0) / double(fbm.size());
+    float spread = 1e-6f;
+    for (float v : fbm) spread = max(spread, fabs(v - float(mean)));
+    vector<uint8_t> volume(fbm.size());
+    for (size_t i = 0; i < fbm.size(); ++i) {
+        volume[i] = uint8_t(glm::clamp(0.5f + 0.5f * (fbm[i] - float(mean)) / spread, 0.0f, 1.0f) * 255.0f + 0.5f);
+    }
+    return volume;
+}
+
+// The baked volume behind a small header; false (and nothing read) if the
+// file is missing or was written for another size or generator version
+static bool loadNoiseVolume(const string& path, int size, vector<uint8_t>& volume) {
+    ifstream file(path, ios::binary);
+    uint32_t header[3] = {};
+    if (!file.read((char*)header, sizeof(header))) return false;
+    if (header[0] != 0x4e474f46u || header[1] != uint32_t(size) || header[2] != NOISE_VERSION) return false;
+    vector<uint8_t> data(size_t(size) * size * size);
+    if (!file.read((char*)data.data(), data.size())) return false;
+    volume.swap(data);
+    return true;
+}
+
+static bool saveNoiseVolume(const string& path, int size, const vector<uint8_t>& volume) {
+    ofstream file(path, ios::binary);
+    uint32_t header[3] = {0x4e474f46u, uint32_t(size), NOISE_VERSION}; // "FOGN"
+    file.write((const char*)header, sizeof(header));
+    file.write((const char*)volume.data(), volume.size());
+    return bool(file);
+}
+
+// Height fog LUT: HEIGHT_FOG_LUT_SIZE^2 R32F texels, the segment's start
+// height along x and its end height along y, both over the scene's heights
+// (see main). Segments with an end outside them are integrated in closed
+// form, as the density itself when they rise less than HEIGHT_FOG_FLAT.
+static const int HEIGHT_FOG_LUT_SIZE = 128;
+static const float HEIGHT_FOG_FLAT = 0.01f; // m
+
+// Relative density by height: (1 - haze) * layer(falloff) + haze *
+// layer(hazeFalloff), where layer(k) = min(1, exp(-k (y - base)))
+struct HeightFogProfile {
+    float base, falloff, haze, hazeFalloff;
+    bool operator==(const HeightFogProfile& o) const {
+        return base == o.base && falloff == o.falloff && haze == o.haze && hazeFalloff == o.hazeFalloff;
+    }
+};
+
+static HeightFogProfile heightFogSettings() {
+    return {g_heightFogBase, max(g_heightFalloff, 0.0f), glm::clamp(g_hazeAmount, 0.0f, 1.0f), max(g_hazeFalloff, 0.0f)};
+}
+
+// Integral of one clamped layer from the base to y
+static double heightLayerIntegral(double y, double base, double falloff) {
+    double h = y - base;
+    if (h <= 0.0 || falloff < 1e-6) return h;
+    return -expm1(-falloff * h) / falloff;
+}
+
+static double heightFogIntegral(const HeightFogProfile& p, double y) {
+    return (1.0 - p.haze) * heightLayerIntegral(y, p.base, p.falloff) + p.haze * heightLayerIntegral(y, p.base, p.hazeFalloff);
+}
+
+static double heightFogDensity(const HeightFogProfile& p, double y) {
+    double h = max(y - p.base, 0.0);
+    return (1.0 - p.haze) * exp(-p.falloff * h) + p.haze * exp(-p.hazeFalloff * h);
+}
+
+// Mean of the profile between every pair of texel heights: the closed-form
+// integral over [y0, y1] divided by y1 - y0, the density itself where they
+// meet. Along a straight ray height is linear in distance, so a segment's
+// optical depth is its length times this mean, whatever its slope.
+static vector<float> buildHeightFogLUT(const HeightFogProfile& p, const float range[2]) {
+    const int n = HEIGHT_FOG_LUT_SIZE;
+    vector<double> height(n), integral(n);
+    for (int i = 0; i < n; ++i) {
+        height[i] = range[0] + (range[1] - range[0]) * double(i) / (n - 1);
+        integral[i] = heightFogIntegral(p, height[i]);
+    }
+    vector<float> lut(size_t(n) * n);
+    for (int j = 0; j < n; ++j) {
+        for (int i = 0; i < n; ++i) {
+            lut[size_t(j) * n + i] = float(i == j ? heightFogDensity(p, height[i])
+                                                  : (integral[j] - integral[i]) / (height[j] - height[i]));
+        }
+    }
+    return lut;
+}
+
+// Phase LUT: PHASE_LUT_SIZE R32F texels over sin(theta / 2) in [0, 1] for
+// each of the first PHASE_LUT_OCTAVES scattering octaves
+static const int PHASE_LUT_SIZE = 256, PHASE_LUT_OCTAVES = 4;
+static_assert(PHASE_LUT_OCTAVES == 4, "FrameData holds one vec4 component per octave");
+
+struct PhaseSettings {
+    float g, backG, backBlend, msScattering, msPhase;
+    bool operator==(const PhaseSettings& o) const {
+        return g == o.g && backG == o.backG && backBlend == o.backBlend && msScattering == o.msScattering && msPhase == o.msPhase;
+    }
+};
+
+static PhaseSettings phaseSettings() {
+    return {glm::clamp(g_phaseG, -0.99f, 0.99f), glm::clamp(g_phaseBackG, -0.99f, 0.99f),
+            glm::clamp(g_phaseBackBlend, 0.0f, 1.0f), g_msScattering, g_msPhase};
+}
+
+// hgPhase() in the shaders: Henyey-Greenstein scaled so isotropic is 1
+static double hgPhase(double cosTheta, double g) {
+    double d = 1.0 + g * g - 2.0 * g * cosTheta;
+    return (1.0 - g * g) / (d * sqrt(d));
+}
+
+// octavePhase() for every texel: the dual-lobe phase of octave o with g
+// scaled by msPhase^o, weighted msScattering^o. Fills lut in place, so a
+// rebuild in the render loop does not allocate.
+static void buildPhaseLUT(const PhaseSettings& p, vector<float>& lut) {
+    lut.resize(size_t(PHASE_LUT_SIZE) * PHASE_LUT_OCTAVES);
+    for (int o = 0; o < PHASE_LUT_OCTAVES; ++o) {
+        double weight = pow(double(p.msScattering), o), gScale = pow(double(p.msPhase), o);
+        for (int i = 0; i < PHASE_LUT_SIZE; ++i) {
+            double s = double(i) / (PHASE_LUT_SIZE - 1);
+            double cosTheta = 1.0 - 2.0 * s * s;
+            double phase = (1.0 - p.backBlend) * hgPhase(cosTheta, p.g * gScale) + p.backBlend * hgPhase(cosTheta, p.backG * gScale);
+            lut[size_t(o) * PHASE_LUT_SIZE + i] = float(weight * phase);
+        }
+    }
+}
+
+// REF_LANES floats processed together by the reference integrator: AVX2
+// registers when the compiler targets them, plain floats otherwise
+#if defined(__AVX2__)
+static const int REF_LANES = 8;
+struct RefMask { __m256 m; };
+struct RefFloat {
+    __m256 v;
+    RefFloat() : v(_mm256_setzero_ps()) {}
+    RefFloat(float s) : v(_mm256_set1_ps(s)) {}
+    RefFloat(__m256 x) : v(x) {}
+    static RefFloat load(const float* p) { return _mm256_loadu_ps(p); }
+    void store(float* p) const { _mm256_storeu_ps(p, v); }
+};
+static inline RefFloat operator+(RefFloat a, RefFloat b) { return _mm256_add_ps(a.v, b.v); }
+static inline RefFloat operator-(RefFloat a, RefFloat b) { return _mm256_sub_ps(a.v, b.v); }
+static inline RefFloat operator*(RefFloat a, RefFloat b) { return _mm256_mul_ps(a.v, b.v); }
+static inline RefFloat operator/(RefFloat a, RefFloat b) { return _mm256_div_ps(a.v, b.v); }
+static inline RefMask operator<(RefFloat a, RefFloat b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)}; }
+static inline RefMask operator>(RefFloat a, RefFloat b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ)}; }
+static inline RefMask operator<=(RefFloat a, RefFloat b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)}; }
+static inline RefMask operator&(RefMask a, RefMask b) { return {_mm256_and_ps(a.m, b.m)}; }
+static inline RefMask operator|(RefMask a, RefMask b) { return {_mm256_or_ps(a.m, b.m)}; }
+static inline RefMask operator!(RefMask a) { return {_mm256_xor_ps(a.m, _mm256_castsi256_ps(_mm256_set1_epi32(-1)))}; }
+static inline bool any(RefMask a) { return _mm256_movemask_ps(a.m) != 0; }
+static inline RefFloat select(RefMask m, RefFloat a, RefFloat b) { return _mm256_blendv_ps(b.v, a.v, m.m); }
+static inline RefFloat min(RefFloat a, RefFloat b) { return _mm256_min_ps(a.v, b.v); }
+static inline RefFloat max(RefFloat a, RefFloat b) { return _mm256_max_ps(a.v, b.v); }
+static inline RefFloat sqrt(RefFloat a) { return _mm256_sqrt_ps(a.v); }
+static inline RefFloat floor(RefFloat a) { return _mm256_floor_ps(a.v); }
+static inline RefFloat ceil(RefFloat a) { return _mm256_ceil_ps(a.v); }
+static inline RefFloat abs(RefFloat a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+
+// Cephes expf: 2^n * p(r) with |r| <= ln2/2, about 2 ulp
+static inline RefFloat exp(RefFloat x) {
+    __m256 v = _mm256_min_ps(_mm256_max_ps(x.v, _mm256_set1_ps(-87.3365f)), _mm256_set1_ps(88.3762f));
+    __m256 n = _mm256_floor_ps(_mm256_fmadd_ps(v, _mm256_set1_ps(1.44269504088896341f), _mm256_set1_ps(0.5f)));
+    v = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), v);
+    v = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), v);
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, v, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, v, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, v, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, v, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, v, _mm256_set1_ps(5.0000001201e-1f));
+    p = _mm256_fmadd_ps(p, _mm256_mul_ps(v, v), _mm256_add_ps(v, _mm256_set1_ps(1.0f)));
+    __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+// base[index] per lane; index holds whole numbers below 2^24
+static inline RefFloat gather(const float* base, RefFloat index) {
+    return _mm256_i32gather_ps(base, _mm256_cvttps_epi32(index.v), 4);
+}
+#else
+static const int REF_LANES = 1;
+struct RefMask { bool m; };
+struct RefFloat {
+    float v;
+    RefFloat() : v(0.0f) {}
+    RefFloat(float s) : v(s) {}
+    static RefFloat load(const float* p) { return *p; }
+    void store(float* p) const { *p = v; }
+};
+static inline RefFloat operator+(RefFloat a, RefFloat b) { return a.v + b.v; }
+static inline RefFloat operator-(RefFloat a, RefFloat b) { return a.v - b.v; }
+static inline RefFloat operator*(RefFloat a, RefFloat b) { return a.v * b.v; }
+static inline RefFloat operator/(RefFloat a, RefFloat b) { return a.v / b.v; }
+static inline RefMask operator<(RefFloat a, RefFloat b) { return {a.v < b.v}; }
+static inline RefMask operator>(RefFloat a, RefFloat b) { return {a.v > b.v}; }
+static inline RefMask operator<=(RefFloat a, RefFloat b) { return {a.v <= b.v}; }
+static inline RefMask operator&(RefMask a, RefMask b) { return {a.m && b.m}; }
+static inline RefMask operator|(RefMask a, RefMask b) { return {a.m || b.m}; }
+static inline RefMask operator!(RefMask a) { return {!a.m}; }
+static inline bool any(RefMask a) { return a.m; }
+static inline RefFloat select(RefMask m, RefFloat a, RefFloat b) { return m.m ? a : b; }
+static inline RefFloat min(RefFloat a, RefFloat b) { return std::min(a.v, b.v); }
+static inline RefFloat max(RefFloat a, RefFloat b) { return std::max(a.v, b.v); }
+static inline RefFloat sqrt(RefFloat a) { return std::sqrt(a.v); }
+static inline RefFloat floor(RefFloat a) { return std::floor(a.v); }
+static inline RefFloat ceil(RefFloat a) { return std::ceil(a.v); }
+static inline RefFloat abs(RefFloat a) { return std::fabs(a.v); }
+static inline RefFloat exp(RefFloat a) { return std::exp(a.v); }
+static inline RefFloat gather(const float* base, RefFloat index) { return base[int(index.v)]; }
+#endif
+
+static inline RefFloat clamp(RefFloat x, RefFloat lo, RefFloat hi) { return min(max(x, lo), hi); }
+static inline RefFloat fract(RefFloat x) { return x - floor(x); }
+
+struct RefVec3 {
+    RefFloat x, y, z;
+    RefVec3() {}
+    RefVec3(RefFloat a, RefFloat b, RefFloat c) : x(a), y(b), z(c) {}
+    RefVec3(const glm::vec3& v) : x(v.x), y(v.y), z(v.z) {}
+};
+static inline RefVec3 operator+(const RefVec3& a, const RefVec3& b) { return {a.x + b.x, a.y + b.y, a.z + b.z}; }
+static inline RefVec3 operator-(const RefVec3& a, const RefVec3& b) { return {a.x - b.x, a.y - b.y, a.z - b.z}; }
+static inline RefVec3 operator*(const RefVec3& a, RefFloat s) { return {a.x * s, a.y * s, a.z * s}; }
+static inline RefFloat dot(const RefVec3& a, const RefVec3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+static inline RefFloat length(const RefVec3& a) { return sqrt(dot(a, a)); }
+
+// CPU port of the per-fragment fog path: FOG_FRAG's surface shading over
+// march(), directLightAt(), shadowAtPoint() and attenuate(). Surfaces and
+// the shadow map are ray cast against the object BVH instead of rasterised;
+// the march runs on REF_LANES neighbouring pixels at once. Reads the same
+// FrameData the shaders do. The shadow hierarchy is not ported, it only
+// skips lookups whose result it already knows.
+// Against the GPU at 8 bits: RMSE under 0.5 and at most 1 step apart from
+// a few silhouette pixels; scenes full of small occluders (--cubes) add
+// shadow-edge texels that flip, around RMSE 1.5.
+struct ReferenceRenderer {
+    const vector<float>& sceneVerts;
+    const vector<Mesh>& meshes;
+    const vector<ObjectData>& objects;
+    const vector<uint32_t>& objectMesh;
+    const ObjectBVH& bvh;
+    uint32_t skyObject;
+    FrameData frame;
+    const vector<uint8_t>& noise; // NOISE_SIZE^3, as uploaded
+    const vector<float>& heightFog; // buildHeightFogLUT()
+    const vector<float>& phase; // buildPhaseLUT()
+
+    int shadowRes = 1024;
+    vector<float> shadowDepth = {}; // window-space depth, row 0 at the bottom like GL
+    vector<glm::mat4> worldToObject = {};
+    vector<float> noiseTexels = {};
+
+    struct Hit {
+        float t = FLT_MAX;
+        uint32_t object = ~0u;
+        glm::vec3 normal; // object space, as stored in the mesh
+    };
+
+    // Closest triangle of one object in (tMin, hit.t), both faces like the
+    // rasteriser (nothing enables GL_CULL_FACE). The ray is moved into object
+    // space unnormalised, so t is the same in both spaces.
+    void intersectObject(uint32_t id, const glm::vec3& ro, const glm::vec3& rd, float tMin, Hit& hit) const {
+        const glm::mat4& m = worldToObject[id];
+        glm::vec3 o = glm::vec3(m * glm::vec4(ro, 1.0f));
+        glm::vec3 d = glm::vec3(m * glm::vec4(rd, 0.0f));
+        const Mesh& mesh = meshes[objectMesh[id]];
+        for (GLsizei tri = 0; tri + 2 < mesh.count; tri += 3) {
+            const float* v0 = &sceneVerts[(mesh.first + tri) * 6];
+            const float* v1 = v0 + 6;
+            const float* v2 = v0 + 12;
+            // Moller-Trumbore
+            float e1x = v1[0] - v0[0], e1y = v1[1] - v0[1], e1z = v1[2] - v0[2];
+            float e2x = v2[0] - v0[0], e2y = v2[1] - v0[1], e2z = v2[2] - v0[2];
+            float px = d.y * e2z - d.z * e2y, py = d.z * e2x - d.x * e2z, pz = d.x * e2y - d.y * e2x;
+            float det = e1x * px + e1y * py + e1z * pz;
+            if (fabs(det) < 1e-12f) continue;
+            float inv = 1.0f / det;
+            float sx = o.x - v0[0], sy = o.y - v0[1], sz = o.z - v0[2];
+            float u = (sx * px + sy * py + sz * pz) * inv;
+            if (u < 0.0f || u > 1.0f) continue;
+            float qx = sy * e1z - sz * e1y, qy = sz * e1x - sx * e1z, qz = sx * e1y - sy * e1x;
+            float v = (d.x * qx + d.y * qy + d.z * qz) * inv;
+            if (v < 0.0f || u + v > 1.0f) continue;
+            float t = (e2x * qx + e2y * qy + e2z * qz) * inv;
+            if (t <= tMin || t >= hit.t) continue;
+            hit.t = t;
+            hit.object = id;
+            hit.normal = glm::vec3(v0[3], v0[4], v0[5]);
+        }
+    }
+
+    Hit trace(const glm::vec3& ro, const glm::vec3& rd, float tMin, float tMax, uint32_t mask) const {
+        Hit hit;
+        hit.t = tMax;
+        bvh.raycast(ro, rd, tMin, tMax, mask, [&](uint32_t id, float) {
+            intersectObject(id, ro, rd, tMin, hit);
+            return hit.t;
+        });
+        return hit;
+    }
+
+    // The shadow pass: one ray per texel centre from the near to the far
+    // plane of the light frustum (t in [0, 1]), keeping the depth the
+    // rasteriser would write there; cleared to 1 where nothing is hit
+    void renderShadowMap(int threads) {
+        glm::mat4 invLightVP = glm::inverse(frame.lightVP);
+        shadowDepth.assign(size_t(shadowRes) * shadowRes, 1.0f);
+        parallelFor(shadowRes, threads, [&](int row) {
+            for (int col = 0; col < shadowRes; ++col) {
+                float nx = (col + 0.5f) / shadowRes * 2.0f - 1.0f;
+                float ny = (row + 0.5f) / shadowRes * 2.0f - 1.0f;
+                glm::vec4 nearP = invLightVP * glm::vec4(nx, ny, -1.0f, 1.0f);
+                glm::vec4 farP = invLightVP * glm::vec4(nx, ny, 1.0f, 1.0f);
+                glm::vec3 ro = glm::vec3(nearP) / nearP.w;
+                glm::vec3 rd = glm::vec3(farP) / farP.w - ro;
+                Hit hit = trace(ro, rd, 0.0f, 1.0f, OBJ_STATIC | OBJ_DYNAMIC);
+                if (hit.object == ~0u) continue;
+                glm::vec4 clip = frame.lightVP * glm::vec4(ro + rd * hit.t, 1.0f);
+                shadowDepth[size_t(row) * shadowRes + col] = clip.z / clip.w * 0.5f + 0.5f;
+            }
+        });
+    }
+
+    // shadowAtPoint(): bilinear depth (GL_LINEAR, clamp to edge), then the
+    // biased compare
+    RefFloat shadowAtPoint(const RefVec3& p) const {
+        const glm::mat4& m = frame.lightVP;
+        RefFloat cx = p.x * m[0][0] + p.y * m[1][0] + p.z * m[2][0] + m[3][0];
+        RefFloat cy = p.x * m[0][1] + p.y * m[1][1] + p.z * m[2][1] + m[3][1];
+        RefFloat cz = p.x * m[0][2] + p.y * m[1][2] + p.z * m[2][2] + m[3][2];
+        RefFloat cw = p.x * m[0][3] + p.y * m[1][3] + p.z * m[2][3] + m[3][3];
+        RefFloat u = cx / cw * 0.5f + 0.5f, v = cy / cw * 0.5f + 0.5f;
+        RefMask outside = (u < 0.0f) | (u > 1.0f) | (v < 0.0f) | (v > 1.0f);
+        RefFloat sampleDepth = cz / cw * 0.5f + 0.5f;
+
+        float res = float(shadowRes), last = res - 1.0f;
+        RefFloat sx = clamp(u, 0.0f, 1.0f) * res - 0.5f, sy = clamp(v, 0.0f, 1.0f) * res - 0.5f;
+        RefFloat x0 = floor(sx), y0 = floor(sy);
+        RefFloat fx = sx - x0, fy = sy - y0;
+        RefFloat xa = clamp(x0, 0.0f, last), xb = clamp(x0 + 1.0f, 0.0f, last);
+        RefFloat ya = clamp(y0, 0.0f, last) * res, yb = clamp(y0 + 1.0f, 0.0f, last) * res;
+        const float* texels = shadowDepth.data();
+        RefFloat d00 = gather(texels, ya + xa), d10 = gather(texels, ya + xb);
+        RefFloat d01 = gather(texels, yb + xa), d11 = gather(texels, yb + xb);
+        RefFloat d0 = d00 + (d10 - d00) * fx, d1 = d01 + (d11 - d01) * fx;
+        RefFloat depthTex = d0 + (d1 - d0) * fy;
+        return select(outside | !(sampleDepth - frame.shadowBias > depthTex), 1.0f, 0.0f);
+    }
+
+    // fogNoise(): trilinear filtering with GL_REPEAT over the R8 volume
+    RefFloat fogNoise(const RefVec3& p) const {
+        if (frame.noiseAmount <= 0.0f) return 1.0f;
+        float size = float(NOISE_SIZE);
+        RefFloat coord[3] = {(p.x * frame.noiseScale + frame.windOffset.x) * size - 0.5f,
+                             (p.y * frame.noiseScale + frame.windOffset.y) * size - 0.5f,
+                             (p.z * frame.noiseScale + frame.windOffset.z) * size - 0.5f};
+        RefFloat lo[3], hi[3], f[3];
+        for (int a = 0; a < 3; ++a) {
+            RefFloat i = floor(coord[a]);
+            f[a] = coord[a] - i;
+            lo[a] = i - floor(i * (1.0f / size)) * size;
+            hi[a] = select(lo[a] < size - 1.0f, lo[a] + 1.0f, 0.0f);
+        }
+        const float* texels = noiseTexels.data();
+        RefFloat za = lo[2] * (size * size), zb = hi[2] * (size * size);
+        RefFloat ya = lo[1] * size, yb = hi[1] * size;
+        RefFloat c000 = gather(texels, za + ya + lo[0]), c100 = gather(texels, za + ya + hi[0]);
+        RefFloat c010 = gather(texels, za + yb + lo[0]), c110 = gather(texels, za + yb + hi[0]);
+        RefFloat c001 = gather(texels, zb + ya + lo[0]), c101 = gather(texels, zb + ya + hi[0]);
+        RefFloat c011 = gather(texels, zb + yb + lo[0]), c111 = gather(texels, zb + yb + hi[0]);
+        RefFloat x00 = c000 + (c100 - c000) * f[0], x10 = c010 + (c110 - c010) * f[0];
+        RefFloat x01 = c001 + (c101 - c001) * f[0], x11 = c011 + (c111 - c011) * f[0];
+        RefFloat y0 = x00 + (x10 - x00) * f[1], y1 = x01 + (x11 - x01) * f[1];
+        RefFloat n = y0 + (y1 - y0) * f[2];
+        return max(RefFloat(1.0f) + (n * 2.0f - 1.0f) * frame.noiseAmount, 0.0f);
+    }
+
+    RefFloat heightLayerIntegral(RefFloat h, float falloff) const {
+        if (falloff < 1e-6f) return h;
+        return select(h <= 0.0f, h, (RefFloat(1.0f) - exp(RefFloat(-falloff) * h)) / falloff);
+    }
+
+    RefFloat heightFogIntegral(RefFloat y) const {
+        const glm::vec4& layers = frame.heightFogLayers;
+        RefFloat h = y - layers.x;
+        return heightLayerIntegral(h, layers.y) * (1.0f - layers.z) + heightLayerIntegral(h, layers.w) * layers.z;
+    }
+
+    // heightFogMean(): bilinear (GL_LINEAR) between the texel centres, the
+    // closed form for lanes with an end outside the LUT's heights
+    RefFloat heightFogMean(RefFloat y0, RefFloat y1) const {
+        float lo = frame.heightFogRange[0], range = frame.heightFogRange[1] - lo;
+        float size = float(HEIGHT_FOG_LUT_SIZE), last = size - 1.0f;
+        RefFloat hx = (y0 - lo) / range, hy = (y1 - lo) / range;
+        RefMask outside = (hx < 0.0f) | (hx > 1.0f) | (hy < 0.0f) | (hy > 1.0f);
+        RefFloat exact = 0.0f;
+        if (any(outside)) {
+            const glm::vec4& layers = frame.heightFogLayers;
+            RefFloat mid = max((y0 + y1) * 0.5f - layers.x, 0.0f);
+            RefFloat density = exp(RefFloat(-layers.y) * mid) * (1.0f - layers.z) + exp(RefFloat(-layers.w) * mid) * layers.z;
+            RefFloat rise = y1 - y0;
+            RefMask flat = abs(rise) < HEIGHT_FOG_FLAT;
+            exact = select(flat, density, (heightFogIntegral(y1) - heightFogIntegral(y0)) / select(flat, 1.0f, rise));
+        }
+        RefFloat sx = clamp(hx, 0.0f, 1.0f) * last;
+        RefFloat sy = clamp(hy, 0.0f, 1.0f) * last;
+        RefFloat xa = floor(sx), ya = floor(sy);
+        RefFloat fx = sx - xa, fy = sy - ya;
+        RefFloat xb = min(xa + 1.0f, last), yb = min(ya + 1.0f, last) * size;
+        ya = ya * size;
+        const float* texels = heightFog.data();
+        RefFloat m00 = gather(texels, ya + xa), m10 = gather(texels, ya + xb);
+        RefFloat m01 = gather(texels, yb + xa), m11 = gather(texels, yb + xb);
+        RefFloat m0 = m00 + (m10 - m00) * fx, m1 = m01 + (m11 - m01) * fx;
+        return select(outside, exact, m0 + (m1 - m0) * fy);
+    }
+
+    RefFloat heightFogDepth(const glm::vec3& p, const RefVec3& dir, RefFloat len) const {
+        if (!frame.heightFog) return len;
+        return len * heightFogMean(p.y, RefFloat(p.y) + dir.y * len);
+    }
+
+    RefFloat fogDensityAt(const RefVec3& p) const {
+        RefFloat density = fogNoise(p);
+        return frame.heightFog ? density * heightFogMean(p.y, p.y) : density;
+    }
+
+    // octavePhase(), with the same linear filtering of the LUT
+    RefFloat octavePhase(RefFloat cosTheta, int o) const {
+        if (frame.phaseMode == 2) {
+            float last = float(PHASE_LUT_SIZE - 1);
+            RefFloat sx = sqrt(clamp(RefFloat(0.5f) - cosTheta * 0.5f, 0.0f, 1.0f)) * last;
+            RefFloat xa = floor(sx), fx = sx - xa;
+            RefFloat xb = min(xa + 1.0f, last);
+            const float* texels = phase.data() + size_t(o) * PHASE_LUT_SIZE;
+            RefFloat a = gather(texels, xa), b = gather(texels, xb);
+            return a + (b - a) * fx;
+        }
+        float weight = frame.octaveWeight[o];
+        if (frame.phaseMode == 0) return weight;
+        float gScale = frame.octaveG[o];
+        RefFloat lobes[2];
+        for (int l = 0; l < 2; ++l) {
+            float g = frame.phaseG[l] * gScale;
+            RefFloat d = RefFloat(1.0f + g * g) - cosTheta * (2.0f * g);
+            lobes[l] = RefFloat(1.0f - g * g) / (d * sqrt(d));
+        }
+        return (lobes[0] + (lobes[1] - lobes[0]) * frame.phaseBackBlend) * weight;
+    }
+
+    // directLightAt() without the colour: power * falloff * attenuation * shadow
+    RefFloat directLightAt(const RefVec3& p, const RefVec3& coneAxis) const {
+        RefVec3 toP = p - RefVec3(frame.lightPos);
+        RefFloat lightDistance = length(toP);
+        RefFloat coneDot = dot(toP, coneAxis) / lightDistance;
+        RefFloat t = clamp((coneDot - frame.coneAngleOuter) / (frame.coneAngleInner - frame.coneAngleOuter), 0.0f, 1.0f);
+        RefFloat directLightFactor = t * t * (3.0f - t * 2.0f);
+        RefFloat atten = 1.0f / (1.0f + lightDistance * 0.1f + lightDistance * lightDistance * 0.05f);
+        RefFloat lit = select(directLightFactor > 0.0f, shadowAtPoint(p), 0.0f);
+        return directLightFactor * atten * lit * frame.lightPower;
+    }
+
+    // coneInterval(), lane by lane; ro is the camera, shared by the packet
+    RefMask coneInterval(const glm::vec3& ro, const RefVec3& rd, RefFloat rayLen, const glm::vec3& coneAxis,
+                         RefFloat& tEnter, RefFloat& tExit) const {
+        glm::vec3 co = ro - frame.lightPos;
+        float cos2 = frame.coneAngleOuter * frame.coneAngleOuter;
+        RefVec3 axis(coneAxis);
+        RefFloat dv = dot(rd, axis);
+        float cv = glm::dot(co, coneAxis);
+        RefFloat a = dv * dv - cos2;
+        RefFloat b = dv * cv - dot(rd, RefVec3(co)) * cos2;
+        float c = cv * cv - cos2 * glm::dot(co, co);
+
+        RefFloat ts[4] = {0.0f, rayLen, rayLen, rayLen};
+        RefFloat disc = b * b - a * c;
+        RefMask quadratic = RefFloat(1e-6f) < abs(a);
+        RefMask twoRoots = quadratic & (RefFloat(0.0f) < disc);
+        RefMask linear = (!quadratic) & (RefFloat(1e-9f) < abs(b));
+        RefFloat sq = sqrt(max(disc, 0.0f));
+        RefFloat q0 = (RefFloat(0.0f) - b - sq) / a, q1 = (sq - b) / a;
+        RefFloat root = clamp(RefFloat(-c) / (b * 2.0f), 0.0f, rayLen);
+        ts[1] = select(twoRoots, clamp(min(q0, q1), 0.0f, rayLen), select(linear, root, ts[1]));
+        ts[2] = select(twoRoots, clamp(max(q0, q1), 0.0f, rayLen), select(linear, root, ts[2]));
+
+        tEnter = rayLen;
+        tExit = 0.0f;
+        for (int k = 0; k < 3; ++k) {
+            RefVec3 mid = RefVec3(ro - frame.lightPos) + rd * ((ts[k] + ts[k + 1]) * 0.5f);
+            RefMask inside = (RefFloat(1e-5f) < ts[k + 1] - ts[k]) & (RefFloat(frame.coneAngleOuter) * length(mid) < dot(mid, axis));
+            tEnter = select(inside, min(tEnter, ts[k]), tEnter);
+            tExit = select(inside, max(tExit, ts[k + 1]), tExit);
+        }
+        return tEnter < tExit;
+    }
+
+    // march() for REF_LANES rays from the camera, scaled by 1 / uLightColor;
+    // lanes outside `active` return 0
+    RefFloat march(const RefVec3& rd, RefFloat rayLen, RefFloat fragX, RefFloat fragY, RefMask active) const {
+        glm::vec3 ro = frame.viewPos;
+        glm::vec3 coneAxis = glm::normalize(frame.windowCenter - frame.lightPos);
+        RefFloat density = frame.fogDensity;
+        RefFloat scattered = RefFloat(frame.fogAmbient) * (1.0f - exp(RefFloat(0.0f) - density * heightFogDepth(ro, rd, rayLen)));
+
+        RefFloat tEnter = 0.0f, tExit = rayLen;
+        if (frame.coneClip) active = active & coneInterval(ro, rd, rayLen, coneAxis, tEnter, tExit);
+        if (!any(active)) return scattered;
+
+        // marchStepCount()
+        RefFloat numSteps = float(max(frame.numSamples, 1));
+        if (frame.adaptiveSteps) {
+            float stepLen = min(frame.stepTarget, 0.25f / max(frame.fogDensity, 1e-4f));
+            numSteps = clamp(ceil((tExit - tEnter) / max(stepLen, 1e-4f)),
+                             float(max(frame.stepRange[0], 1)), float(max(frame.stepRange[1], 1)));
+        }
+        numSteps = select(active, numSteps, 0.0f);
+        RefFloat stepSize = (tExit - tEnter) / max(numSteps, 1.0f);
+
+        RefFloat offset = 0.5f;
+        if (frame.dither) {
+            // ign(gl_FragCoord.xy + 5.588238 * uJitterFrame)
+            float jitter = 5.588238f * float(frame.jitterFrame);
+            offset = fract(RefFloat(52.9829189f) * fract((fragX + jitter) * 0.06711056f + (fragY + jitter) * 0.00583715f));
+        }
+
+        RefFloat viewDepth = density * heightFogDepth(ro, rd, tEnter + stepSize * offset);
+        RefFloat currentAttenuation = exp(RefFloat(0.0f) - viewDepth);
+        int octaves = max(frame.scatterOctaves, 1);
+        RefFloat scattering = density * stepSize;
+        RefVec3 axis(coneAxis);
+        float stepCount[REF_LANES];
+        numSteps.store(stepCount);
+        float maxSteps = *max_element(stepCount, stepCount + REF_LANES);
+        RefFloat direct = 0.0f;
+        for (int i = 0; i < int(maxSteps); ++i) {
+            RefMask stepping = RefFloat(float(i)) < numSteps;
+            if (frame.adaptiveSteps) stepping = stepping & !(currentAttenuation < frame.transmittanceEps);
+            if (!any(stepping)) break;
+            numSteps = select(stepping, numSteps, 0.0f); // termination is final
+            RefFloat t = tEnter + stepSize * (offset + float(i));
+            RefVec3 p = RefVec3(ro) + rd * t;
+            RefFloat stepScattering = scattering * fogDensityAt(p);
+            RefFloat cosTheta = 1.0f;
+            if (frame.phaseMode != 0) {
+                RefVec3 toP = p - RefVec3(frame.lightPos);
+                cosTheta = RefFloat(0.0f) - dot(toP, rd) / length(toP);
+            }
+            RefFloat inScattered = directLightAt(p, axis) * stepScattering;
+            RefFloat light = inScattered * currentAttenuation * octavePhase(cosTheta, 0);
+            for (int o = 1; o < octaves; ++o) {
+                light = light + inScattered * exp(RefFloat(0.0f) - viewDepth * frame.octaveExtinction[o]) * octavePhase(cosTheta, o);
+            }
+            direct = direct + select(stepping, light, 0.0f);
+            currentAttenuation = select(stepping, currentAttenuation * exp(RefFloat(0.0f) - stepScattering), currentAttenuation);
+            viewDepth = viewDepth + stepScattering;
+        }
+        return scattered + direct;
+    }
+
+    // One frame into an 8-bit RGB image, top row first. Pixel centres and
+    // the projection match a width x height framebuffer drawn with frame.proj.
+    vector<uint8_t> render(int width, int height, int threads) {
+        worldToObject.resize(objects.size());
+        for (size_t i = 0; i < objects.size(); ++i) worldToObject[i] = glm::inverse(objects[i].model);
+        noiseTexels.resize(noise.size());
+        for (size_t i = 0; i < noise.size(); ++i) noiseTexels[i] = noise[i] / 255.0f;
+        renderShadowMap(threads);
+
+        vector<uint8_t> image(size_t(width) * height * 3);
+        glm::mat4 invViewProj = frame.invViewProj;
+        glm::vec3 forward = -glm::vec3(frame.view[0][2], frame.view[1][2], frame.view[2][2]);
+        const int TILE = 16;
+        int tilesX = (width + TILE - 1) / TILE, tilesY = (height + TILE - 1) / TILE;
+        parallelFor(tilesX * tilesY, threads, [&](int tile) {
+            int x0 = (tile % tilesX) * TILE, y0 = (tile / tilesX) * TILE;
+            for (int y = y0; y < min(y0 + TILE, height); ++y) {
+                for (int x = x0; x < min(x0 + TILE, width); x += REF_LANES) {
+                    float dirX[REF_LANES], dirY[REF_LANES], dirZ[REF_LANES], len[REF_LANES], fragX[REF_LANES];
+                    glm::vec3 surface[REF_LANES];
+                    int lanes = min(REF_LANES, width - x);
+                    for (int l = 0; l < REF_LANES; ++l) {
+                        fragX[l] = float(x + l) + 0.5f;
+                        len[l] = 0.0f;
+                        dirX[l] = dirY[l] = dirZ[l] = 0.0f;
+                        surface[l] = glm::vec3(0.0f); // clear colour
+                        if (l >= lanes) continue;
+
+                        glm::vec4 ndc((x + l + 0.5f) / width * 2.0f - 1.0f, (y + 0.5f) / height * 2.0f - 1.0f, 1.0f, 1.0f);
+                        glm::vec4 farP = invViewProj * ndc;
+                        glm::vec3 rd = glm::normalize(glm::vec3(farP) / farP.w - frame.viewPos);
+                        float cosView = glm::dot(rd, forward);
+                        Hit hit = trace(frame.viewPos, rd, VIEW_NEAR / cosView, VIEW_FAR / cosView, OBJ_STATIC | OBJ_DYNAMIC);
+                        intersectObject(skyObject, frame.viewPos, rd, VIEW_NEAR / cosView, hit);
+                        if (hit.object == ~0u) continue;
+                        glm::vec3 albedo = glm::vec3(objects[hit.object].color);
+                        if (hit.object == skyObject) { surface[l] = albedo; continue; }
+
+                        // FOG_FRAG surface lighting
+                        glm::vec3 pos = frame.viewPos + rd * hit.t;
+                        glm::vec3 norm = glm::normalize(glm::mat3(glm::transpose(worldToObject[hit.object])) * hit.normal);
+                        glm::vec3 lightDir = glm::normalize(frame.lightPos - pos);
+                        float diff = max(glm::dot(norm, lightDir), 0.0f);
+                        surface[l] = albedo * (0.1f + frame.fogAmbient) + frame.lightColor * albedo * diff;
+                        dirX[l] = rd.x; dirY[l] = rd.y; dirZ[l] = rd.z;
+                        len[l] = hit.t;
+                    }
+
+                    RefFloat rayLen = RefFloat::load(len);
+                    RefVec3 rd(RefFloat::load(dirX), RefFloat::load(dirY), RefFloat::load(dirZ));
+                    RefFloat fog = march(rd, rayLen, RefFloat::load(fragX), float(y) + 0.5f, RefFloat(0.0f) < rayLen);
+                    RefFloat transmission = exp(RefFloat(0.0f) - RefFloat(frame.extinction) * heightFogDepth(frame.viewPos, rd, rayLen));
+                    float fogLane[REF_LANES], transmissionLane[REF_LANES];
+                    fog.store(fogLane);
+                    transmission.store(transmissionLane);
+
+                    for (int l = 0; l < lanes; ++l) {
+                        glm::vec3 color = surface[l] * transmissionLane[l] + frame.lightColor * fogLane[l];
+                        uint8_t* out = &image[(size_t(height - 1 - y) * width + x + l) * 3];
+                        for (int c = 0; c < 3; ++c) out[c] = uint8_t(glm::clamp(color[c], 0.0f, 1.0f) * 255.0f + 0.5f);
+                    }
+                }
+            }
+        });
+        return image;
+    }
+};
+
+static bool writePPM(const string& path, int width, int height, const vector<uint8_t>& rgb) {
+    ofstream file(path, ios::binary);
+    if (!file) return false;
+    file << "P6\n" << width << " " << height << "\n255\n";
+    file.write((const char*)rgb.data(), rgb.size());
+    return bool(file);
+}
+
+// GPU passes the benchmark times separately with GL_TIME_ELAPSED queries
+enum FramePass { PASS_SHADOW, PASS_SHADOW_MINMAX, PASS_FROXEL, PASS_SCENE, PASS_RESOLVE, PASS_COUNT };
+static const char* FRAME_PASS_NAMES[PASS_COUNT] = {"shadow", "shadow_minmax", "froxel", "scene", "resolve"};
+
+// Fields of one comma-separated line, empty ones included
+static vector<string> splitCommas(const string& line) {
+    vector<string> fields;
+    for (size_t p = 0; p <= line.size();) {
+        size_t comma = line.find(',', p);
+        if (comma == string::npos) comma = line.size();
+        fields.push_back(line.substr(p, comma - p));
+        p = comma + 1;
+    }
+    return fields;
+}
+
+// The inside of a JSON string literal holding s
+static string jsonEscape(const string& s) {
+    string escaped;
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if ((unsigned char)c < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+// The two files every results writer produces: <path>.csv, one row per
+// result and also the baseline format, and <path>.json
+struct ResultFiles {
+    ofstream csv, json;
+    explicit ResultFiles(const string& path) : csv(path + ".csv"), json(path + ".json") {}
+    bool ok() const { return bool(csv) && bool(json); }
+};
+
+// The rows of a results CSV (writeBenchResults(), writeQualityResults())
+// split into fields, header skipped; none when the file cannot be read
+static vector<vector<string>> readCsvRows(const string& path) {
+    vector<vector<string>> rows;
+    ifstream csv(path);
+    string line;
+    getline(csv, line); // header
+    while (getline(csv, line)) rows.push_back(splitCommas(line));
+    return rows;
+}
+
+// One point of a benchmark sweep: settings applied through setParam()
+struct BenchConfig {
+    string name;
+    vector<pair<string, string>> settings;
+};
+
+// Cross product of the sweep axes, each "name=v1,v2,..."
+static vector<BenchConfig> expandSweep(const vector<string>& axes) {
+    vector<BenchConfig> configs(1);
+    for (const string& axis : axes) {
+        size_t eq = axis.find('=');
+        if (eq == string::npos) {
+            cerr << "Bad sweep " << axis << " (expected name=v1,v2,...)" << endl;
+            continue;
+        }
+        string name = axis.substr(0, eq);
+        vector<string> values = splitCommas(axis.substr(eq + 1));
+        vector<BenchConfig> expanded;
+        for (const BenchConfig& base : configs) {
+            for (const string& v : values) {
+                BenchConfig cfg = base;
+                cfg.name += (cfg.name.empty() ? "" : " ") + name + "=" + v;
+                cfg.settings.push_back({name, v});
+                expanded.push_back(cfg);
+            }
+        }
+        configs.swap(expanded);
+    }
+    return configs;
+}
+
+// Nearest-rank percentile, p in (0, 100]
+static double percentile(vector<double> v, double p) {
+    if (v.empty()) return 0.0;
+    sort(v.begin(), v.end());
+    size_t rank = size_t(ceil(p / 100.0 * double(v.size())));
+    return v[min(v.size(), max(rank, size_t(1))) - 1];
+}
+
+// Frame times of one config over one camera preset, in milliseconds
+struct BenchResult {
+    string config;
+    int preset = 0, frames = 0;
+    double mean = 0.0, p50 = 0.0, p95 = 0.0, p99 = 0.0;
+    double passMean[PASS_COUNT] = {};
+};
+
+// Writes <path>.csv (one row per result, also the baseline format) and
+// <path>.json
+static bool writeBenchResults(const string& path, const string& renderer, int width, int height,
+                              const vector<BenchResult>& results) {
+    ResultFiles out(path);
+    if (!out.ok()) return false;
+    ofstream &csv = out.csv, &json = out.json;
+    csv << "config,preset,frames,mean_ms,p50_ms,p95_ms,p99_ms";
+    for (const char* pass : FRAME_PASS_NAMES) csv << "," << pass << "_ms";
+    csv << "\n";
+    json << "{\n  \"renderer\": \"" << jsonEscape(renderer) << "\",\n  \"width\": " << width << ",\n  \"height\": " << height
+         << ",\n  \"results\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        csv << r.config << "," << r.preset << "," << r.frames << "," << r.mean << "," << r.p50 << "," << r.p95 << "," << r.p99;
+        json << (i ? "," : "") << "\n    {\"config\": \"" << jsonEscape(r.config) << "\", \"preset\": " << r.preset
+             << ", \"frames\": " << r.frames << ", \"mean_ms\": " << r.mean << ", \"p50_ms\": " << r.p50
+             << ", \"p95_ms\": " << r.p95 << ", \"p99_ms\": " << r.p99 << ", \"passes_ms\": {";
+        for (int p = 0; p < PASS_COUNT; ++p) {
+            csv << "," << r.passMean[p];
+            json << (p ? ", " : "") << "\"" << FRAME_PASS_NAMES[p] << "\": " << r.passMean[p];
+        }
+        csv << "\n";
+        json << "}}";
+    }
+    json << "\n  ]\n}\n";
+    return out.ok();
+}
+
+// Reads results back from a CSV written by writeBenchResults()
+static vector<BenchResult> readBenchBaseline(const string& path) {
+    vector<BenchResult> results;
+    for (const vector<string>& fields : readCsvRows(path)) {
+        if (fields.size() < 7 + PASS_COUNT) continue;
+        BenchResult r;
+        r.config = fields[0];
+        r.preset = atoi(fields[1].c_str());
+        r.frames = atoi(fields[2].c_str());
+        r.mean = atof(fields[3].c_str());
+        r.p50 = atof(fields[4].c_str());
+        r.p95 = atof(fields[5].c_str());
+        r.p99 = atof(fields[6].c_str());
+        for (int p = 0; p < PASS_COUNT; ++p) r.passMean[p] = atof(fields[7 + p].c_str());
+        results.push_back(r);
+    }
+    return results;
+}
+
+// --render: frames read back from the GPU and written out by a pool of
+// encoder threads. 8-bit formats are read back as RGBA8, PFM as RGBA32F;
+// either way bottom row first, as glReadPixels returns them.
+enum FrameFormat { FRAME_PNG, FRAME_PPM, FRAME_PFM };
+static const char* FRAME_FORMAT_NAMES[] = {"png", "ppm", "pfm"};
+
+static size_t framePixelBytes(FrameFormat format) { return format == FRAME_PFM ? 4 * sizeof(float) : 4; }
+
+// RGBA8 bottom-up to RGB8 top-down
+static vector<uint8_t> frameRGB8(const uint8_t* rgba, int width, int height) {
+    vector<uint8_t> rgb(size_t(width) * height * 3);
+    for (int y = 0; y < height; ++y) {
+        const uint8_t* src = rgba + size_t(height - 1 - y) * width * 4;
+        uint8_t* dst = rgb.data() + size_t(y) * width * 3;
+        for (int x = 0; x < width; ++x) memcpy(dst + x * 3, src + x * 4, 3);
+    }
+    return rgb;
+}
+
+// PNG with stored (uncompressed) deflate blocks, so it needs no zlib: larger
+// files, but valid for any reader and cheap to produce
+static bool writePNG(const string& path, int width, int height, const vector<uint8_t>& rgb) {
+    static uint32_t crcTable[256];
+    static bool crcReady = [] {
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            crcTable[n] = c;
+        }
+        return true;
+    }();
+    (void)crcReady;
+    auto put32 = [](vector<uint8_t>& out, uint32_t v) {
+        for (int shift = 24; shift >= 0; shift -= 8) out.push_back(uint8_t(v >> shift));
+    };
+    auto chunk = [&](ofstream& file, const char* type, const vector<uint8_t>& data) {
+        vector<uint8_t> out;
+        put32(out, uint32_t(data.size()));
+        out.insert(out.end(), type, type + 4);
+        out.insert(out.end(), data.begin(), data.end());
+        uint32_t crc = 0xFFFFFFFFu;
+        for (size_t i = 4; i < out.size(); ++i) crc = crcTable[(crc ^ out[i]) & 0xFF] ^ (crc >> 8);
+        put32(out, crc ^ 0xFFFFFFFFu);
+        file.write((const char*)out.data(), out.size());
+    };
+
+    // Scanlines with filter type 0, in 65535-byte stored blocks
+    size_t rowBytes = size_t(width) * 3;
+    vector<uint8_t> raw;
+    raw.reserve((rowBytes + 1) * height);
+    for (int y = 0; y < height; ++y) {
+        raw.push_back(0);
+        raw.insert(raw.end(), rgb.begin() + y * rowBytes, rgb.begin() + (y + 1) * rowBytes);
+    }
+    vector<uint8_t> idat = {0x78, 0x01};
+    for (size_t p = 0; p < raw.size(); p += 65535) {
+        size_t len = min<size_t>(65535, raw.size() - p);
+        idat.push_back(p + len == raw.size() ? 1 : 0);
+        idat.push_back(uint8_t(len));
+        idat.push_back(uint8_t(len >> 8));
+        idat.push_back(uint8_t(~len));
+        idat.push_back(uint8_t(~len >> 8));
+        idat.insert(idat.end(), raw.begin() + p, raw.begin() + p + len);
+    }
+    uint32_t a = 1, b = 0;
+    for (uint8_t v : raw) {
+        a = (a + v) % 65521;
+        b = (b + a) % 65521;
+    }
+    put32(idat, (b << 16) | a);
+
+    ofstream file(path, ios::binary);
+    if (!file) return false;
+    file.write("\x89PNG\r\n\x1a\n", 8);
+    vector<uint8_t> ihdr;
+    put32(ihdr, uint32_t(width));
+    put32(ihdr, uint32_t(height));
+    ihdr.insert(ihdr.end(), {8, 2, 0, 0, 0}); // 8-bit RGB
+    chunk(file, "IHDR", ihdr);
+    chunk(file, "IDAT", idat);
+    chunk(file, "IEND", {});
+    return bool(file);
+}
+
+// PFM: little-endian float RGB, bottom row first like the readback
+static bool writePFM(const string& path, int width, int height, const float* rgba) {
+    ofstream file(path, ios::binary);
+    if (!file) return false;
+    file << "PF\n" << width << " " << height << "\n-1.0\n";
+    vector<float> row(size_t(width) * 3);
+    for (int y = 0; y < height; ++y) {
+        const float* src = rgba + size_t(y) * width * 4;
+        for (int x = 0; x < width; ++x) memcpy(&row[x * 3], src + x * 4, 3 * sizeof(float));
+        file.write((const char*)row.data(), row.size() * sizeof(float));
+    }
+    return bool(file);
+}
+
+// Encoder threads fed by the render loop. Submitting blocks once maxQueued
+// frames are waiting, which bounds the memory when the disk falls behind;
+// pixel buffers go back to a free list instead of being reallocated.
+class FrameWriter {
+public:
+    struct Job {
+        string path;
+        int width = 0, height = 0;
+        FrameFormat format = FRAME_PNG;
+        vector<uint8_t> pixels;
+    };
+
+    uint64_t written = 0, failed = 0;
+    size_t peakQueued = 0;
+    double busySeconds = 0.0;  // summed over the threads
+    double blockedSeconds = 0.0; // the render loop waiting to submit
+
+    void start(int threads, size_t maxQueued) {
+        limit = max<size_t>(maxQueued, 1);
+        count = max(threads, 1);
+        for (int i = 0; i < count; ++i) workers.emplace_back([this] { run(); });
+    }
+
+    vector<uint8_t> buffer(size_t bytes) {
+        lock_guard<mutex> lock(m);
+        vector<uint8_t> pixels;
+        if (!spare.empty()) {
+            pixels.swap(spare.back());
+            spare.pop_back();
+        }
+        pixels.resize(bytes);
+        return pixels;
+    }
+
+    void submit(Job&& job) {
+        unique_lock<mutex> lock(m);
+        if (queue.size() >= limit) {
+            auto start = std::chrono::steady_clock::now();
+            space.wait(lock, [&] { return queue.size() < limit; });
+            blockedSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        queue.push_back(move(job));
+        peakQueued = max(peakQueued, queue.size());
+        ready.notify_one();
+    }
+
+    // Waits for every submitted frame to be written
+    void finish() {
+        {
+            lock_guard<mutex> lock(m);
+            quit = true;
+        }
+        ready.notify_all();
+        for (thread& t : workers) t.join();
+        workers.clear();
+    }
+
+    int threads() const { return count; }
+
+private:
+    mutex m;
+    condition_variable ready, space;
+    deque<Job> queue;
+    vector<vector<uint8_t>> spare;
+    vector<thread> workers;
+    size_t limit = 1;
+    int count = 0;
+    bool quit = false;
+
+    void run() {
+        unique_lock<mutex> lock(m);
+        while (true) {
+            ready.wait(lock, [&] { return quit || !queue.empty(); });
+            if (queue.empty()) return;
+            Job job = move(queue.front());
+            queue.pop_front();
+            space.notify_one();
+            lock.unlock();
+            auto start = std::chrono::steady_clock::now();
+            bool ok = job.format == FRAME_PFM
+                ? writePFM(job.path, job.width, job.height, (const float*)job.pixels.data())
+                : job.format == FRAME_PPM ? writePPM(job.path, job.width, job.height, frameRGB8(job.pixels.data(), job.width, job.height))
+                                          : writePNG(job.path, job.width, job.height, frameRGB8(job.pixels.data(), job.width, job.height));
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (!ok) cerr << "Failed to write " << job.path << endl;
+            lock.lock();
+            busySeconds += seconds;
+            (ok ? written : failed)++;
+            spare.push_back(move(job.pixels));
+        }
+    }
+};
+
+// --quality: image error against a ground truth. RMSE and PSNR are over
+// the 8-bit RGB values; FLIP follows LDR-FLIP (Andersson et al. 2020): a
+// contrast-sensitivity filtered colour difference in Hunt-adjusted L*a*b*
+// (HyAB), raised where edges or points differ, for a viewer at
+// QUALITY_PPD pixels per degree (a 0.7 m wide 4K monitor at 0.7 m, the
+// paper's default). Both take RGBA8 rows as read back.
+static const float QUALITY_PPD = 67.0f;
+
+static void rmsePSNR(const uint8_t* a, const uint8_t* b, int width, int height, double& rmse, double& psnr) {
+    double sum = 0.0;
+    size_t pixels = size_t(width) * height;
+    for (size_t i = 0; i < pixels; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            double d = double(a[i * 4 + c]) - double(b[i * 4 + c]);
+            sum += d * d;
+        }
+    }
+    rmse = sqrt(sum / double(max<size_t>(pixels * 3, 1)));
+    psnr = rmse > 0.0 ? min(20.0 * log10(255.0 / rmse), 99.0) : 99.0;
+}
+
+// One image's FLIP inputs: the filtered colour and the edge and point
+// strengths of its luminance. The truth's are computed once per view.
+struct FlipImage {
+    int width = 0, height = 0;
+    vector<float> lab;    // 3 per pixel, Hunt-adjusted
+    vector<float> edges, points;
+};
+
+// Convolution with kx along rows then ky along columns, edges clamped
+static void convolveSeparable(const vector<float>& src, vector<float>& dst, int width, int height,
+                              const vector<float>& kx, const vector<float>& ky, int threads) {
+    int rx = int(kx.size()) / 2, ry = int(ky.size()) / 2;
+    vector<float> rows(src.size());
+    dst.resize(src.size());
+    parallelFor(height, threads, [&](int y) {
+        const float* in = src.data() + size_t(y) * width;
+        for (int x = 0; x < width; ++x) {
+            float sum = 0.0f;
+            for (int k = -rx; k <= rx; ++k) sum += kx[k + rx] * in[glm::clamp(x + k, 0, width - 1)];
+            rows[size_t(y) * width + x] = sum;
+        }
+    });
+    parallelFor(height, threads, [&](int y) {
+        for (int x = 0; x < width; ++x) {
+            float sum = 0.0f;
+            for (int k = -ry; k <= ry; ++k) sum += ky[k + ry] * rows[size_t(glm::clamp(y + k, 0, height - 1)) * width + x];
+            dst[size_t(y) * width + x] = sum;
+        }
+    });
+}
+
+static glm::vec3 flipXYZ(const glm::vec3& rgb) {
+    return {0.4124564f * rgb.x + 0.3575761f * rgb.y + 0.1804375f * rgb.z,
+            0.2126729f * rgb.x + 0.7151522f * rgb.y + 0.0721750f * rgb.z,
+            0.0193339f * rgb.x + 0.1191920f * rgb.y + 0.9503041f * rgb.z};
+}
+
+static const glm::vec3 FLIP_WHITE(0.950428545f, 1.0f, 1.088900371f); // flipXYZ(1, 1, 1)
+
+static glm::vec3 flipHuntLab(const glm::vec3& rgb) {
+    glm::vec3 xyz = flipXYZ(rgb) / FLIP_WHITE;
+    auto f = [](float t) { return t > 0.008856452f ? cbrt(t) : t / 0.128418549f + 0.137931034f; };
+    float l = 116.0f * f(xyz.y) - 16.0f;
+    return {l, 0.01f * l * 500.0f * (f(xyz.x) - f(xyz.y)), 0.01f * l * 200.0f * (f(xyz.y) - f(xyz.z))};
+}
+
+static float flipHyAB(const glm::vec3& a, const glm::vec3& b) {
+    return fabs(a.x - b.x) + sqrt((a.y - b.y) * (a.y - b.y) + (a.z - b.z) * (a.z - b.z));
+}
+
+static FlipImage flipPrepare(const uint8_t* rgba, int width, int height, int threads) {
+    FlipImage image;
+    image.width = width;
+    image.height = height;
+    size_t pixels = size_t(width) * height;
+
+    // sRGB to the opponent space YCxCz, luminance normalised to [0, 1]
+    vector<float> channel[3];
+    for (auto& c : channel) c.resize(pixels);
+    vector<float> luminance(pixels);
+    for (size_t i = 0; i < pixels; ++i) {
+        glm::vec3 rgb;
+        for (int c = 0; c < 3; ++c) {
+            float v = rgba[i * 4 + c] / 255.0f;
+            rgb[c] = v <= 0.04045f ? v / 12.92f : pow((v + 0.055f) / 1.055f, 2.4f);
+        }
+        glm::vec3 xyz = flipXYZ(rgb) / FLIP_WHITE;
+        channel[0][i] = 116.0f * xyz.y - 16.0f;
+        channel[1][i] = 500.0f * (xyz.x - xyz.y);
+        channel[2][i] = 200.0f * (xyz.y - xyz.z);
+        luminance[i] = xyz.y;
+    }
+
+    // Contrast sensitivity: a sum of Gaussians per channel (achromatic,
+    // red-green, blue-yellow), all on the widest one's radius
+    const float csf[3][4] = {{1.0f, 0.0047f, 0.0f, 1e-5f}, {1.0f, 0.0053f, 0.0f, 1e-5f}, {34.1f, 0.04f, 13.5f, 0.025f}};
+    const float pi2 = float(M_PI * M_PI);
+    int radius = int(ceil(3.0f * sqrt(0.04f / (2.0f * pi2)) * QUALITY_PPD));
+    for (int c = 0; c < 3; ++c) {
+        vector<float> kernel[2];
+        float weight[2], total = 0.0f;
+        for (int t = 0; t < 2; ++t) {
+            float a = csf[c][2 * t], b = csf[c][2 * t + 1];
+            float sum = 0.0f;
+            for (int x = -radius; x <= radius; ++x) {
+                float d = x / QUALITY_PPD;
+                kernel[t].push_back(exp(-pi2 * d * d / b));
+                sum += kernel[t].back();
+            }
+            weight[t] = a * sqrt(float(M_PI) / b);
+            total += weight[t] * sum * sum;
+        }
+        vector<float> filtered(pixels, 0.0f), term;
+        for (int t = 0; t < 2; ++t) {
+            if (weight[t] == 0.0f) continue;
+            convolveSeparable(channel[c], term, width, height, kernel[t], kernel[t], threads);
+            for (size_t i = 0; i < pixels; ++i) filtered[i] += weight[t] / total * term[i];
+        }
+        channel[c].swap(filtered);
+    }
+    image.lab.resize(pixels * 3);
+    for (size_t i = 0; i < pixels; ++i) {
+        float y = (channel[0][i] + 16.0f) / 116.0f;
+        glm::vec3 xyz = glm::vec3(channel[1][i] / 500.0f + y, y, y - channel[2][i] / 200.0f) * FLIP_WHITE;
+        glm::vec3 rgb(3.2404542f * xyz.x - 1.5371385f * xyz.y - 0.4985314f * xyz.z,
+                      -0.9692660f * xyz.x + 1.8760108f * xyz.y + 0.0415560f * xyz.z,
+                      0.0556434f * xyz.x - 0.2040259f * xyz.y + 1.0572252f * xyz.z);
+        for (int c = 0; c < 3; ++c) rgb[c] = glm::clamp(rgb[c], 0.0f, 1.0f);
+        glm::vec3 lab = flipHuntLab(rgb);
+        for (int c = 0; c < 3; ++c) image.lab[i * 3 + c] = lab[c];
+    }
+
+    // Edge and point detectors: first and second derivatives of a Gaussian
+    // 0.082 degrees wide, each side normalised to +-1
+    float sd = 0.5f * 0.082f * QUALITY_PPD;
+    int featureRadius = int(ceil(3.0f * sd));
+    vector<float> gauss, edge, point;
+    for (int x = -featureRadius; x <= featureRadius; ++x) {
+        float g = exp(-float(x * x) / (2.0f * sd * sd));
+        gauss.push_back(g);
+        edge.push_back(-float(x) * g);
+        point.push_back((float(x * x) / (sd * sd) - 1.0f) * g);
+    }
+    auto normalize = [](vector<float>& k) {
+        float positive = 0.0f, negative = 0.0f;
+        for (float v : k) (v > 0.0f ? positive : negative) += v;
+        for (float& v : k) v = v > 0.0f ? v / positive : v < 0.0f ? v / -negative : 0.0f;
+    };
+    normalize(edge);
+    normalize(point);
+    float gaussSum = accumulate(gauss.begin(), gauss.end(), 0.0f);
+    for (float& g : gauss) g /= gaussSum;
+    vector<float> dx, dy;
+    convolveSeparable(luminance, dx, width, height, edge, gauss, threads);
+    convolveSeparable(luminance, dy, width, height, gauss, edge, threads);
+    image.edges.resize(pixels);
+    for (size_t i = 0; i < pixels; ++i) image.edges[i] = sqrt(dx[i] * dx[i] + dy[i] * dy[i]);
+    convolveSeparable(luminance, dx, width, height, point, gauss, threads);
+    convolveSeparable(luminance, dy, width, height, gauss, point, threads);
+    image.points.resize(pixels);
+    for (size_t i = 0; i < pixels; ++i) image.points[i] = sqrt(dx[i] * dx[i] + dy[i] * dy[i]);
+    return image;
+}
+
+// Mean FLIP error of test against reference, 0 (identical) to 1
+static double flipMean(const FlipImage& reference, const FlipImage& test) {
+    const float qc = 0.7f, qf = 0.5f, pc = 0.4f, pt = 0.95f;
+    float cmax = pow(flipHyAB(flipHuntLab({0, 1, 0}), flipHuntLab({0, 0, 1})), qc);
+    size_t pixels = size_t(reference.width) * reference.height;
+    double sum = 0.0;
+    for (size_t i = 0; i < pixels; ++i) {
+        const float* a = &reference.lab[i * 3];
+        const float* b = &test.lab[i * 3];
+        float colour = pow(flipHyAB({a[0], a[1], a[2]}, {b[0], b[1], b[2]}), qc);
+        colour = colour < pc * cmax ? pt / (pc * cmax) * colour : pt + (colour - pc * cmax) / (cmax - pc * cmax) * (1.0f - pt);
+        float feature = max(fabs(reference.edges[i] - test.edges[i]), fabs(reference.points[i] - test.points[i]));
+        feature = pow(feature / float(M_SQRT2), qf);
+        sum += pow(colour, 1.0f - feature);
+    }
+    return sum / double(max<size_t>(pixels, 1));
+}
+
+// The ground truth the quality suite measures against: the per-fragment
+// march at full resolution with a high sample count, every approximation off
+static const char* QUALITY_TRUTH_SAMPLES = "1024";
+// A view whose truth is this close to the same view without the beam (RMSE
+// over 8-bit RGB) tells the configs apart by noise alone
+static const double QUALITY_MIN_BEAM_RMSE = 1.0;
+static const pair<const char*, const char*> QUALITY_TRUTH[] = {
+    {"numSamples", QUALITY_TRUTH_SAMPLES}, {"dithering", "0"}, {"adaptiveSteps", "0"}, {"fogMode", "0"},
+    {"volumeDownsample", "1"}, {"temporal", "0"}, {"showMapMode", "0"}, {"governor", "0"},
+};
+
+// Quality views: points inside the room, each looking at the middle of the
+// beam (the light at y = 2 down to its orbit on the floor) from across the
+// room, from a low corner and from up close. The camera presets are no use
+// here: 1 and 2 stand behind the back wall and never see the beam.
+static const glm::vec3 QUALITY_VIEWS[3] = {{0.0f, 1.2f, 1.8f}, {-1.8f, 0.5f, -1.8f}, {0.6f, 1.3f, 0.6f}};
+static const glm::vec3 QUALITY_AIM = {0.0f, 1.0f, 0.0f};
+
+// One config at one view: its median frame time and its error
+struct QualityResult {
+    string config;
+    int view = 0;
+    double phase = 0.0, ms = 0.0, rmse = 0.0, psnr = 0.0, flip = 0.0;
+};
+
+// A config averaged over the views. It is on the Pareto front when no
+// other config is both at least as fast and at least as accurate (FLIP)
+// and strictly better at one of them.
+struct QualitySummary {
+    string config;
+    double ms = 0.0, rmse = 0.0, psnr = 0.0, flip = 0.0;
+    bool pareto = false;
+};
+
+static vector<QualitySummary> summarizeQuality(const vector<QualityResult>& results) {
+    vector<QualitySummary> summaries;
+    vector<int> views;
+    for (const QualityResult& r : results) {
+        auto it = find_if(summaries.begin(), summaries.end(), [&](const QualitySummary& s) { return s.config == r.config; });
+        if (it == summaries.end()) {
+            summaries.push_back({r.config});
+            views.push_back(0);
+            it = summaries.end() - 1;
+        }
+        it->ms += r.ms;
+        it->rmse += r.rmse;
+        it->psnr += r.psnr;
+        it->flip += r.flip;
+        views[it - summaries.begin()]++;
+    }
+    for (size_t i = 0; i < summaries.size(); ++i) {
+        QualitySummary& s = summaries[i];
+        s.ms /= views[i];
+        s.rmse /= views[i];
+        s.psnr /= views[i];
+        s.flip /= views[i];
+    }
+    for (QualitySummary& s : summaries) {
+        s.pareto = none_of(summaries.begin(), summaries.end(), [&](const QualitySummary& o) {
+            return o.ms <= s.ms && o.flip <= s.flip && (o.ms < s.ms || o.flip < s.flip);
+        });
+    }
+    sort(summaries.begin(), summaries.end(), [](const QualitySummary& a, const QualitySummary& b) { return a.ms < b.ms; });
+    return summaries;
+}
+
+// Writes <path>.csv (one row per config and view, also the baseline
+// format) and <path>.json (those rows and the per-config summary)
+static bool writeQualityResults(const string& path, const string& renderer, int width, int height,
+                                const vector<QualityResult>& results, const vector<QualitySummary>& summaries) {
+    ResultFiles out(path);
+    if (!out.ok()) return false;
+    ofstream &csv = out.csv, &json = out.json;
+    csv << "config,view,phase,ms,rmse,psnr,flip\n";
+    json << "{\n  \"renderer\": \"" << jsonEscape(renderer) << "\",\n  \"width\": " << width << ",\n  \"height\": " << height
+         << ",\n  \"truth_samples\": " << QUALITY_TRUTH_SAMPLES << ",\n  \"pixels_per_degree\": " << QUALITY_PPD
+         << ",\n  \"results\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const QualityResult& r = results[i];
+        csv << r.config << "," << r.view << "," << r.phase << "," << r.ms << "," << r.rmse << "," << r.psnr << "," << r.flip << "\n";
+        json << (i ? "," : "") << "\n    {\"config\": \"" << jsonEscape(r.config) << "\", \"view\": " << r.view << ", \"phase\": " << r.phase
+             << ", \"ms\": " << r.ms << ", \"rmse\": " << r.rmse << ", \"psnr\": " << r.psnr << ", \"flip\": " << r.flip << "}";
+    }
+    json << "\n  ],\n  \"summary\": [";
+    for (size_t i = 0; i < summaries.size(); ++i) {
+        const QualitySummary& s = summaries[i];
+        json << (i ? "," : "") << "\n    {\"config\": \"" << jsonEscape(s.config) << "\", \"ms\": " << s.ms << ", \"rmse\": " << s.rmse
+             << ", \"psnr\": " << s.psnr << ", \"flip\": " << s.flip << ", \"pareto\": " << (s.pareto ? "true" : "false") << "}";
+    }
+    json << "\n  ]\n}\n";
+    return out.ok();
+}
+
+// Reads results back from a CSV written by writeQualityResults()
+static vector<QualityResult> readQualityBaseline(const string& path) {
+    vector<QualityResult> results;
+    for (const vector<string>& fields : readCsvRows(path)) {
+        if (fields.size() < 7) continue;
+        QualityResult r;
+        r.config = fields[0];
+        r.view = atoi(fields[1].c_str());
+        r.phase = atof(fields[2].c_str());
+        r.ms = atof(fields[3].c_str());
+        r.rmse = atof(fields[4].c_str());
+        r.psnr = atof(fields[5].c_str());
+        r.flip = atof(fields[6].c_str());
+        results.push_back(r);
+    }
+    return results;
+}
+
+// 3x5 overlay font, one octal digit per row, top row first (4 = left
+// column). Lower case draws as upper case; anything missing is blank.
+static const struct { char c; uint16_t rows; } FONT_3X5[] = {
+    {'0', 075557}, {'1', 026227}, {'2', 071747}, {'3', 071717}, {'4', 055711},
+    {'5', 074717}, {'6', 074757}, {'7', 071111}, {'8', 075757}, {'9', 075717},
+    {'A', 025755}, {'B', 065656}, {'C', 034443}, {'D', 065556}, {'E', 074647},
+    {'F', 074644}, {'G', 034553}, {'H', 055755}, {'I', 072227}, {'J', 011152},
+    {'K', 055655}, {'L', 044447}, {'M', 057755}, {'N', 065555}, {'O', 025552},
+    {'P', 065644}, {'Q', 025563}, {'R', 065655}, {'S', 034216}, {'T', 072222},
+    {'U', 055557}, {'V', 055552}, {'W', 055775}, {'X', 055255}, {'Y', 055222},
+    {'Z', 071247}, {'.', 000002}, {',', 000024}, {':', 002020}, {'%', 051245},
+    {'/', 011244}, {'-', 000700}, {'+', 002720}, {'=', 007070}, {'_', 000007},
+    {'(', 012221}, {')', 042224}, {'[', 032223}, {']', 062226},
+};
+
+// Lines of text as an 8-bit bitmap, top row first: 4x6 pixel cells (glyph
+// plus spacing) with a one-cell margin
+static vector<uint8_t> rasterizeText(const vector<string>& lines, int& width, int& height) {
+    size_t cols = 0;
+    for (const string& line : lines) cols = max(cols, line.size());
+    width = int(cols + 2) * 4;
+    height = int(lines.size() + 2) * 6;
+    vector<uint8_t> pixels(size_t(width) * height, 0);
+    for (size_t row = 0; row < lines.size(); ++row) {
+        for (size_t col = 0; col < lines[row].size(); ++col) {
+            char c = (char)toupper((unsigned char)lines[row][col]);
+            uint16_t glyph = 0;
+            for (const auto& g : FONT_3X5) if (g.c == c) glyph = g.rows;
+            for (int y = 0; y < 5; ++y) {
+                for (int x = 0; x < 3; ++x) {
+                    if ((glyph >> ((4 - y) * 3 + 2 - x)) & 1) pixels[((row + 1) * 6 + y) * width + (col + 1) * 4 + x] = 255;
+                }
+            }
+        }
+    }
+    return pixels;
+}
+
+// Frame profiler. CPU scopes read steady_clock; GPU scopes are GL_TIMESTAMP
+// pairs in a ring of LATENCY frames, read back when their slot comes round
+// again (or dropped if the GPU is still behind), so nothing waits on the GPU.
+// Times are ms since construction, GPU ones moved onto the CPU clock by an
+// offset sampled when profiling starts. Scopes nest. While disabled no frame
+// is open and every call returns straight away.
+struct Profiler {
+    struct Event { const char* name; double start, end; int depth; };
+    struct Frame {
+        uint64_t index = 0;
+        double start = 0.0, end = 0.0;
+        bool gpuDone = false;
+        vector<Event> cpu, gpu;
+    };
+    static const int LATENCY = 4;
+    static const int MAX_GPU_SCOPES = 32;
+
+    size_t historyFrames = 120;
+    deque<Frame> history;
+    uint64_t gpuDropped = 0;
+
+    bool enabled() const { return active; }
+
+    void setEnabled(bool on) {
+        if (on == active) return;
+        active = on;
+        for (GpuSlot& slot : slots) slot.count = -1;
+        if (!on) return;
+        if (!queriesCreated) {
+            for (GpuSlot& slot : slots) glGenQueries(2 * MAX_GPU_SCOPES, slot.queries);
+            queriesCreated = true;
+        }
+        GLint64 gpuNow = 0;
+        glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+        gpuOffset = cpuNow() - double(gpuNow) * 1e-6;
+        history.clear();
+        gpuDropped = 0;
+    }
+
+    void beginFrame(uint64_t index) {
+        if (!active) return;
+        GpuSlot& slot = slots[index % LATENCY];
+        collect(slot, false);
+        slot.frame = index;
+        slot.count = 0;
+        history.emplace_back();
+        history.back().index = index;
+        history.back().start = cpuNow();
+        while (history.size() > historyFrames) history.pop_front();
+        cpuStack.clear();
+        gpuStack.clear();
+        frameOpen = true;
+    }
+
+    void endFrame() {
+        if (!frameOpen) return;
+        while (!cpuStack.empty()) endCpu();
+        while (!gpuStack.empty()) endGpu();
+        history.back().end = cpuNow();
+        frameOpen = false;
+    }
+
+    void beginCpu(const char* name) {
+        if (!frameOpen) return;
+        Frame& frame = history.back();
+        cpuStack.push_back(int(frame.cpu.size()));
+        frame.cpu.push_back({name, cpuNow(), 0.0, int(cpuStack.size()) - 1});
+    }
+
+    void endCpu() {
+        if (!frameOpen || cpuStack.empty()) return;
+        history.back().cpu[cpuStack.back()].end = cpuNow();
+        cpuStack.pop_back();
+    }
+
+    void beginGpu(const char* name) {
+        if (!frameOpen) return;
+        GpuSlot& slot = slots[history.back().index % LATENCY];
+        if (slot.count == MAX_GPU_SCOPES) {
+            gpuStack.push_back(-1);
+            return;
+        }
+        int i = slot.count++;
+        slot.names[i] = name;
+        slot.depth[i] = int(gpuStack.size());
+        glQueryCounter(slot.queries[2 * i], GL_TIMESTAMP);
+        gpuStack.push_back(i);
+    }
+
+    void endGpu() {
+        if (!frameOpen || gpuStack.empty()) return;
+        int i = gpuStack.back();
+        gpuStack.pop_back();
+        if (i >= 0) glQueryCounter(slots[history.back().index % LATENCY].queries[2 * i + 1], GL_TIMESTAMP);
+    }
+
+    // Waits for every outstanding slot; only between frames (before a dump)
+    void collectAll() {
+        for (GpuSlot& slot : slots) collect(slot, true);
+    }
+
+    // Mean ms per frame of each scope over the last `frames` frames, indented
+    // by depth, in the order the scopes ran
+    vector<string> summary(size_t frames) const {
+        struct Row { const char* name; int depth; double total; };
+        auto addEvents = [](vector<Row>& rows, const vector<Event>& events) {
+            size_t at = 0;
+            for (const Event& e : events) {
+                auto it = find_if(rows.begin(), rows.end(), [&](const Row& r) { return r.depth == e.depth && strcmp(r.name, e.name) == 0; });
+                if (it == rows.end()) it = rows.insert(rows.begin() + min(at, rows.size()), Row{e.name, e.depth, 0.0});
+                it->total += e.end - e.start;
+                at = size_t(it - rows.begin()) + 1;
+            }
+        };
+        vector<Row> cpuRows, gpuRows;
+        int cpuFrames = 0, gpuFrames = 0;
+        double frameTotal = 0.0;
+        for (auto f = history.rbegin(); f != history.rend() && size_t(cpuFrames) < frames; ++f) {
+            if (f->end <= f->start) continue;
+            addEvents(cpuRows, f->cpu);
+            frameTotal += f->end - f->start;
+            cpuFrames++;
+            if (!f->gpuDone) continue;
+            addEvents(gpuRows, f->gpu);
+            gpuFrames++;
+        }
+        vector<string> lines;
+        char line[64];
+        snprintf(line, sizeof(line), "frame %7.2f ms  (%d frames)", cpuFrames ? frameTotal / cpuFrames : 0.0, cpuFrames);
+        lines.push_back(line);
+        auto addRows = [&](const char* title, const vector<Row>& rows, int count) {
+            lines.push_back(title);
+            for (const Row& r : rows) {
+                snprintf(line, sizeof(line), "%*s%-*s %7.3f", 2 + 2 * r.depth, "", 18 - 2 * r.depth, r.name, r.total / max(count, 1));
+                lines.push_back(line);
+            }
+        };
+        addRows("cpu", cpuRows, cpuFrames);
+        snprintf(line, sizeof(line), "gpu (%d frames, %llu dropped)", gpuFrames, (unsigned long long)gpuDropped);
+        addRows(line, gpuRows, gpuFrames);
+        return lines;
+    }
+
+    // Chrome trace-event JSON (chrome://tracing, Perfetto) of the frames in
+    // the history: CPU scopes nested under a frame event, GPU scopes on
+    // their own track
+    bool writeTrace(const string& path) const {
+        ofstream file(path);
+        if (!file) return false;
+        file << fixed;
+        file.precision(3);
+        file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+             << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"CPU\"}},\n"
+             << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"GPU\"}}";
+        auto event = [&](const string& name, double start, double end, int tid) {
+            file << ",\n{\"name\":\"" << name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+                 << ",\"ts\":" << start * 1000.0 << ",\"dur\":" << max(end - start, 0.0) * 1000.0 << "}";
+        };
+        for (const Frame& f : history) {
+            if (f.end <= f.start) continue;
+            event("frame " + to_string(f.index), f.start, f.end, 1);
+            for (const Event& e : f.cpu) event(e.name, e.start, e.end, 1);
+            for (const Event& e : f.gpu) event(e.name, e.start, e.end, 2);
+        }
+        file << "\n]}\n";
+        return bool(file);
+    }
+
+private:
+    struct GpuSlot {
+        GLuint queries[2 * MAX_GPU_SCOPES];
+        const char* names[MAX_GPU_SCOPES];
+        int depth[MAX_GPU_SCOPES];
+        int count = -1;
+        uint64_t frame = 0;
+    };
+
+    double cpuNow() const {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - origin).count();
+    }
+
+    // Moves a slot's timestamps into its frame. Without `wait` the slot is
+    // dropped if any of its queries is still pending.
+    void collect(GpuSlot& slot, bool wait) {
+        if (slot.count < 0) return;
+        int count = slot.count;
+        slot.count = -1;
+        for (int q = 0; q < 2 * count && !wait; ++q) {
+            GLint ready = 0;
+            glGetQueryObjectiv(slot.queries[q], GL_QUERY_RESULT_AVAILABLE, &ready);
+            if (!ready) {
+                gpuDropped++;
+                return;
+            }
+        }
+        auto frame = find_if(history.begin(), history.end(), [&](const Frame& f) { return f.index == slot.frame; });
+        if (frame == history.end()) return;
+        for (int i = 0; i < count; ++i) {
+            GLuint64 begin = 0, end = 0;
+            glGetQueryObjectui64v(slot.queries[2 * i], GL_QUERY_RESULT, &begin);
+            glGetQueryObjectui64v(slot.queries[2 * i + 1], GL_QUERY_RESULT, &end);
+            frame->gpu.push_back({slot.names[i], gpuOffset + double(begin) * 1e-6, gpuOffset + double(end) * 1e-6, slot.depth[i]});
+        }
+        frame->gpuDone = true;
+    }
+
+    GpuSlot slots[LATENCY];
+    bool active = false, frameOpen = false, queriesCreated = false;
+    vector<int> cpuStack, gpuStack;
+    double gpuOffset = 0.0;
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+};
+
+// Closed-loop quality governor. The frame time it steers is the larger of
+// the CPU time up to the swap and the GPU time of the profiler's newest
+// finished frame, the median over WINDOW frames so a one-off hitch does
+// not count. Over budget, it cuts the fog or the shadow ladder, whichever
+// passes cost more that window; with UP_HEADROOM to spare for upHold
+// frames it restores the most recent cut. A restore that has to be cut
+// again within PROBE_FRAMES doubles upHold, so a level that does not fit
+// is not retried every second. A cut that made the frame slower (the
+// deferred volume pass has a fixed cost that can outweigh what it saves)
+// is reverted, and its ladder stops there. The window restarts after
+// every change, keeping the program build or reallocation the change
+// causes out of the next decision. The settings in force when the
+// governor is switched on are the top of both ladders, and come back when
+// it is switched off.
+struct QualityGovernor {
+    // Fog ladder: fraction of the sample counts at a volume downsample.
+    // Few distinct counts, so few specialized programs get built.
+    struct FogLevel { float samples; int downsample; };
+    static constexpr FogLevel FOG_LADDER[] = {{1.0f, 1}, {0.75f, 1}, {0.5f, 1}, {0.75f, 2}, {0.5f, 2}, {0.5f, 4}, {0.25f, 4}};
+    static const int FOG_LEVELS = int(sizeof(FOG_LADDER) / sizeof(FOG_LADDER[0]));
+    static const int SHADOW_LEVELS = 3;  // full, half and quarter size
+    static const int MIN_SHADOW_RES = 128;
+    static const int WINDOW = 30, BASE_UP_HOLD = 90, MAX_UP_HOLD = 1440, PROBE_FRAMES = 60;
+    static constexpr double UP_HEADROOM = 0.75, REVERT_SLOWDOWN = 1.25;
+
+    enum Knob { KNOB_FOG, KNOB_SHADOW };
+    int fogLevel = 0, shadowLevel = 0;
+    int upHold = BASE_UP_HOLD;
+    ofstream log;  // CSV of every decision when opened
+
+    // Takes the current settings as full quality
+    void start(double now) {
+        baseSamples = g_numSamples;
+        baseTemporalSamples = g_temporalSamples;
+        baseDownsample = g_volumeDownsample;
+        baseShadowRes = g_shadowRes;
+        fogLevel = shadowLevel = 0;
+        fogLimit = FOG_LEVELS - 1;
+        shadowLimit = SHADOW_LEVELS - 1;
+        cutCount = 0;
+        upHold = BASE_UP_HOLD;
+        lastWasRestore = false;
+        lastCutMs = 0.0;
+        restart();
+        printSettings("governor on");
+        logRow(now, "start", "", 0, 0.0, 0.0, 0.0);
+    }
+
+    void stop(double now) {
+        fogLevel = shadowLevel = 0;
+        apply();
+        printSettings("governor off");
+        logRow(now, "stop", "", 0, 0.0, 0.0, 0.0);
+    }
+
+    // Throws the window away, e.g. when the budget changes
+    void restart() {
+        filled = 0;
+        sinceChange = 0;
+    }
+
+    void update(double now, double frameMs, double fogMs, double shadowMs) {
+        frame[next] = frameMs;
+        fog[next] = fogMs;
+        shadow[next] = shadowMs;
+        next = (next + 1) % WINDOW;
+        filled = min(filled + 1, WINDOW);
+        sinceChange++;
+        if (filled < WINDOW) return;
+
+        double sorted[WINDOW];
+        copy(frame, frame + WINDOW, sorted);
+        nth_element(sorted, sorted + WINDOW / 2, sorted + WINDOW);
+        double medianMs = sorted[WINDOW / 2];
+        double meanFog = accumulate(fog, fog + WINDOW, 0.0) / WINDOW;
+        double meanShadow = accumulate(shadow, shadow + WINDOW, 0.0) / WINDOW;
+        if (lastCutMs > 0.0 && sinceChange == WINDOW && medianMs > lastCutMs * REVERT_SLOWDOWN) {
+            Knob knob = cuts[--cutCount];
+            int& level = knob == KNOB_FOG ? fogLevel : shadowLevel;
+            (knob == KNOB_FOG ? fogLimit : shadowLimit) = --level;
+            lastCutMs = 0.0;
+            change(now, "revert", knob, medianMs, meanFog, meanShadow);
+            return;
+        }
+        if (sinceChange == WINDOW) lastCutMs = 0.0;
+        if (medianMs > g_frameBudgetMs) {
+            Knob knob = meanShadow > meanFog ? KNOB_SHADOW : KNOB_FOG;
+            if (!canCut(knob)) knob = knob == KNOB_FOG ? KNOB_SHADOW : KNOB_FOG;
+            if (!canCut(knob)) {
+                if (sinceChange == WINDOW) {
+                    cout << "governor: " << medianMs << " ms over the " << g_frameBudgetMs << " ms budget at the lowest quality" << endl;
+                    logRow(now, "floor", "", 0, medianMs, meanFog, meanShadow);
+                }
+                return;
+            }
+            if (lastWasRestore && sinceChange <= PROBE_FRAMES) upHold = min(upHold * 2, MAX_UP_HOLD);
+            (knob == KNOB_FOG ? fogLevel : shadowLevel)++;
+            cuts[cutCount++] = knob;
+            lastWasRestore = false;
+            lastCutMs = medianMs;
+            change(now, "cut", knob, medianMs, meanFog, meanShadow);
+        } else if (medianMs < g_frameBudgetMs * UP_HEADROOM && cutCount > 0 && sinceChange >= upHold) {
+            if (lastWasRestore) upHold = max(upHold / 2, BASE_UP_HOLD);
+            Knob knob = cuts[--cutCount];
+            (knob == KNOB_FOG ? fogLevel : shadowLevel)--;
+            lastWasRestore = true;
+            change(now, "restore", knob, medianMs, meanFog, meanShadow);
+        }
+    }
+
+private:
+    int baseSamples = 0, baseTemporalSamples = 0, baseDownsample = 1, baseShadowRes = 1024;
+    double frame[WINDOW] = {}, fog[WINDOW] = {}, shadow[WINDOW] = {};
+    int next = 0, filled = 0, sinceChange = 0;
+    Knob cuts[FOG_LEVELS + SHADOW_LEVELS];
+    int cutCount = 0;
+    int fogLimit = FOG_LEVELS - 1, shadowLimit = SHADOW_LEVELS - 1;
+    bool lastWasRestore = false;
+    double lastCutMs = 0.0;  // window median that triggered the last cut, until it is judged
+
+    bool canCut(Knob knob) const {
+        if (knob == KNOB_FOG) return fogLevel < fogLimit;
+        return shadowLevel < shadowLimit && (baseShadowRes >> (shadowLevel + 1)) >= MIN_SHADOW_RES;
+    }
+
+    void apply() {
+        const FogLevel& f = FOG_LADDER[fogLevel];
+        g_numSamples = max(4, int(round(baseSamples * f.samples)));
+        g_temporalSamples = max(2, int(round(baseTemporalSamples * f.samples)));
+        g_volumeDownsample = max(baseDownsample, f.downsample);
+        g_shadowRes = baseShadowRes >> shadowLevel;
+    }
+
+    void change(double now, const char* action, Knob knob, double frameMs, double meanFog, double meanShadow) {
+        apply();
+        restart();
+        const char* name = knob == KNOB_FOG ? "fog" : "shadow";
+        int level = knob == KNOB_FOG ? fogLevel : shadowLevel;
+        cout << "governor " << action << " " << name << " to level " << level << ": " << frameMs << " ms (fog "
+             << meanFog << ", shadow " << meanShadow << ") vs " << g_frameBudgetMs << " ms budget" << endl;
+        printSettings("governor");
+        logRow(now, action, name, level, frameMs, meanFog, meanShadow);
+    }
+
+    void printSettings(const char* what) const {
+        cout << what << ": " << g_numSamples << " samples (" << g_temporalSamples << " temporal), volume 1/"
+             << g_volumeDownsample << ", shadow map " << g_shadowRes << ", budget " << g_frameBudgetMs << " ms" << endl;
+    }
+
+    void logRow(double now, const char* action, const char* knob, int level, double frameMs, double meanFog, double meanShadow) {
+        if (!log.is_open()) return;
+        if (log.tellp() == 0) log << "time,action,knob,level,frame_p50_ms,fog_ms,shadow_ms,budget_ms,samples,temporal_samples,volume_downsample,shadow_res,up_hold\n";
+        log << now << "," << action << "," << knob << "," << level << "," << frameMs << "," << meanFog << "," << meanShadow << ","
+            << g_frameBudgetMs << "," << g_numSamples << "," << g_temporalSamples << "," << g_volumeDownsample << ","
+            << g_shadowRes << "," << upHold << "\n";
+        log.flush();
+    }
+};
+
+static double steadySeconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// One weather record of the environment stream, a CSV line
+//   time_s,visibility_m,humidity_pct,sun_elevation_deg
+struct EnvironmentRecord {
+    double time = 0.0;
+    float visibility = 4000.0f, humidity = 50.0f, sunElevation = 30.0f;
+};
+
+// The stretch of the stream to play now: `from` to `to`, starting at wall
+// time `start` (steadySeconds()) and advancing `rate` stream seconds per
+// wall second; rate 0 jumps straight to `to`
+struct EnvironmentWindow {
+    EnvironmentRecord from, to;
+    double start = 0.0, rate = 0.0;
+};
+
+// Single-producer, single-consumer triple buffer. The writer fills its own
+// slot and swaps it with the shared middle one; the reader swaps the middle
+// into its front slot when the writer has published since. Neither side
+// ever waits, locks or allocates.
+template <typename T>
+class TripleBuffer {
+public:
+    T& back() { return slots[backSlot]; }
+    void publish() { backSlot = middle.exchange(uint8_t(backSlot | FRESH), memory_order_acq_rel) & SLOT; }
+
+    // True when front() changed
+    bool update() {
+        if (!(middle.load(memory_order_relaxed) & FRESH)) return false;
+        frontSlot = middle.exchange(frontSlot, memory_order_acq_rel) & SLOT;
+        return true;
+    }
+    const T& front() const { return slots[frontSlot]; }
+
+private:
+    static const uint8_t SLOT = 3, FRESH = 4;
+    T slots[3];
+    atomic<uint8_t> middle{1};
+    uint8_t backSlot = 0, frontSlot = 2;
+};
+
+// Background reader of the environment stream. Sources: a file or FIFO
+// path, "-" for stdin, "unix:/path" for a local stream socket. Regular
+// files are replayed on their own clock, `speed` times faster than real
+// time (0 = as fast as they parse); pipes and sockets are live, each new
+// record is blended in over the gap since the previous one.
+class EnvironmentStream {
+public:
+    atomic<uint64_t> records{0}, malformed{0};
+
+    ~EnvironmentStream() { close(); }
+
+    bool open(const string& source, double speed) {
+#if defined(_WIN32)
+        cerr << "--env needs a POSIX system" << endl;
+        return false;
+#else
+        if (source == "-") {
+            fd = dup(0);
+            live = true;
+        } else if (source.compare(0, 5, "unix:") == 0) {
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, source.c_str() + 5, sizeof(addr.sun_path) - 1);
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd >= 0 && connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) { ::close(fd); fd = -1; }
+            live = true;
+        } else {
+            fd = ::open(source.c_str(), O_RDONLY | O_NONBLOCK); // a FIFO without a writer yet must not block
+            struct stat st;
+            live = fd >= 0 && fstat(fd, &st) == 0 && !S_ISREG(st.st_mode);
+            fifo = live;
+        }
+        if (fd < 0) return false;
+        replaySpeed = max(speed, 0.0);
+        startTime = steadySeconds();
+        reader = thread([this] { run(); });
+        return true;
+#endif
+    }
+
+    void close() {
+        stop = true;
+        if (reader.joinable()) reader.join();
+#if !defined(_WIN32)
+        if (fd >= 0) ::close(fd);
+#endif
+        fd = -1;
+    }
+
+    bool finished() const { return done; }
+    double elapsed() const { return (done ? endTime.load() : steadySeconds()) - startTime; }
+
+    // Render thread: the environment at wall time `now`, interpolated
+    // between records; false until the first record arrives
+    bool sample(double now, EnvironmentRecord& out) {
+        windows.update();
+        const EnvironmentWindow& w = windows.front();
+        if (w.start == 0.0) return false;
+        double span = w.to.time - w.from.time;
+        float f = w.rate > 0.0 && span > 0.0 ? glm::clamp(float((now - w.start) * w.rate / span), 0.0f, 1.0f) : 1.0f;
+        out.time = w.from.time + span * f;
+        out.visibility = glm::mix(w.from.visibility, w.to.visibility, f);
+        out.humidity = glm::mix(w.from.humidity, w.to.humidity, f);
+        out.sunElevation = glm::mix(w.from.sunElevation, w.to.sunElevation, f);
+        return true;
+    }
+
+private:
+    TripleBuffer<EnvironmentWindow> windows;
+    thread reader;
+    atomic<bool> stop{false}, done{false};
+    atomic<double> endTime{0.0};
+    int fd = -1;
+    bool live = false, fifo = false; // a FIFO outlives its writers, so EOF there means wait
+    double replaySpeed = 1.0, startTime = 0.0;
+
+    void publish(const EnvironmentRecord& from, const EnvironmentRecord& to, double start, double rate) {
+        EnvironmentWindow& w = windows.back();
+        w.from = from;
+        w.to = to;
+        w.start = start;
+        w.rate = rate;
+        windows.publish();
+    }
+
+    // Comments, blank lines and a header are skipped; anything else must
+    // hold four numbers with a time not before the previous record's
+    bool parse(const char* line, const EnvironmentRecord& prev, bool first, EnvironmentRecord& r) {
+        while (*line == ' ' || *line == '\t') line++;
+        if (*line == '\0' || *line == '#') return false;
+        if (first && isalpha((unsigned char)*line)) return false; // header
+        char* end;
+        double v[4];
+        for (int i = 0; i < 4; ++i) {
+            v[i] = strtod(line, &end);
+            if (end == line || (i < 3 && *end != ',')) { malformed++; return false; }
+            line = end + 1;
+        }
+        if (!first && v[0] < prev.time) { malformed++; return false; }
+        r.time = v[0];
+        r.visibility = float(max(v[1], 1.0));
+        r.humidity = glm::clamp(float(v[2]), 0.0f, 100.0f);
+        r.sunElevation = glm::clamp(float(v[3]), -90.0f, 90.0f);
+        return true;
+    }
+
+    void run() {
+#if !defined(_WIN32)
+        char buffer[1 << 16];
+        size_t used = 0;
+        EnvironmentRecord prev;
+        bool first = true;
+        double clockStart = 0.0, firstTime = 0.0;
+        bool eof = false;
+        // Replay clock: when the stream reaches record time t
+        auto waitUntil = [&](double t) {
+            double due = clockStart + (replaySpeed > 0.0 ? (t - firstTime) / replaySpeed : 0.0);
+            while (!stop && steadySeconds() < due) {
+                this_thread::sleep_for(std::chrono::duration<double>(min(due - steadySeconds(), 0.05)));
+            }
+            return due;
+        };
+        while (!stop && !eof) {
+            // Wait for data in short slices so close() is never held up by
+            // a quiet pipe or socket
+            pollfd p = {fd, POLLIN, 0};
+            if (poll(&p, 1, 100) <= 0) continue;
+            ssize_t n = read(fd, buffer + used, sizeof(buffer) - 1 - used);
+            if ((n < 0 && errno == EAGAIN) || (n == 0 && fifo)) {
+                this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
+            }
+            if (n <= 0) { eof = true; n = 0; if (used > 0) buffer[used++] = '\n'; }
+            used += size_t(n);
+
+            size_t lineStart = 0;
+            for (size_t i = 0; i < used && !stop; ++i) {
+                if (buffer[i] != '\n') continue;
+                buffer[i] = '\0';
+                EnvironmentRecord r;
+                bool ok = parse(buffer + lineStart, prev, first, r);
+                lineStart = i + 1;
+                if (!ok) continue;
+                records++;
+                if (live) {
+                    publish(first ? r : prev, r, steadySeconds(), 1.0);
+                } else if (first) {
+                    clockStart = steadySeconds();
+                    firstTime = r.time;
+                } else {
+                    // Replay: publish prev -> r once the clock reaches prev
+                    publish(prev, r, waitUntil(prev.time), replaySpeed);
+                }
+                prev = r;
+                first = false;
+            }
+            // Keep the partial last line; a line longer than the buffer is dropped
+            if (lineStart == 0 && used >= sizeof(buffer) - 1) { malformed++; used = 0; }
+            memmove(buffer, buffer + lineStart, used - lineStart);
+            used -= lineStart;
+        }
+        if (!live && !first && !stop) {
+            double due = waitUntil(prev.time);
+            if (!stop) publish(prev, prev, due, 0.0);
+        }
+#endif
+        endTime = steadySeconds();
+        done = true;
+    }
+};
+
+// Weather to fog model. Koschmieder's 3.912 / visibility gives the
+// extinction, with distances scaled by ENV_DISTANCE_SCALE so kilometres of
+// visibility land in the room's range; the marched density keeps its ratio
+// to it. Humidity grows the droplets and sharpens the forward lobe (g in
+// 0.01 steps, so the phase LUT is not rebuilt every frame); the sun's
+// elevation sets the ambient level.
+static const float ENV_DISTANCE_SCALE = 0.01f;
+
+static void applyEnvironment(const EnvironmentRecord& e, float densityPerExtinction) {
+    g_extinction = 3.912f / (e.visibility * ENV_DISTANCE_SCALE);
+    g_fogDensity = g_extinction * densityPerExtinction;
+    g_phaseG = round((0.5f + 0.4f * e.humidity / 100.0f) * 100.0f) / 100.0f;
+    g_fogAmbient = 0.005f + 0.045f * max(sin(glm::radians(e.sunElevation)), 0.0f);
+}
+
+// Terrain: shadertoy.glsl's terrainheight() as a streamed heightfield. The
+// map is TERRAIN_MAP_TILES^2 tiles of TERRAIN_TILE^2 cells, TERRAIN_SPACING
+// apart and centred on the origin: 1024 m on a side, 16384^2 heights or
+// 1 GiB of floats, so only the TERRAIN_POOL tiles nearest the camera are
+// resident. Rays are cast through a max-mip quadtree over it: a level l
+// cell covers 2^l x 2^l height cells and holds the highest height in them.
+// Levels below TERRAIN_TILE_LEVELS live in each resident tile, the rest in
+// a coarse map of per-tile maxima that stays valid after a tile is evicted
+// (a tile never baked counts as TERRAIN_MAX_HEIGHT). TERRAIN_FRAG is the
+// GPU side; the two must agree.
+static const int TERRAIN_TILE = 64;                // cells per tile side
+static const int TERRAIN_TILE_LEVELS = 6;          // in-tile levels, 64^2 .. 2^2 cells
+static const int TERRAIN_MAP_TILES = 256;          // tiles per map side
+static const int TERRAIN_MAP_LEVELS = 9;           // coarse levels, 256^2 .. 1 tiles
+static const int TERRAIN_TOP_LEVEL = TERRAIN_TILE_LEVELS + TERRAIN_MAP_LEVELS - 1;
+static const int TERRAIN_CELLS = TERRAIN_MAP_TILES * TERRAIN_TILE;
+static const int TERRAIN_SAMPLES = TERRAIN_TILE + 1; // per tile side, edges shared with the neighbours
+static const int TERRAIN_MAX_STEPS = 256;
+static const int TERRAIN_POOL = 192;
+static const int TERRAIN_UPLOADS = 4;              // finished tiles uploaded per frame, at most
+static const float TERRAIN_SPACING = 1.0f / 16.0f;
+static const float TERRAIN_ORIGIN = -0.5f * TERRAIN_CELLS * TERRAIN_SPACING;
+static const float TERRAIN_MAX_HEIGHT = 2.0f;      // terrainHeight() is clamped to [0, 2]
+static const float TERRAIN_FAR = 20.0f;            // shadertoy.glsl's maxt
+static const float TERRAIN_RADIUS = 24.0f;         // tiles this close to the camera are streamed in
+
+static float terrainHeight(float x, float z) {
+    return glm::clamp(sin(x * 2.0f) * sin(z) + sin(x) * sin(z * 0.5f), 0.0f, 2.0f);
+}
+
+// shadertoy.glsl's castray(): fixed steps, interpolated at the crossing
+static float castTerrainLinear(const glm::vec3& ro, const glm::vec3& rd, float tMin, float tMax, float stepSize, int& steps) {
+    float prevHeight = 0.0f, prevY = 0.0f;
+    steps = 0;
+    for (float t = tMin; t < tMax; t += stepSize) {
+        steps++;
+        glm::vec3 p = ro + rd * t;
+        float h = terrainHeight(p.x, p.z);
+        if (p.y < h) return t - stepSize + stepSize * (prevHeight - prevY) / (p.y - h + prevHeight - prevY);
+        prevHeight = h;
+        prevY = p.y;
+    }
+    return tMax;
+}
+
+static size_t terrainLevelOffset(int level) {
+    size_t offset = 0;
+    for (int l = 0; l < level; ++l) offset += size_t(TERRAIN_TILE >> l) * (TERRAIN_TILE >> l);
+    return offset;
+}
+
+// One tile's heights and in-tile max levels, concatenated from level 0
+struct TerrainTile {
+    int x = -1, z = -1;
+    float maxHeight = 0.0f;
+    vector<float> heights, maxima;
+};
+
+static void bakeTerrainTile(int tx, int tz, TerrainTile& tile) {
+    tile.x = tx;
+    tile.z = tz;
+    tile.heights.resize(size_t(TERRAIN_SAMPLES) * TERRAIN_SAMPLES);
+    tile.maxima.resize(terrainLevelOffset(TERRAIN_TILE_LEVELS));
+    for (int j = 0; j < TERRAIN_SAMPLES; ++j) {
+        for (int i = 0; i < TERRAIN_SAMPLES; ++i) {
+            float x = TERRAIN_ORIGIN + float(tx * TERRAIN_TILE + i) * TERRAIN_SPACING;
+            float z = TERRAIN_ORIGIN + float(tz * TERRAIN_TILE + j) * TERRAIN_SPACING;
+            tile.heights[size_t(j) * TERRAIN_SAMPLES + i] = terrainHeight(x, z);
+        }
+    }
+    const float* h = tile.heights.data();
+    for (int j = 0; j < TERRAIN_TILE; ++j) {
+        for (int i = 0; i < TERRAIN_TILE; ++i) {
+            const float* s = h + size_t(j) * TERRAIN_SAMPLES + i;
+            tile.maxima[size_t(j) * TERRAIN_TILE + i] = max(max(s[0], s[1]), max(s[TERRAIN_SAMPLES], s[TERRAIN_SAMPLES + 1]));
+        }
+    }
+    for (int level = 1; level < TERRAIN_TILE_LEVELS; ++level) {
+        int n = TERRAIN_TILE >> level;
+        const float* src = tile.maxima.data() + terrainLevelOffset(level - 1);
+        float* dst = tile.maxima.data() + terrainLevelOffset(level);
+        for (int j = 0; j < n; ++j) {
+            for (int i = 0; i < n; ++i) {
+                const float* s = src + size_t(2 * j) * (2 * n) + 2 * i;
+                dst[size_t(j) * n + i] = max(max(s[0], s[1]), max(s[2 * n], s[2 * n + 1]));
+            }
+        }
+    }
+    const float* top = tile.maxima.data() + terrainLevelOffset(TERRAIN_TILE_LEVELS - 1);
+    tile.maxHeight = max(max(top[0], top[1]), max(top[2], top[3]));
+}
+
+// The CPU side of the map: page table, resident pool and coarse levels,
+// mirrored into textures by the render loop
+struct TerrainMap {
+    vector<int> pages = vector<int>(size_t(TERRAIN_MAP_TILES) * TERRAIN_MAP_TILES, -1);
+    vector<TerrainTile> pool = vector<TerrainTile>(TERRAIN_POOL);
+    vector<float> coarse = vector<float>(coarseOffset(TERRAIN_MAP_LEVELS), TERRAIN_MAX_HEIGHT);
+    int resident = 0;
+
+    static size_t coarseOffset(int level) {
+        size_t offset = 0;
+        for (int l = 0; l < level; ++l) offset += size_t(TERRAIN_MAP_TILES >> l) * (TERRAIN_MAP_TILES >> l);
+        return offset;
+    }
+
+    // Tiles within TERRAIN_RADIUS of (x, z), nearest first
+    static void wantedTiles(float x, float z, vector<pair<int, int>>& out) {
+        out.clear();
+        float tileSize = TERRAIN_TILE * TERRAIN_SPACING;
+        int cx = int(floor((x - TERRAIN_ORIGIN) / tileSize)), cz = int(floor((z - TERRAIN_ORIGIN) / tileSize));
+        int reach = int(ceil(TERRAIN_RADIUS / tileSize)) + 1;
+        for (int tz = max(cz - reach, 0); tz <= min(cz + reach, TERRAIN_MAP_TILES - 1); ++tz) {
+            for (int tx = max(cx - reach, 0); tx <= min(cx + reach, TERRAIN_MAP_TILES - 1); ++tx) {
+                if (tileDistance(tx, tz, x, z) <= TERRAIN_RADIUS) out.push_back({tx, tz});
+            }
+        }
+        sort(out.begin(), out.end(), [&](const pair<int, int>& a, const pair<int, int>& b) {
+            return tileDistance(a.first, a.second, x, z) < tileDistance(b.first, b.second, x, z);
+        });
+    }
+
+    // Distance from (x, z) to the nearest point of a tile
+    static float tileDistance(int tx, int tz, float x, float z) {
+        float tileSize = TERRAIN_TILE * TERRAIN_SPACING;
+        float x0 = TERRAIN_ORIGIN + tx * tileSize, z0 = TERRAIN_ORIGIN + tz * tileSize;
+        float dx = max(max(x0 - x, x - (x0 + tileSize)), 0.0f), dz = max(max(z0 - z, z - (z0 + tileSize)), 0.0f);
+        return sqrt(dx * dx + dz * dz);
+    }
+
+    bool isResident(int tx, int tz) const { return pages[size_t(tz) * TERRAIN_MAP_TILES + tx] >= 0; }
+
+    // Takes a baked tile into a free slot, or the slot of the resident
+    // tile farthest from (x, z) when that is farther than this one. Returns
+    // the slot and the tile it evicted (x = -1 for none), or -1 if the
+    // tile was dropped.
+    int insert(TerrainTile& tile, float x, float z, int& evictedX, int& evictedZ) {
+        evictedX = evictedZ = -1;
+        if (isResident(tile.x, tile.z)) return -1;
+        int slot = -1;
+        float farthest = tileDistance(tile.x, tile.z, x, z);
+        for (int s = 0; s < TERRAIN_POOL; ++s) {
+            if (pool[s].x < 0) { slot = s; break; }
+            float d = tileDistance(pool[s].x, pool[s].z, x, z);
+            if (d > farthest) { farthest = d; slot = s; }
+        }
+        if (slot < 0) return -1;
+        if (pool[slot].x >= 0) {
+            evictedX = pool[slot].x;
+            evictedZ = pool[slot].z;
+            pages[size_t(evictedZ) * TERRAIN_MAP_TILES + evictedX] = -1;
+            resident--;
+        }
+        swap(pool[slot], tile);
+        TerrainTile& t = pool[slot];
+        pages[size_t(t.z) * TERRAIN_MAP_TILES + t.x] = slot;
+        resident++;
+        // The tile's true maximum replaces the bound up the coarse levels
+        coarse[size_t(t.z) * TERRAIN_MAP_TILES + t.x] = t.maxHeight;
+        for (int level = 1; level < TERRAIN_MAP_LEVELS; ++level) {
+            int n = TERRAIN_MAP_TILES >> level, i = t.x >> level, j = t.z >> level;
+            const float* src = coarse.data() + coarseOffset(level - 1);
+            const float* s = src + size_t(2 * j) * (2 * n) + 2 * i;
+            coarse[coarseOffset(level) + size_t(j) * n + i] = max(max(s[0], s[1]), max(s[2 * n], s[2 * n + 1]));
+        }
+        return slot;
+    }
+
+    // Highest height in a cell of the given level; -1 where the tile is not
+    // resident, so rays pass through
+    float cellMax(int level, int cx, int cz) const {
+        if (level > TERRAIN_TILE_LEVELS) {
+            int n = TERRAIN_MAP_TILES >> (level - TERRAIN_TILE_LEVELS);
+            return coarse[coarseOffset(level - TERRAIN_TILE_LEVELS) + size_t(cz) * n + cx];
+        }
+        int shift = TERRAIN_TILE_LEVELS - level;
+        int slot = pages[size_t(cz >> shift) * TERRAIN_MAP_TILES + (cx >> shift)];
+        if (slot < 0) return -1.0f;
+        if (level == TERRAIN_TILE_LEVELS) return coarse[size_t(cz) * TERRAIN_MAP_TILES + cx];
+        int n = TERRAIN_TILE >> level;
+        return pool[slot].maxima[terrainLevelOffset(level) + size_t(cz & (n - 1)) * n + (cx & (n - 1))];
+    }
+
+    // First t in [tA, tB] where the ray meets the bilinear patch of a level
+    // 0 cell, or -1: along the ray the patch height is quadratic in t
+    float hitPatch(const glm::vec3& ro, const glm::vec3& rd, int cx, int cz, float tA, float tB) const {
+        const TerrainTile& tile = pool[pages[size_t(cz / TERRAIN_TILE) * TERRAIN_MAP_TILES + cx / TERRAIN_TILE]];
+        const float* s = tile.heights.data() + size_t(cz % TERRAIN_TILE) * TERRAIN_SAMPLES + cx % TERRAIN_TILE;
+        float h00 = s[0], h10 = s[1], h01 = s[TERRAIN_SAMPLES], h11 = s[TERRAIN_SAMPLES + 1];
+
+        glm::vec3 p = ro + rd * tA;
+        float u = (p.x - (TERRAIN_ORIGIN + cx * TERRAIN_SPACING)) / TERRAIN_SPACING;
+        float v = (p.z - (TERRAIN_ORIGIN + cz * TERRAIN_SPACING)) / TERRAIN_SPACING;
+        float du = rd.x / TERRAIN_SPACING, dv = rd.z / TERRAIN_SPACING;
+        float e1 = h10 - h00, e2 = h01 - h00, e3 = h00 - h10 - h01 + h11;
+        float a = -e3 * du * dv;
+        float b = rd.y - e1 * du - e2 * dv - e3 * (u * dv + v * du);
+        float c = p.y - h00 - e1 * u - e2 * v - e3 * u * v;
+        if (c <= 0.0f) return tA;
+        float span = tB - tA, tau = -1.0f;
+        if (fabs(a) < 1e-7f) {
+            if (b < 0.0f) tau = -c / b;
+        } else {
+            float disc = b * b - 4.0f * a * c;
+            if (disc >= 0.0f) {
+                float q = -0.5f * (b + (b < 0.0f ? -sqrt(disc) : sqrt(disc)));
+                float r1 = q / a, r2 = q != 0.0f ? c / q : -1.0f;
+                tau = min(r1 >= 0.0f ? r1 : 1e30f, r2 >= 0.0f ? r2 : 1e30f);
+            }
+        }
+        return tau >= 0.0f && tau <= span ? tA + tau : -1.0f;
+    }
+
+    // TERRAIN_FRAG's castQuadtree(). The current cell is tracked as
+    // integers: a ray that passes above a cell moves to its neighbour, and
+    // up a level when that leaves the parent; one that may dip below the
+    // cell's maximum descends into the child it is in at that point.
+    float cast(const glm::vec3& ro, const glm::vec3& rd, float tMin, float tMax, int& steps) const {
+        steps = 0;
+        float size = TERRAIN_CELLS * TERRAIN_SPACING;
+        float t = tMin, tEnd = tMax;
+        const float lo[3] = {TERRAIN_ORIGIN, -1.0f, TERRAIN_ORIGIN}, hi[3] = {TERRAIN_ORIGIN + size, TERRAIN_MAX_HEIGHT, TERRAIN_ORIGIN + size};
+        const float o[3] = {ro.x, ro.y, ro.z}, d[3] = {rd.x, rd.y, rd.z};
+        for (int axis = 0; axis < 3; ++axis) {
+            if (d[axis] == 0.0f) {
+                if (o[axis] < lo[axis] || o[axis] > hi[axis]) return tMax;
+                continue;
+            }
+            float ta = (lo[axis] - o[axis]) / d[axis], tb = (hi[axis] - o[axis]) / d[axis];
+            t = max(t, min(ta, tb));
+            tEnd = min(tEnd, max(ta, tb));
+        }
+        if (t >= tEnd) return tMax;
+
+        int level = TERRAIN_TOP_LEVEL, cx = 0, cz = 0;
+        int dirX = rd.x >= 0.0f ? 1 : -1, dirZ = rd.z >= 0.0f ? 1 : -1;
+        while (t < tEnd && steps < TERRAIN_MAX_STEPS) {
+            steps++;
+            float cellSize = TERRAIN_SPACING * float(1 << level);
+            float x0 = TERRAIN_ORIGIN + cx * cellSize, z0 = TERRAIN_ORIGIN + cz * cellSize;
+            float exitX = rd.x != 0.0f ? (x0 + (rd.x >= 0.0f ? cellSize : 0.0f) - ro.x) / rd.x : FLT_MAX;
+            float exitZ = rd.z != 0.0f ? (z0 + (rd.z >= 0.0f ? cellSize : 0.0f) - ro.z) / rd.z : FLT_MAX;
+            float tExit = min(min(exitX, exitZ), tEnd);
+            float hMax = cellMax(level, cx, cz);
+            float yIn = ro.y + rd.y * t, yOut = ro.y + rd.y * tExit;
+            if (min(yIn, yOut) <= hMax) {
+                float tEnter = yIn > hMax ? (hMax - ro.y) / rd.y : t;
+                if (level > 0) {
+                    float px = ro.x + rd.x * tEnter, pz = ro.z + rd.z * tEnter;
+                    cx = cx * 2 + (px >= x0 + 0.5f * cellSize ? 1 : 0);
+                    cz = cz * 2 + (pz >= z0 + 0.5f * cellSize ? 1 : 0);
+                    level--;
+                    t = tEnter;
+                    continue;
+                }
+                float hit = hitPatch(ro, rd, cx, cz, tEnter, tExit);
+                if (hit >= 0.0f) return hit;
+            }
+            int nx = cx, nz = cz;
+            if (exitX < exitZ) nx += dirX;
+            else nz += dirZ;
+            int cells = TERRAIN_CELLS >> level;
+            if (nx < 0 || nz < 0 || nx >= cells || nz >= cells) break;
+            if (level < TERRAIN_TOP_LEVEL && ((nx >> 1) != (cx >> 1) || (nz >> 1) != (cz >> 1))) {
+                nx >>= 1;
+                nz >>= 1;
+                level++;
+            }
+            cx = nx;
+            cz = nz;
+            t = tExit;
+        }
+        return tMax;
+    }
+};
+
+// Bakes terrain tiles on a worker thread, nearest first, standing in for
+// reading a real map's tiles from disk. The render thread replaces the
+// wanted list when the camera changes tile and takes finished tiles.
+class TerrainStreamer {
+public:
+    atomic<uint64_t> baked{0};
+
+    ~TerrainStreamer() {
+        {
+            lock_guard<mutex> lock(m);
+            quit = true;
+        }
+        cv.notify_one();
+        if (worker.joinable()) worker.join();
+    }
+
+    void want(const vector<pair<int, int>>& tiles) {
+        {
+            lock_guard<mutex> lock(m);
+            queue.assign(tiles.rbegin(), tiles.rend()); // nearest at the back
+        }
+        if (!worker.joinable()) worker = thread([this] { run(); });
+        cv.notify_one();
+    }
+
+    bool take(TerrainTile& tile) {
+        lock_guard<mutex> lock(m);
+        if (done.empty()) return false;
+        swap(tile, done.front());
+        done.pop_front();
+        return true;
+    }
+
+    size_t pending() {
+        lock_guard<mutex> lock(m);
+        return queue.size() + done.size();
+    }
+
+private:
+    mutex m;
+    condition_variable cv;
+    vector<pair<int, int>> queue;
+    deque<TerrainTile> done;
+    bool quit = false;
+    thread worker;
+
+    void run() {
+        unique_lock<mutex> lock(m);
+        while (true) {
+            cv.wait(lock, [&] { return quit || !queue.empty(); });
+            if (quit) return;
+            pair<int, int> next = queue.back();
+            queue.pop_back();
+            lock.unlock();
+            TerrainTile tile;
+            bakeTerrainTile(next.first, next.second, tile);
+            baked++;
+            lock.lock();
+            done.push_back(move(tile));
+        }
+    }
+};
+
+// --terrain-bench: rays over shadertoy.glsl's camera path, cast with its
+// fixed 0.2 march and through the quadtree, against a 0.005 march of the
+// analytic terrain as ground truth. Reports steps per ray, time per ray and
+// how often each misses or lands away from the true first hit.
+static void runTerrainBench(int frames, int width, int height) {
+    TerrainMap map;
+    vector<pair<int, int>> wanted;
+    struct Stats { vector<int> steps; double seconds = 0.0, error = 0.0; int hits = 0, misses = 0, wrong = 0; };
+    Stats linear, quadtree;
+    int truthHits = 0;
+    size_t rays = 0;
+    double bakeSeconds = 0.0;
+    for (int frame = 0; frame < frames; ++frame) {
+        // shadertoy.glsl's camera at iTime = frame / 2
+        float time = frame * 0.5f;
+        glm::vec3 camPos(1.0f + sin(time) * 0.3f, 0.0f, time);
+        camPos.y = terrainHeight(camPos.x, camPos.z) + 0.3f;
+        glm::vec3 target(1.0f + sin((time + 1.0f) * 0.5f) * 5.0f, 0.0f, time + 1.0f);
+        target.y = terrainHeight(target.x, target.z) + 0.2f;
+        glm::vec3 forward = glm::normalize(target - camPos);
+        glm::vec3 right = glm::normalize(glm::cross(glm::vec3(0, 1, 0), forward));
+        glm::vec3 up = glm::cross(forward, right);
+
+        auto bakeStart = std::chrono::steady_clock::now();
+        TerrainMap::wantedTiles(camPos.x, camPos.z, wanted);
+        for (const auto& w : wanted) {
+            if (map.isResident(w.first, w.second)) continue;
+            TerrainTile tile;
+            bakeTerrainTile(w.first, w.second, tile);
+            int ex, ez;
+            map.insert(tile, camPos.x, camPos.z, ex, ez);
+        }
+        bakeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - bakeStart).count();
+
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                float u = ((x + 0.5f) / width * 2.0f - 1.0f) * float(width) / float(height);
+                float v = (y + 0.5f) / height * 2.0f - 1.0f;
+                glm::vec3 rd = glm::normalize(forward + right * u + up * v);
+                int steps = 0;
+                float truth = castTerrainLinear(camPos, rd, 0.1f, TERRAIN_FAR, 0.005f, steps);
+                bool truthHit = truth < TERRAIN_FAR;
+                truthHits += truthHit;
+                auto measure = [&](Stats& s, float t, double seconds) {
+                    s.steps.push_back(steps);
+                    s.seconds += seconds;
+                    bool hit = t < TERRAIN_FAR;
+                    s.hits += hit;
+                    if (truthHit && !hit) s.misses++;
+                    else if (hit && (!truthHit || fabs(t - truth) > 0.05f)) s.wrong++;
+                    else if (hit) s.error += fabs(t - truth);
+                };
+                auto start = std::chrono::steady_clock::now();
+                float t = castTerrainLinear(camPos, rd, 0.1f, TERRAIN_FAR, 0.2f, steps);
+                measure(linear, t, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+                start = std::chrono::steady_clock::now();
+                t = map.cast(camPos, rd, 0.1f, TERRAIN_FAR, steps);
+                measure(quadtree, t, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+                rays++;
+            }
+        }
+    }
+
+    cout << "terrain bench: " << frames << " frames x " << width << "x" << height << " rays, " << map.resident
+         << " tiles resident (baked in " << bakeSeconds << " s)" << endl;
+    cout << "  truth (0.005 march): " << truthHits << " hits of " << rays << " rays" << endl;
+    auto report = [&](const char* name, Stats& s) {
+        sort(s.steps.begin(), s.steps.end());
+        double mean = accumulate(s.steps.begin(), s.steps.end(), 0.0) / max<size_t>(s.steps.size(), 1);
+        int good = s.hits - s.wrong;
+        cout << "  " << name << ": steps/ray mean " << mean << ", p50 " << s.steps[s.steps.size() / 2]
+             << ", p95 " << s.steps[s.steps.size() * 95 / 100] << ", max " << s.steps.back() << "; "
+             << 1e9 * s.seconds / max<size_t>(rays, 1) << " ns/ray; missed " << s.misses << ", wrong hit " << s.wrong
+             << ", mean |dt| " << (good > 0 ? s.error / good : 0.0) << endl;
+    };
+    report("linear 0.2 ", linear);
+    report("quadtree   ", quadtree);
+}
+
+int main(int argc, char** argv) {
+    // --cubes N: stress test, the room filled with N procedurally placed cubes
+    // --camera 1|2|3, --yaw/--pitch degrees: start view
+    // --set name=value: any setting setParam() knows
+    // --size WxH: framebuffer size (window, benchmark, render or reference)
+    // --reference out.ppm: render one frame with the CPU integrator instead
+    //   and exit, no window or GL context (--threads N, --time s)
+    // --reference-scaling 1: also time that frame on 1, 2, 4, ... --threads
+    //   threads and print the speedup of each
+    // --noise-cache file|off: baked fog noise volume (default noise_volume.bin)
+    // --env file|fifo|-|unix:path: weather records "time,visibility,humidity,
+    //   sun_elevation" (seconds, m, %, degrees) driving the fog; files are
+    //   replayed at --env-speed x their timestamps (0 = as fast as they
+    //   parse), pipes, stdin and sockets are followed live
+    // --bench out: offscreen benchmark, writes out.csv and out.json. Every
+    //   --sweep name=v1,v2,... combination runs the camera script over the
+    //   three presets (--bench-frames N each, after --bench-warmup N); the
+    //   default sweep is numSamples x dithering x fogMode x showMapMode;
+    //   --bench-baseline old.csv flags p95 regressions beyond
+    //   --bench-tolerance (fraction) and makes the exit code 1;
+    //   --bench-sync 1 times passes on the CPU around glFinish() instead of
+    //   with timer queries (software rasterisers defer the real work past
+    //   the query)
+    // --render dir: offline frames, no window. Every --sweep combination
+    //   renders --render-frames N frames from the start view on a 60 Hz
+    //   clock from --time, written to dir as --render-format png|ppm|pfm
+    //   (pfm keeps the unclamped float colour) with a frames.csv index;
+    //   readback goes through a ring of --render-ring N pixel buffers and
+    //   encoding through --encoders N threads
+    // --quality out: image quality against cost, writes out.csv and
+    //   out.json. The three QUALITY_VIEWS at every --quality-phases t1,t2,...
+    //   (seconds, the light's orbit position) are rendered as ground truth
+    //   (QUALITY_TRUTH, one frame per view) and then with every --sweep
+    //   combination, each view timed over --quality-frames N after
+    //   --quality-warmup N; reports RMSE, PSNR and FLIP against the truth
+    //   and the Pareto front of frame time against FLIP, and warns about
+    //   views where the beam barely shows. --quality-baseline old.csv
+    //   flags FLIP increases beyond --quality-tolerance (fraction) with
+    //   exit code 1
+    //   (--bench, --render and --quality each take over the run; give one)
+    // --shader-cache dir|off: linked program binaries (default shader_cache)
+    // --shader-dir dir: read shaders from dir/NAME.glsl, writing out any
+    //   that are missing
+    // --trace out.json: profile from the start and write the last
+    //   --trace-frames N frames as a Chrome trace on exit (X writes one any
+    //   time the profiler is on)
+    // --governor-log out.csv: every quality governor decision, with the
+    //   measurements behind it (the governor itself is --set governor=1, 7)
+    // --terrain-bench N: cast N frames of shadertoy.glsl's camera path on
+    //   the CPU, fixed-step march against the quadtree, and exit (one ray
+    //   per --size pixel; 160x90 takes seconds)
+    // --cull-bench N: time N rounds of the camera and light BVH queries
+    //   (with --cubes for the object count) and exit
+    const glm::vec3 cameraPresets[3] = {{0,1.3f,7.0f}, {0,1.3f,3.0f}, {0,1.3f,0.4f}};
+    int stressCubes = 0;
+    int outputW = 1280, outputH = 720;
+    string referencePath;
+    int referenceThreads = max(1, int(thread::hardware_concurrency()));
+    bool referenceScaling = false;
+    double referenceTime = 0.0;
+    string benchPath, benchBaselinePath;
+    vector<string> benchSweeps;
+    int benchFrames = 120, benchWarmup = 10;
+    double benchTolerance = 0.1;
+    bool benchSyncPasses = false;
+    string tracePath = "fog_trace.json";
+    bool traceOnExit = false;
+    int traceFrames = 120;
+    string shaderCacheDir = "shader_cache", shaderDir;
+    string noiseCachePath = "noise_volume.bin";
+    string envSource;
+    double envSpeed = 1.0;
+    string governorLogPath;
+    int terrainBenchFrames = 0;
+    int cullBenchFrames = 0;
+    string renderDir;
+    FrameFormat renderFormat = FRAME_PNG;
+    int renderFrames = 1, renderRing = 3;
+    int renderEncoders = max(1, int(thread::hardware_concurrency()) - 1);
+    string qualityPath, qualityBaselinePath;
+    vector<double> qualityPhases = {0.0, 2.0, 4.0};
+    int qualityFrames = 5, qualityWarmup = 4;
+    double qualityTolerance = 0.1;
+    for (int i = 1; i + 1 < argc; ++i) {
+        string arg = argv[i], value = argv[i + 1];
+        if (arg == "--cubes") stressCubes = max(0, atoi(value.c_str()));
+        else if (arg == "--camera") cam.pos = cameraPresets[glm::clamp(atoi(value.c_str()), 1, 3) - 1];
+        else if (arg == "--yaw") cam.yaw = float(atof(value.c_str()));
+        else if (arg == "--pitch") cam.pitch = glm::clamp(float(atof(value.c_str())), -89.9f, 89.9f);
+        else if (arg == "--set") {
+            size_t eq = value.find('=');
+            if (eq == string::npos || !setParam(value.substr(0, eq), value.substr(eq + 1))) cerr << "Unknown setting " << value << endl;
+        }
+        else if (arg == "--size") sscanf(value.c_str(), "%dx%d", &outputW, &outputH);
+        else if (arg == "--reference") referencePath = value;
+        else if (arg == "--threads") referenceThreads = max(1, atoi(value.c_str()));
+        else if (arg == "--reference-scaling") referenceScaling = atoi(value.c_str()) != 0;
+        else if (arg == "--time") referenceTime = atof(value.c_str());
+        else if (arg == "--bench") benchPath = value;
+        else if (arg == "--sweep") benchSweeps.push_back(value);
+        else if (arg == "--bench-frames") benchFrames = max(1, atoi(value.c_str()));
+        else if (arg == "--bench-warmup") benchWarmup = max(0, atoi(value.c_str()));
+        else if (arg == "--bench-baseline") benchBaselinePath = value;
+        else if (arg == "--bench-tolerance") benchTolerance = atof(value.c_str());
+        else if (arg == "--bench-sync") benchSyncPasses = atoi(value.c_str()) != 0;
+        else if (arg == "--trace") { tracePath = value; traceOnExit = true; g_profiler = true; }
+        else if (arg == "--shader-cache") shaderCacheDir = value == "off" ? "" : value;
+        else if (arg == "--shader-dir") shaderDir = value;
+        else if (arg == "--noise-cache") noiseCachePath = value == "off" ? "" : value;
+        else if (arg == "--env") envSource = value;
+        else if (arg == "--env-speed") envSpeed = atof(value.c_str());
+        else if (arg == "--governor-log") governorLogPath = value;
+        else if (arg == "--terrain-bench") terrainBenchFrames = max(1, atoi(value.c_str()));
+        else if (arg == "--cull-bench") cullBenchFrames = max(1, atoi(value.c_str()));
+        else if (arg == "--render") renderDir = value;
+        else if (arg == "--render-format") {
+            if (value == "ppm") renderFormat = FRAME_PPM;
+            else if (value == "pfm") renderFormat = FRAME_PFM;
+            else if (value == "png") renderFormat = FRAME_PNG;
+            else cerr << "Unknown render format " << value << " (png, ppm or pfm)" << endl;
+        }
+        else if (arg == "--render-frames") renderFrames = max(1, atoi(value.c_str()));
+        else if (arg == "--render-ring") renderRing = max(1, atoi(value.c_str()));
+        else if (arg == "--encoders") renderEncoders = max(1, atoi(value.c_str()));
+        else if (arg == "--quality") qualityPath = value;
+        else if (arg == "--quality-phases") {
+            qualityPhases.clear();
+            for (const string& phase : splitCommas(value)) {
+                if (!phase.empty()) qualityPhases.push_back(atof(phase.c_str()));
+            }
+            if (qualityPhases.empty()) qualityPhases.push_back(0.0);
+        }
+        else if (arg == "--quality-frames") qualityFrames = max(1, atoi(value.c_str()));
+        else if (arg == "--quality-warmup") qualityWarmup = max(0, atoi(value.c_str()));
+        else if (arg == "--quality-baseline") qualityBaselinePath = value;
+        else if (arg == "--quality-tolerance") qualityTolerance = atof(value.c_str());
+        else if (arg == "--trace-frames") traceFrames = max(1, atoi(value.c_str()));
+        else continue;
+        ++i;
+    }
+
+    if (!shaderDir.empty()) useShaderDir(shaderDir);
+
+    outputW = max(outputW, 1);
+    outputH = max(outputH, 1);
+    if (!benchPath.empty() + !renderDir.empty() + !qualityPath.empty() > 1) {
+        cerr << "--bench, --render and --quality are separate runs; give one of them" << endl;
+        return -1;
+    }
+    if (terrainBenchFrames > 0) {
+        runTerrainBench(terrainBenchFrames, outputW, outputH);
+        return 0;
+    }
+    float aspect = float(outputW) / float(outputH);
+    glm::mat4 proj = glm::perspective(glm::radians(70.0f), aspect, VIEW_NEAR, VIEW_FAR);
+
+    auto quad = [&](glm::vec3 a, glm::vec3 b, glm::vec3 c, glm::vec3 d, glm::vec3 normal) {
+        return vector<float>{
+            a.x,a.y,a.z, normal.x, normal.y, normal.z, 
+            b.x,b.y,b.z, normal.x, normal.y, normal.z,
+            c.x,c.y,c.z, normal.x, normal.y, normal.z,
+            a.x,a.y,a.z, normal.x, normal.y, normal.z, 
+            c.x,c.y,c.z, normal.x, normal.y, normal.z,
+            d.x,d.y,d.z, normal.x, normal.y, normal.z
+        };
+    };
+
+    vector<float> sceneVerts;
+    Mesh floorM = makeMesh(sceneVerts, quad({-2,0,-2},{2,0,-2},{2,0,2},{-2,0,2}, {0,1,0}));
+    Mesh backM  = makeMesh(sceneVerts, quad({-2,0,2},{2,0,2},{2,2,2},{-2,2,2}, {0,0,-1}));
+    Mesh leftM  = makeMesh(sceneVerts, quad({-2,0,-2},{-2,0,2},{-2,2,2},{-2,2,-2}, {1,0,0}));
+    Mesh rightM = makeMesh(sceneVerts, quad({2,0,2},{2,0,-2},{2,2,-2},{2,2,2}, {-1,0,0}));
+    
+    float cx0=-0.5f, cx1=0.5f, cz0=-0.5f, cz1=0.5f;
+    glm::vec3 ceilingNormal = {0,-1,0};
+    Mesh cwTop = makeMesh(sceneVerts, quad({-2,2,cz1},{ 2,2,cz1},{ 2,2,2},{-2,2,2}, ceilingNormal));
+    Mesh cwBot = makeMesh(sceneVerts, quad({-2,2,-2},{ 2,2,-2},{ 2,2,cz0},{-2,2,cz0}, ceilingNormal));
+    Mesh cwLft = makeMesh(sceneVerts, quad({-2,2,cz0},{-2,2,cz1},{cx0,2,cz1},{cx0,2,cz0}, ceilingNormal));
+    Mesh cwRgt = makeMesh(sceneVerts, quad({cx1,2,cz0},{cx1,2,cz1},{2,2,cz1},{2,2,cz0}, ceilingNormal));
+    Mesh sky   = makeMesh(sceneVerts, quad({cx0,1.99f,cz0},{cx1,1.99f,cz0},{cx1,1.99f,cz1},{cx0,1.99f,cz1}, {0,1,0}));
+
+    Mesh cubeMesh = makeCube(sceneVerts);
+    struct Cfg { glm::vec3 pos; float size; glm::vec3 color; };
+    vector<Cfg> cfgs = {
+        {{-1.0f, 0.0f, -1.0f}, 0.5f, {0.7f,0.4f,0.3f}},
+        {{ 1.2f, 0.0f,  0.5f}, 0.5f, {0.3f,0.7f,0.4f}},
+        {{-0.5f, 0.0f,  0.8f}, 0.4f, {0.5f,0.5f,0.8f}},
+        {{ 0.7f, 0.0f, -1.2f}, 0.4f, {0.9f,0.9f,0.5f}},
+        {{ 0.2f, 0.0f, -0.2f}, 0.5f, {0.6f,0.4f,0.8f}}
+    };
+
+    // Stress test: a jittered 3D grid filling the room replaces the five above
+    if (stressCubes > 0) {
+        auto hash01 = [](uint32_t x) {
+            x ^= x >> 16; x *= 0x7feb352dU; x ^= x >> 15; x *= 0x846ca68bU; x ^= x >> 16;
+            return float(x) / 4294967296.0f;
+        };
+        int side = (int)ceil(cbrt((double)stressCubes));
+        float cellXZ = 3.6f / side, cellY = 1.8f / side;
+        float size = 0.5f * min(cellXZ, cellY);
+        cfgs.clear();
+        for (int i = 0; i < stressCubes; ++i) {
+            int ix = i % side, iy = (i / side) % side, iz = i / (side * side);
+            uint32_t h = uint32_t(i) * 4u;
+            glm::vec3 pos = {-1.8f + (ix + 0.25f + 0.5f * hash01(h)) * cellXZ,
+                             iy * cellY,
+                             -1.8f + (iz + 0.25f + 0.5f * hash01(h + 1)) * cellXZ};
+            glm::vec3 color = {0.3f + 0.6f * hash01(h + 2), 0.3f + 0.6f * hash01(h + 3), 0.5f};
+            cfgs.push_back({pos, size, color});
+        }
+        cout << "stress test: " << stressCubes << " cubes" << endl;
+    }
+
+    glm::vec3 lightPos = {0.0f, 1.99f, 0.0f}; 
+    glm::vec3 lightColor = {1.0f, 0.9f, 0.7f};
+    float lightPower = 4.5f;
+
+    // Object table: one ObjectData slot per drawable, with its mesh, world
+    // bounds and culling flags. Only the moving cube's slot, the last one,
+    // changes after setup.
+    vector<ObjectData> objects;
+    vector<Mesh> meshes;
+    vector<AABB> meshBoxes, objectBoxes;
+    vector<uint32_t> objectMesh, objectFlags;
+    auto addObject = [&](const Mesh& m, glm::vec3 color, uint32_t flags, const glm::mat4& model = glm::mat4(1.0f)) {
+        size_t mi = 0;
+        while (mi < meshes.size() && meshes[mi].first != m.first) ++mi;
+        if (mi == meshes.size()) {
+            meshes.push_back(m);
+            meshBoxes.push_back(meshBounds(sceneVerts, m));
+        }
+        objects.push_back({model, glm::vec4(color, 1.0f)});
+        objectMesh.push_back(uint32_t(mi));
+        objectFlags.push_back(flags);
+        objectBoxes.push_back(transformBounds(meshBoxes[mi], model));
+        return uint32_t(objects.size() - 1);
+    };
+
+    // The sky is drawn on its own, unfogged, so it stays out of every query.
+    // It lies in the light's near plane and never reached the shadow map.
+    uint32_t skyObject = addObject(sky, lightColor, 0);
+    glm::vec3 floorColor = {0.35f,0.35f,0.4f}, wallColor = {0.4f,0.4f,0.45f};
+    for (const Mesh* m : {&floorM, &cwTop, &cwBot, &cwLft, &cwRgt}) addObject(*m, floorColor, OBJ_STATIC);
+    for (const Mesh* m : {&backM, &leftM, &rightM}) addObject(*m, wallColor, OBJ_STATIC);
+    for (auto &c : cfgs) {
+        glm::mat4 model(1.0f);
+        model = glm::translate(model, glm::vec3(c.pos.x, c.pos.y + c.size / 2.0f, c.pos.z));
+        model = glm::scale(model, glm::vec3(c.size)); 
+        addObject(cubeMesh, c.color, OBJ_STATIC, model);
+    }
+ 
+    // Dynamic occluder for the shadow cache's dynamic layer, hidden until enabled
+    uint32_t movingCubeObject = addObject(cubeMesh, {0.8f, 0.3f, 0.3f}, 0);
+    float movingCubeSize = 0.3f;
+
+    ObjectBVH bvh;
+    auto bvhStart = std::chrono::steady_clock::now();
+    bvh.build(objectBoxes, objectFlags);
+    if (stressCubes > 0) {
+        cout << "BVH: " << bvh.nodes.size() << " nodes over " << objects.size() << " objects, built in "
+             << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - bvhStart).count() << " ms" << endl;
+    }
+
+    // Fog density noise, baked on --threads workers unless the cache file
+    // already holds this version of it
+    vector<uint8_t> noiseVolume;
+    auto noiseStart = std::chrono::steady_clock::now();
+    bool noiseCached = !noiseCachePath.empty() && loadNoiseVolume(noiseCachePath, NOISE_SIZE, noiseVolume);
+    if (!noiseCached) {
+        noiseVolume = bakeNoiseVolume(NOISE_SIZE, referenceThreads);
+        if (!noiseCachePath.empty() && !saveNoiseVolume(noiseCachePath, NOISE_SIZE, noiseVolume)) cerr << "Failed to write " << noiseCachePath << endl;
+    }
+    cout << "noise volume " << NOISE_SIZE << "^3 R8 (" << noiseVolume.size() / 1024 << " KiB) "
+         << (noiseCached ? "loaded from " + noiseCachePath : "baked on " + to_string(referenceThreads) + " threads") << " in "
+         << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - noiseStart).count() << " ms" << endl;
+
+    // Height fog LUT over the scene's heights with a metre to spare, rebuilt
+    // by the loop whenever the profile changes. Anything flown outside it
+    // takes the closed form in heightFogMean().
+    AABB sceneBounds;
+    for (size_t i = 0; i < objectBoxes.size(); ++i) {
+        if (objectFlags[i] & OBJ_STATIC) sceneBounds.grow(objectBoxes[i]);
+    }
+    const float heightFogRange[2] = {sceneBounds.lo.y - 1.0f, sceneBounds.hi.y + 1.0f};
+    HeightFogProfile heightFogProfile = heightFogSettings();
+    vector<float> heightFogLUT = buildHeightFogLUT(heightFogProfile, heightFogRange);
+    PhaseSettings phase = phaseSettings();
+    vector<float> phaseLUT;
+    buildPhaseLUT(phase, phaseLUT);
+
+    glm::vec3 rotatingTarget = {0.0f, 0.0f, 0.0f};
+    glm::vec3 windOffset(0.0f);
+    float orbitRadius = 0.5f;
+
+    float coneInnerCos = 0.970f; 
+    float coneOuterCos = 0.95f;  
+
+    auto cameraFront = [&]() {
+        glm::vec3 front;
+        front.x = cos(glm::radians(cam.yaw)) * cos(glm::radians(cam.pitch));
+        front.y = sin(glm::radians(cam.pitch));
+        front.z = sin(glm::radians(cam.yaw)) * cos(glm::radians(cam.pitch));
+        return glm::normalize(front);
+    };
+
+    // Everything that moves with time: the light's target and the moving
+    // cube, refit into the BVH as it goes
+    auto animate = [&](float timeF) {
+        float targetX = sin(timeF * g_orbitSpeed) * orbitRadius;
+        float targetZ = cos(timeF * g_orbitSpeed) * orbitRadius;
+        rotatingTarget = {targetX, 0.0f, targetZ};
+
+        // Sampling upwind moves the fog downwind; wrapped to the volume
+        for (int c = 0; c < 3; ++c) {
+            float offset = -g_wind[c] * timeF * g_noiseScale;
+            windOffset[c] = offset - floor(offset);
+        }
+
+        if (g_movingCube) {
+            glm::vec3 p = {0.6f * cos(timeF * 0.5f), 1.1f + 0.2f * sin(timeF * 1.3f), 0.6f * sin(timeF * 0.5f)};
+            glm::mat4 model = glm::translate(glm::mat4(1.0f), p);
+            objects[movingCubeObject].model = glm::scale(model, glm::vec3(movingCubeSize));
+        }
+        bvh.update(movingCubeObject, transformBounds(meshBoxes[objectMesh[movingCubeObject]], objects[movingCubeObject].model),
+                   g_movingCube ? uint32_t(OBJ_DYNAMIC) : 0u);
+    };
+
+    // Cached: fixed frustum straight down, 70 deg covers the cone at any
+    // point of the orbit (14 deg tilt + 18 deg outer angle). Uncached: the
+    // tighter per-frame frustum aimed at the target.
+    auto lightViewProj = [&]() {
+        if (g_shadowCache) {
+            glm::mat4 lightProj = glm::perspective(glm::radians(70.0f), 1.0f, 0.1f, 50.0f);
+            glm::mat4 lightView = glm::lookAt(lightPos, lightPos + glm::vec3(0,-1,0), glm::vec3(0,0,-1));
+            return lightProj * lightView;
+        }
+        glm::mat4 lightProj = glm::perspective(glm::radians(45.0f), 1.0f, 0.1f, 50.0f);
+        glm::mat4 lightView = glm::lookAt(lightPos, rotatingTarget, glm::vec3(0,1,0));
+        return lightProj * lightView;
+    };
+
+    // The shadow pass's cull volume: the spotlight cone, or when cached the
+    // cone around the whole orbit, which is what the fixed frustum covers
+    auto lightCullVolume = [&](const glm::mat4& lightVP) {
+        CullVolume volume(lightVP);
+        float outerAngle = acos(coneOuterCos);
+        if (g_shadowCache) volume.setCone(lightPos, {0,-1,0}, outerAngle + atan(orbitRadius / lightPos.y), 50.0f);
+        else volume.setCone(lightPos, rotatingTarget - lightPos, outerAngle, 50.0f);
+        return volume;
+    };
+
+    if (cullBenchFrames > 0) {
+        // The render loop's queries, without GL: the camera at each preset
+        // and the light's static and dynamic layers along the orbit
+        glm::vec3 front = cameraFront();
+        glm::vec3 right = glm::normalize(glm::cross(front, {0,1,0}));
+        glm::vec3 up = glm::normalize(glm::cross(right, front));
+        vector<uint32_t> visible;
+        auto timeQuery = [&](const CullVolume& vol, uint32_t mask, CullStats& stats) {
+            auto start = std::chrono::steady_clock::now();
+            visible.clear();
+            bvh.query(vol, mask, visible, stats);
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        };
+        printf("cull bench: %zu objects, %d frames\n", objects.size(), cullBenchFrames);
+        for (int preset = 0; preset < 3; ++preset) {
+            glm::mat4 view = glm::lookAt(cameraPresets[preset], cameraPresets[preset] + front, up);
+            vector<double> ms;
+            CullStats stats;
+            for (int f = 0; f < cullBenchFrames; ++f) {
+                stats = CullStats();
+                ms.push_back(timeQuery(CullVolume(proj * view), OBJ_STATIC | OBJ_DYNAMIC, stats));
+            }
+            printf("  camera %d: mean %.3f ms  p95 %.3f ms  (%d tested, %d drawn)\n", preset + 1,
+                   accumulate(ms.begin(), ms.end(), 0.0) / ms.size(), percentile(ms, 95.0), stats.tested, stats.drawn);
+        }
+        for (int cached = 0; cached < 2; ++cached) {
+            g_shadowCache = cached != 0;
+            vector<double> ms;
+            CullStats stats;
+            for (int f = 0; f < cullBenchFrames; ++f) {
+                animate(f / 60.0f);
+                CullVolume volume = lightCullVolume(lightViewProj());
+                stats = CullStats();
+                ms.push_back(timeQuery(volume, OBJ_STATIC, stats) + timeQuery(volume, OBJ_DYNAMIC, stats));
+            }
+            printf("  light (%s): mean %.3f ms  p95 %.3f ms  (%d tested, %d drawn)\n", cached ? "cached" : "uncached",
+                   accumulate(ms.begin(), ms.end(), 0.0) / ms.size(), percentile(ms, 95.0), stats.tested, stats.drawn);
+        }
+        return 0;
+    }
+
+    // The FrameData fields shared by the GPU and the CPU reference; the
+    // render loop fills in its own targets and engine state
+    auto frameDataFor = [&](const glm::mat4& view, const glm::mat4& lightVP, int width, int height) {
+        FrameData frame = {};
+        frame.view = view;
+        frame.proj = proj;
+        frame.lightVP = lightVP;
+        frame.invViewProj = glm::inverse(proj * view);
+        frame.viewPos = cam.pos;
+        frame.lightPower = lightPower;
+        frame.lightPos = lightPos;
+        frame.shadowBias = 0.005f;
+        frame.lightColor = lightColor;
+        frame.fogDensity = g_fogDensity;
+        frame.windowCenter = rotatingTarget;
+        frame.extinction = g_extinction;
+        frame.fogAmbient = g_fogAmbient;
+        frame.coneAngleInner = coneInnerCos;
+        frame.coneAngleOuter = coneOuterCos;
+        // Temporal accumulation spreads the samples over frames, so each
+        // frame takes proportionally longer steps
+        frame.stepTarget = g_temporal ? g_stepTarget * float(g_numSamples) / float(g_temporalSamples) : g_stepTarget;
+        frame.transmittanceEps = g_transmittanceEps;
+        frame.numSamples = g_temporal ? g_temporalSamples : g_numSamples;
+        frame.showMapMode = g_showMapMode;
+        frame.stepRange[0] = g_stepMin;
+        frame.stepRange[1] = g_stepMax;
+        frame.screenSize[0] = (float)width;
+        frame.screenSize[1] = (float)height;
+        frame.dither = g_useDithering || g_temporal;
+        frame.coneClip = g_coneClip;
+        frame.adaptiveSteps = g_adaptiveSteps;
+        frame.shadowHierarchy = g_shadowHierarchy;
+        frame.noiseAmount = g_heterogeneousFog ? g_noiseStrength : 0.0f;
+        frame.noiseScale = g_noiseScale;
+        frame.windOffset = windOffset;
+        frame.heightFog = g_heightFog;
+        frame.heightFogRange[0] = heightFogRange[0];
+        frame.heightFogRange[1] = heightFogRange[1];
+        frame.heightFogLayers = {heightFogProfile.base, heightFogProfile.falloff, heightFogProfile.haze, heightFogProfile.hazeFalloff};
+        PhaseSettings phase = phaseSettings();
+        frame.phaseMode = glm::clamp(g_phaseMode, 0, 2);
+        frame.scatterOctaves = glm::clamp(g_scatterOctaves, 1, PHASE_LUT_OCTAVES);
+        frame.phaseG[0] = phase.g;
+        frame.phaseG[1] = phase.backG;
+        frame.phaseBackBlend = phase.backBlend;
+        for (int o = 0; o < PHASE_LUT_OCTAVES; ++o) {
+            frame.octaveExtinction[o] = pow(g_msExtinction, float(o));
+            frame.octaveWeight[o] = pow(phase.msScattering, float(o));
+            frame.octaveG[o] = pow(phase.msPhase, float(o));
+        }
+        return frame;
+    };
+
+    if (!referencePath.empty()) {
+        glm::vec3 front = cameraFront();
+        glm::vec3 right = glm::normalize(glm::cross(front, {0,1,0}));
+        glm::vec3 up = glm::normalize(glm::cross(right, front));
+        glm::mat4 view = glm::lookAt(cam.pos, cam.pos + front, up);
+        animate(float(referenceTime));
+        ReferenceRenderer reference{sceneVerts, meshes, objects, objectMesh, bvh, skyObject,
+                                    frameDataFor(view, lightViewProj(), outputW, outputH), noiseVolume, heightFogLUT, phaseLUT};
+        auto start = std::chrono::steady_clock::now();
+        vector<uint8_t> image = reference.render(outputW, outputH, referenceThreads);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (!writePPM(referencePath, outputW, outputH, image)) {
+            cerr << "Failed to write " << referencePath << endl;
+            return -1;
+        }
+        cout << "reference frame " << outputW << "x" << outputH << " in " << ms << " ms on "
+             << referenceThreads << " threads, " << REF_LANES << " lanes -> " << referencePath << endl;
+        if (referenceScaling) {
+            // Best of three per thread count; every count must reproduce the image
+            vector<int> counts;
+            for (int t = 1; t < referenceThreads; t *= 2) counts.push_back(t);
+            counts.push_back(referenceThreads);
+            double singleMs = 0.0;
+            printf("threads        ms  speedup  efficiency\n");
+            for (int t : counts) {
+                double best = DBL_MAX;
+                for (int rep = 0; rep < 3; ++rep) {
+                    auto runStart = std::chrono::steady_clock::now();
+                    vector<uint8_t> run = reference.render(outputW, outputH, t);
+                    best = min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - runStart).count());
+                    if (run != image) cerr << "reference frame on " << t << " threads differs" << endl;
+                }
+                if (t == 1) singleMs = best;
+                printf("%7d %9.1f %8.2f %10.0f%%\n", t, best, singleMs / best, 100.0 * singleMs / best / t);
+            }
+        }
+        return 0;
+    }
+
+    // The benchmark, the quality suite and offline rendering never show the
+    // window. Without a display they ask for GLFW's null platform (3.4+)
+    // with an OSMesa context, so they run on Mesa's llvmpipe with no GPU or
+    // X server.
+    bool benchmark = !benchPath.empty();
+    bool quality = !qualityPath.empty();
+    bool offline = !renderDir.empty();
+    bool headless = benchmark || quality || offline;
+#ifdef GLFW_PLATFORM_NULL
+    if (headless && !getenv("DISPLAY") && !getenv("WAYLAND_DISPLAY")) glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+#endif
+    if (!glfwInit()) { cerr << "Failed to init GLFW\n"; return -1; }
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    if (headless) {
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+#ifdef GLFW_PLATFORM_NULL
+        if (glfwGetPlatform() == GLFW_PLATFORM_NULL) glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_OSMESA_CONTEXT_API);
+#endif
+    }
 
-    GLFWwindow* w1 = glfwCreateWindow(1280, 720, "Fog Engine (T=Dither, M=Map Analysis, []=Dimmer)", nullptr, nullptr);
+    // 4.5 enables the compute-based froxel engine; 4.1 runs everything else
+    const char* title = "Fog Engine (T=Dither, M=Map Analysis, P=Pre-pass, R=Volume Res, Y=Temporal, V=Fog Engine (March/Froxel/Epipolar), K=Cone Clip, N=Adaptive Steps, H=Shadow Hierarchy, C=Shadow Cache, U=Shadow Rate Cap, B=Moving Cube, L=Culling, I=Stats, J=Shader Specialization, Z=Heterogeneous Fog, 4=Height Fog, 5=Phase Function, 6=Scattering Octaves, 7=Quality Governor, 8=Frame Budget, 9=Terrain View, 0=Terrain Traversal, O=Profiler, X=Trace Dump, []=Dimmer, -/=Height Falloff)";
+    GLFWwindow* w1 = glfwCreateWindow(outputW, outputH, title, nullptr, nullptr);
+    if (!w1) {
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+        w1 = glfwCreateWindow(outputW, outputH, title, nullptr, nullptr);
+    }
     if (!w1) { cerr << "Failed create window\n"; glfwTerminate(); return -1; }
     glfwMakeContextCurrent(w1);
     if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress)) { cerr << "Failed to init GLAD\n"; return -1; }
+    g_hasCompute = GLVersion.major > 4 || (GLVersion.major == 4 && GLVersion.minor >= 3);
 
     glEnable(GL_DEPTH_TEST);
     glfwSetCursorPosCallback(w1, cursorpos);
     glfwSetKeyCallback(w1, key_callback); 
-    glfwSetInputMode(w1, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    if (headless) {
+        cam.mouseCaptured = false;
+        glfwSwapInterval(0);
+    } else {
+        glfwSetInputMode(w1, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    }
 
-    GLuint simpleVS = compile(GL_VERTEX_SHADER, SIMPLE_VERT);
-    GLuint simpleFS = compile(GL_FRAGMENT_SHADER, SIMPLE_FRAG);
-    GLuint simpleProg = linkProgram(simpleVS, simpleFS);
-    glDeleteShader(simpleVS); glDeleteShader(simpleFS);
+    // Scene programs read per-frame data from the FrameData block and
+    // per-object data from the object buffer
+    // Programs are registered here and built on first use; the fog
+    // programs once per combination of the settings they specialize on
+    ProgramCache programs;
+    programs.dir = shaderCacheDir;
+    string scenePrefix = string(GLSL_410) + FRAME_DATA + OBJECT_DATA;
+    string sceneVertPrefix = scenePrefix + OBJECT_VERT;
+    string sceneFragPrefix = scenePrefix + OBJECT_FRAG;
+    string fogPrefix = string(GLSL_410) + FRAME_DATA + HEIGHT_FOG + FOG_COMMON + FOG_MARCH;
+    string epiFogPrefix = fogPrefix + EPIPOLAR_COMMON;
+    programs.add("simple", {{GL_VERTEX_SHADER, sceneVertPrefix + SIMPLE_VERT}, {GL_FRAGMENT_SHADER, sceneFragPrefix + SIMPLE_FRAG}});
+    programs.add("depth", {{GL_VERTEX_SHADER, sceneVertPrefix + DEPTH_VERT}, {GL_FRAGMENT_SHADER, DEPTH_FRAG}});
+    programs.add("shadow minmax", {{GL_VERTEX_SHADER, FULLSCREEN_VERT}, {GL_FRAGMENT_SHADER, SHADOW_MINMAX_FRAG}});
+    programs.add("fog", {{GL_VERTEX_SHADER, sceneVertPrefix + FOG_VERT}, {GL_FRAGMENT_SHADER, sceneFragPrefix + HEIGHT_FOG + FOG_COMMON + FOG_MARCH + FOG_FRAG}});
+    programs.add("prepass", {{GL_VERTEX_SHADER, sceneVertPrefix + PREPASS_VERT}, {GL_FRAGMENT_SHADER, DEPTH_FRAG}});
+    programs.add("volume", {{GL_VERTEX_SHADER, FULLSCREEN_VERT}, {GL_FRAGMENT_SHADER, fogPrefix + VOLUME_FRAG}});
+    programs.add("volume composite", {{GL_VERTEX_SHADER, FULLSCREEN_VERT}, {GL_FRAGMENT_SHADER, string(GLSL_410) + FRAME_DATA + HEIGHT_FOG + VOLUME_COMPOSITE_FRAG}});
+    programs.add("temporal", {{GL_VERTEX_SHADER, FULLSCREEN_VERT}, {GL_FRAGMENT_SHADER, TEMPORAL_FRAG}});
+    programs.add("epipolar coords", {{GL_VERTEX_SHADER, FULLSCREEN_VERT}, {GL_FRAGMENT_SHADER, string(GLSL_410) + EPIPOLAR_COMMON + EPIPOLAR_COORD_FRAG}});
+    programs.add("epipolar march", {{GL_VERTEX_SHADER, FULLSCREEN_VERT}, {GL_FRAGMENT_SHADER, epiFogPrefix + EPIPOLAR_MARCH_FRAG}});
+    programs.add("epipolar interp", {{GL_VERTEX_SHADER, FULLSCREEN_VERT}, {GL_FRAGMENT_SHADER, EPIPOLAR_INTERP_FRAG}});
+    programs.add("epipolar composite", {{GL_VERTEX_SHADER, FULLSCREEN_VERT}, {GL_FRAGMENT_SHADER, epiFogPrefix + EPIPOLAR_COMPOSITE_FRAG}});
+    programs.add("overlay", {{GL_VERTEX_SHADER, FULLSCREEN_VERT}, {GL_FRAGMENT_SHADER, OVERLAY_FRAG}});
+    programs.add("terrain", {{GL_VERTEX_SHADER, FULLSCREEN_VERT}, {GL_FRAGMENT_SHADER, string(GLSL_410) + FRAME_DATA + TERRAIN_FRAG}});
+    programs.add("froxel inject", {{GL_COMPUTE_SHADER, string(GLSL_430) + FRAME_DATA + HEIGHT_FOG + FOG_COMMON + FROXEL_INJECT_COMP}});
+    programs.add("froxel integrate", {{GL_COMPUTE_SHADER, string(GLSL_430) + FRAME_DATA + HEIGHT_FOG + FOG_COMMON + FROXEL_INTEGRATE_COMP}});
 
-    GLuint depthVS = compile(GL_VERTEX_SHADER, DEPTH_VERT);
-    GLuint depthFS = compile(GL_FRAGMENT_SHADER, DEPTH_FRAG);
-    GLuint depthProg = linkProgram(depthVS, depthFS);
-    glDeleteShader(depthVS); glDeleteShader(depthFS);
+    // #defines specializing the fog programs on this frame's settings
+    auto fogDefines = [](const FrameData& f) {
+        if (!g_specializeShaders) return string();
+        return "#define NUM_SAMPLES " + to_string(f.numSamples) + "\n#define DITHER " + (f.dither ? "true" : "false") +
+               "\n#define SHOW_MAP_MODE " + to_string(f.showMapMode) + "\n#define FOG_MODE " + to_string(f.fogMode) +
+               "\n#define DEFERRED_FOG " + (f.deferredFog ? "true" : "false") + "\n#define PHASE_MODE " + to_string(f.phaseMode) +
+               "\n#define SCATTER_OCTAVES " + to_string(f.scatterOctaves) + "\n";
+    };
+    // The same permutation as a number, so the render loop only builds the
+    // defines when it changes; 0 is the unspecialised program
+    auto fogVariant = [](const FrameData& f) -> uint64_t {
+        if (!g_specializeShaders) return 0;
+        return uint64_t(uint32_t(f.numSamples)) << 32 | uint64_t(f.showMapMode & 0xff) << 24 | uint64_t(f.phaseMode & 0xff) << 16 |
+               uint64_t(f.scatterOctaves & 0xff) << 8 | uint64_t(f.fogMode & 0xf) << 4 | uint64_t(f.deferredFog != 0) << 2 |
+               uint64_t(f.dither != 0) << 1 | 1;
+    };
 
-    GLuint fogVS = compile(GL_VERTEX_SHADER, FOG_VERT);
-    GLuint fogFS = compile(GL_FRAGMENT_SHADER, FOG_FRAG);
-    GLuint fogProg = linkProgram(fogVS, fogFS);
-    glDeleteShader(fogVS); glDeleteShader(fogFS);
+    // Used every frame, so built up front
+    auto startupStart = std::chrono::steady_clock::now();
+    GLuint simpleProg = programs.get("simple").id;
+    GLuint depthProg = programs.get("depth").id;
+    const Program& shadowMinMaxProg = programs.get("shadow minmax");
+    GLuint prepassProg = programs.get("prepass").id;
+    cout << "programs: " << programs.built << " built, " << programs.loaded << " from cache in "
+         << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startupStart).count() << " ms"
+         << (programs.dir.empty() ? " (no binary cache)" : "") << endl;
 
-    float aspect = 1280.f / 720.f;
-    glm::mat4 proj = glm::perspective(glm::radians(70.0f), aspect, 0.1f, 50.0f);
+    // Core profile needs a VAO bound even when the vertex shader has no inputs
+    GLuint fullscreenVAO = 0;
+    glGenVertexArrays(1, &fullscreenVAO);
 
-    auto quad = [&](glm::vec3 a, glm::vec3 b, glm::vec3 c, glm::vec3 d, glm::vec3 normal) {
-        return vector<float>{
-            a.x,a.y,a.z, normal.x, normal.y, normal.z, 
-            b.x,b.y,b.z, normal.x, normal.y, normal.z,
-            c.x,c.y,c.z, normal.x, normal.y, normal.z,
-            a.x,a.y,a.z, normal.x, normal.y, normal.z, 
-            c.x,c.y,c.z, normal.x, normal.y, normal.z,
-            d.x,d.y,d.z, normal.x, normal.y, normal.z
-        };
-    };
+    // Froxel grid: 160x90 tiles over the screen, 64 exponential depth slices
+    const int FROXEL_W = 160, FROXEL_H = 90, FROXEL_D = 64;
+    const float FROXEL_NEAR = 0.1f, FROXEL_FAR = 20.0f;
+    GLuint froxelScatterTex = 0, froxelIntegratedTex = 0;
+    if (g_hasCompute) {
+        GLuint* froxelTex[2] = {&froxelScatterTex, &froxelIntegratedTex};
+        for (GLuint* tex : froxelTex) {
+            glGenTextures(1, tex);
+            glBindTexture(GL_TEXTURE_3D, *tex);
+            glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA16F, FROXEL_W, FROXEL_H, FROXEL_D, 0, GL_RGBA, GL_FLOAT, nullptr);
+            glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        }
+    }
 
-    Mesh floorM = makeMesh(quad({-2,0,-2},{2,0,-2},{2,0,2},{-2,0,2}, {0,1,0}));
-    Mesh backM  = makeMesh(quad({-2,0,2},{2,0,2},{2,2,2},{-2,2,2}, {0,0,-1}));
-    Mesh leftM  = makeMesh(quad({-2,0,-2},{-2,0,2},{-2,2,2},{-2,2,-2}, {1,0,0}));
-    Mesh rightM = makeMesh(quad({2,0,2},{2,0,-2},{2,2,-2},{2,2,2}, {-1,0,0}));
-    
-    float cx0=-0.5f, cx1=0.5f, cz0=-0.5f, cz1=0.5f;
-    glm::vec3 ceilingNormal = {0,-1,0};
-    Mesh cwTop = makeMesh(quad({-2,2,cz1},{ 2,2,cz1},{ 2,2,2},{-2,2,2}, ceilingNormal));
-    Mesh cwBot = makeMesh(quad({-2,2,-2},{ 2,2,-2},{ 2,2,cz0},{-2,2,cz0}, ceilingNormal));
-    Mesh cwLft = makeMesh(quad({-2,2,cz0},{-2,2,cz1},{cx0,2,cz1},{cx0,2,cz0}, ceilingNormal));
-    Mesh cwRgt = makeMesh(quad({cx1,2,cz0},{cx1,2,cz1},{2,2,cz1},{2,2,cz0}, ceilingNormal));
-    Mesh sky   = makeMesh(quad({cx0,1.99f,cz0},{cx1,1.99f,cz0},{cx1,1.99f,cz1},{cx0,1.99f,cz1}, {0,1,0}));
-
-    Mesh cubeMesh = makeCube();
-    vector<glm::mat4> cubeModels;
-    vector<glm::vec3> cubeColors;
-    struct Cfg { glm::vec3 pos; float size; glm::vec3 color; };
-    vector<Cfg> cfgs = {
-        {{-1.0f, 0.0f, -1.0f}, 0.5f, {0.7f,0.4f,0.3f}},
-        {{ 1.2f, 0.0f,  0.5f}, 0.5f, {0.3f,0.7f,0.4f}},
-        {{-0.5f, 0.0f,  0.8f}, 0.4f, {0.5f,0.5f,0.8f}},
-        {{ 0.7f, 0.0f, -1.2f}, 0.4f, {0.9f,0.9f,0.5f}},
-        {{ 0.2f, 0.0f, -0.2f}, 0.5f, {0.6f,0.4f,0.8f}}
-    };
+    // Fog noise volume: tileable, so the wind offset wraps with GL_REPEAT
+    GLuint noiseTex = 0;
+    glGenTextures(1, &noiseTex);
+    glBindTexture(GL_TEXTURE_3D, noiseTex);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_R8, NOISE_SIZE, NOISE_SIZE, NOISE_SIZE, 0, GL_RED, GL_UNSIGNED_BYTE, noiseVolume.data());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_REPEAT);
 
-    for (auto &c : cfgs) {
-        glm::mat4 model(1.0f);
-        model = glm::translate(model, glm::vec3(c.pos.x, c.size / 2.0f, c.pos.z));
-        model = glm::scale(model, glm::vec3(c.size)); 
-        cubeModels.push_back(model);
-        cubeColors.push_back(c.color);
-    }
- 
-    glm::vec3 lightPos = {0.0f, 1.99f, 0.0f}; 
-    glm::vec3 lightColor = {1.0f, 0.9f, 0.7f};
-    float lightPower = 4.5f;
+    // Height fog LUT: bilinear between texel centres, clamped at the range ends
+    GLuint heightFogTex = 0;
+    glGenTextures(1, &heightFogTex);
+    glBindTexture(GL_TEXTURE_2D, heightFogTex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, HEIGHT_FOG_LUT_SIZE, HEIGHT_FOG_LUT_SIZE, 0, GL_RED, GL_FLOAT, heightFogLUT.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
-    glm::vec3 rotatingTarget = {0.0f, 0.0f, 0.0f};
-    float orbitRadius = 0.5f;
-    float extinctionCoeff = 0.1f; 
+    // Phase LUT: linear along the angle, one row per octave
+    GLuint phaseTex = 0;
+    glGenTextures(1, &phaseTex);
+    glBindTexture(GL_TEXTURE_2D, phaseTex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, PHASE_LUT_SIZE, PHASE_LUT_OCTAVES, 0, GL_RED, GL_FLOAT, phaseLUT.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
-    float coneInnerCos = 0.970f; 
-    float coneOuterCos = 0.95f;  
+    // Terrain: the resident tiles' heights and max levels as layers of two
+    // arrays, the page table and the coarse max levels, all read with
+    // texelFetch. Filled in by the loop as tiles stream in.
+    TerrainMap terrainMap;
+    TerrainStreamer terrainStreamer;
+    vector<pair<int, int>> terrainWanted;
+    int terrainCenterX = INT_MIN, terrainCenterZ = INT_MIN;
+    GLuint terrainTex[4] = {0, 0, 0, 0}; // heights, maxima, pages, coarse
+    glGenTextures(4, terrainTex);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, terrainTex[0]);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R32F, TERRAIN_SAMPLES, TERRAIN_SAMPLES, TERRAIN_POOL, 0, GL_RED, GL_FLOAT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, terrainTex[1]);
+    for (int level = 0; level < TERRAIN_TILE_LEVELS; ++level)
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, level, GL_R32F, TERRAIN_TILE >> level, TERRAIN_TILE >> level, TERRAIN_POOL, 0, GL_RED, GL_FLOAT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, TERRAIN_TILE_LEVELS - 1);
+    glBindTexture(GL_TEXTURE_2D, terrainTex[2]);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32I, TERRAIN_MAP_TILES, TERRAIN_MAP_TILES, 0, GL_RED_INTEGER, GL_INT, terrainMap.pages.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    glBindTexture(GL_TEXTURE_2D, terrainTex[3]);
+    for (int level = 0; level < TERRAIN_MAP_LEVELS; ++level)
+        glTexImage2D(GL_TEXTURE_2D, level, GL_R32F, TERRAIN_MAP_TILES >> level, TERRAIN_MAP_TILES >> level, 0, GL_RED, GL_FLOAT,
+                     terrainMap.coarse.data() + TerrainMap::coarseOffset(level));
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, TERRAIN_MAP_LEVELS - 1);
+
+    // One finished tile into the map and its textures: its layers, its and
+    // any evicted tile's page entry, and its path up the coarse levels
+    auto uploadTerrainTile = [&](TerrainTile& tile, const glm::vec3& camPos) {
+        int evictedX, evictedZ;
+        int slot = terrainMap.insert(tile, camPos.x, camPos.z, evictedX, evictedZ);
+        if (slot < 0) return;
+        const TerrainTile& t = terrainMap.pool[slot];
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glActiveTexture(GL_TEXTURE0 + UNIT_TERRAIN_HEIGHTS);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, terrainTex[0]);
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, slot, TERRAIN_SAMPLES, TERRAIN_SAMPLES, 1, GL_RED, GL_FLOAT, t.heights.data());
+        glActiveTexture(GL_TEXTURE0 + UNIT_TERRAIN_MAXIMA);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, terrainTex[1]);
+        for (int level = 0; level < TERRAIN_TILE_LEVELS; ++level)
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, slot, TERRAIN_TILE >> level, TERRAIN_TILE >> level, 1, GL_RED, GL_FLOAT,
+                            t.maxima.data() + terrainLevelOffset(level));
+        glActiveTexture(GL_TEXTURE0 + UNIT_TERRAIN_PAGES);
+        glBindTexture(GL_TEXTURE_2D, terrainTex[2]);
+        if (evictedX >= 0) {
+            int none = -1;
+            glTexSubImage2D(GL_TEXTURE_2D, 0, evictedX, evictedZ, 1, 1, GL_RED_INTEGER, GL_INT, &none);
+        }
+        glTexSubImage2D(GL_TEXTURE_2D, 0, t.x, t.z, 1, 1, GL_RED_INTEGER, GL_INT, &slot);
+        glActiveTexture(GL_TEXTURE0 + UNIT_TERRAIN_COARSE);
+        glBindTexture(GL_TEXTURE_2D, terrainTex[3]);
+        for (int level = 0; level < TERRAIN_MAP_LEVELS; ++level) {
+            int i = t.x >> level, j = t.z >> level;
+            glTexSubImage2D(GL_TEXTURE_2D, level, i, j, 1, 1, GL_RED, GL_FLOAT,
+                            &terrainMap.coarse[TerrainMap::coarseOffset(level) + size_t(j) * (TERRAIN_MAP_TILES >> level) + i]);
+        }
+        glActiveTexture(GL_TEXTURE0);
+    };
+
+    // Epipolar sampling targets: marched coordinates, scattering, interpolated
+    GLuint epiFBO[3] = {0, 0, 0}, epiTex[3] = {0, 0, 0}; // coords, marched, interpolated
+    const GLenum epiFormat[3] = {GL_RGBA32F, GL_RGBA16F, GL_RGBA16F};
+    glGenFramebuffers(3, epiFBO);
+    glGenTextures(3, epiTex);
+    for (int i = 0; i < 3; ++i) {
+        glBindTexture(GL_TEXTURE_2D, epiTex[i]);
+        glTexImage2D(GL_TEXTURE_2D, 0, epiFormat[i], EPI_SAMPLES, EPI_LINES, 0, GL_RGBA, GL_FLOAT, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, epiFBO[i]);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, epiTex[i], 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            cerr << "Epipolar FBO " << i << " incomplete\n";
+        }
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-    const int SHADOW_RES = 1024;
     GLuint shadowFBO = 0;
     GLuint shadowTex = 0;
     glGenFramebuffers(1, &shadowFBO);
     glGenTextures(1, &shadowTex);
     glBindTexture(GL_TEXTURE_2D, shadowTex);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, SHADOW_RES, SHADOW_RES, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glBindFramebuffer(GL_FRAMEBUFFER, shadowFBO);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, shadowTex, 0);
-    glDrawBuffer(GL_NONE);
-    glReadBuffer(GL_NONE);
-    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-        cerr << "Shadow FBO incomplete\n";
+
+
+    // Static layer of the shadow cache, copied into shadowTex before the
+    // dynamic objects are drawn
+    GLuint staticShadowFBO = 0, staticShadowTex = 0;
+    glGenFramebuffers(1, &staticShadowFBO);
+    glGenTextures(1, &staticShadowTex);
+    glBindTexture(GL_TEXTURE_2D, staticShadowTex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    // Shadow cache state: shadowVP is the matrix shadowTex was rendered with
+    glm::mat4 shadowVP(1.0f), staticShadowVP(1.0f);
+    bool staticShadowValid = false, shadowValid = false, shadowMinMaxValid = false;
+    bool shadowHadDynamic = false;
+    double lastShadowUpdate = -1e9;
+    int shadowUpdates = 0;
+
+    // Min/max depth chain over the shadow map, rebuilt after every shadow
+    // pass: level 0 is shadowRes / 2, down to 1x1
+    int shadowMinMaxLevels = 0;
+    GLuint shadowMinMaxFBO = 0, shadowMinMaxTex = 0;
+    glGenFramebuffers(1, &shadowMinMaxFBO);
+    glGenTextures(1, &shadowMinMaxTex);
+    glBindTexture(GL_TEXTURE_2D, shadowMinMaxTex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    // (Re)allocates the shadow map, its static layer and min/max chain at
+    // res x res (a power of two); the governor changes it at run time, and
+    // every cached shadow is invalid afterwards
+    int shadowRes = 0;
+    auto allocateShadowMaps = [&](int res) {
+        shadowRes = res;
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, shadowTex);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, res, res, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+        glBindTexture(GL_TEXTURE_2D, staticShadowTex);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, res, res, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+        shadowMinMaxLevels = 0;
+        for (int s = res / 2; s >= 1; s /= 2) shadowMinMaxLevels++;
+        glBindTexture(GL_TEXTURE_2D, shadowMinMaxTex);
+        for (int level = 0; level < shadowMinMaxLevels; ++level) {
+            int s = (res / 2) >> level;
+            glTexImage2D(GL_TEXTURE_2D, level, GL_RG32F, s, s, 0, GL_RG, GL_FLOAT, nullptr);
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, shadowMinMaxLevels - 1);
+
+        const GLuint fbos[2] = {shadowFBO, staticShadowFBO};
+        const GLuint texs[2] = {shadowTex, staticShadowTex};
+        for (int i = 0; i < 2; ++i) {
+            glBindFramebuffer(GL_FRAMEBUFFER, fbos[i]);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, texs[i], 0);
+            glDrawBuffer(GL_NONE);
+            glReadBuffer(GL_NONE);
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+                cerr << (i == 0 ? "Shadow" : "Static shadow") << " FBO incomplete at " << res << "\n";
+            }
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        staticShadowValid = shadowValid = shadowMinMaxValid = false;
+    };
+    auto roundShadowRes = [](int res) { return glm::clamp(1 << int(round(log2(float(max(res, 1))))), 64, 8192); };
+    g_shadowRes = roundShadowRes(g_shadowRes);
+    allocateShadowMaps(g_shadowRes);
+
+    // Per-frame uniform block, shared by every program that declares FrameData
+    GLuint frameUBO = 0;
+    glGenBuffers(1, &frameUBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, frameUBO);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameData), nullptr, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UBO_BINDING, frameUBO);
+
+    // All scene geometry in one vertex buffer behind one VAO. Attribute 2 is
+    // the per-instance draw ID, read from this frame's draw ID list.
+    GLuint sceneVAO = 0, sceneVBO = 0, drawIDBuffer = 0;
+    glGenVertexArrays(1, &sceneVAO);
+    glBindVertexArray(sceneVAO);
+    glGenBuffers(1, &sceneVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, sceneVBO);
+    glBufferData(GL_ARRAY_BUFFER, sceneVerts.size() * sizeof(float), sceneVerts.data(), GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
+    glGenBuffers(1, &drawIDBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, drawIDBuffer);
+    glEnableVertexAttribArray(2);
+    glVertexAttribIPointer(2, 1, GL_INT, 0, (void*)0);
+    glVertexAttribDivisor(2, 1);
+    glBindVertexArray(0);
+
+    // Draw commands go out through glMultiDrawArraysIndirect on GL 4.3. On
+    // 4.1 the same list is walked on the CPU, offsetting the draw ID
+    // attribute in place of baseInstance.
+    bool multiDrawIndirect = GLVersion.major > 4 || (GLVersion.major == 4 && GLVersion.minor >= 3);
+    GLuint drawCommandBuffer = 0;
+    if (multiDrawIndirect) {
+        glGenBuffers(1, &drawCommandBuffer);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, drawCommandBuffer);
     }
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-    auto drawMesh = [&](const Mesh& m, GLuint prog, glm::vec3 color, const glm::mat4& view, const glm::mat4& projection, const glm::mat4& model = glm::mat4(1.0f)) {
-        glUseProgram(prog);
-        GLint locM = glGetUniformLocation(prog, "uModel");
-        GLint locV = glGetUniformLocation(prog, "uView");
-        GLint locP = glGetUniformLocation(prog, "uProj");
-        if (locM >= 0) glUniformMatrix4fv(locM, 1, GL_FALSE, glm::value_ptr(model));
-        if (locV >= 0) glUniformMatrix4fv(locV, 1, GL_FALSE, glm::value_ptr(view));
-        if (locP >= 0) glUniformMatrix4fv(locP, 1, GL_FALSE, glm::value_ptr(projection));
-        GLint locC = glGetUniformLocation(prog, "uColor");
-        if (locC >= 0) glUniform3f(locC, color.r, color.g, color.b);
-        glBindVertexArray(m.vao);
-        glDrawArrays(m.mode, 0, m.count);
+    // Object buffer behind the uObjects buffer texture. With GL 4.4 it is a
+    // persistently mapped ring of OBJECT_RING regions, each fenced until the
+    // GPU is done with it; otherwise one region updated with glBufferSubData.
+    // Static objects are written once; per frame only the dynamic tail
+    // from movingCubeObject on is rewritten.
+    const int OBJECT_RING = 3;
+    bool persistentObjects = GLVersion.major > 4 || (GLVersion.major == 4 && GLVersion.minor >= 4);
+    GLsizeiptr objectBytes = GLsizeiptr(objects.size() * sizeof(ObjectData));
+    GLsizeiptr objectRegion = objectBytes;
+    GLuint objectBuffer = 0, objectTex = 0;
+    GLsizeiptr dynamicObjectOffset = GLsizeiptr(movingCubeObject * sizeof(ObjectData));
+    GLsizeiptr dynamicObjectBytes = objectBytes - dynamicObjectOffset;
+    char* objectMapped = nullptr;
+    GLsync objectFences[OBJECT_RING] = {};
+    glGenBuffers(1, &objectBuffer);
+    glGenTextures(1, &objectTex);
+    glBindBuffer(GL_TEXTURE_BUFFER, objectBuffer);
+    glBindTexture(GL_TEXTURE_BUFFER, objectTex);
+    if (persistentObjects) {
+        GLint align = 1;
+        glGetIntegerv(GL_TEXTURE_BUFFER_OFFSET_ALIGNMENT, &align);
+        objectRegion = (objectBytes + align - 1) / align * align;
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_TEXTURE_BUFFER, objectRegion * OBJECT_RING, nullptr, flags);
+        objectMapped = (char*)glMapBufferRange(GL_TEXTURE_BUFFER, 0, objectRegion * OBJECT_RING, flags);
+        for (int region = 0; region < OBJECT_RING; ++region) {
+            memcpy(objectMapped + region * objectRegion, objects.data(), objectBytes);
+        }
+    } else {
+        glBufferData(GL_TEXTURE_BUFFER, objectBytes, objects.data(), GL_DYNAMIC_DRAW);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, objectBuffer);
+    }
+    GLint maxTexels = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+    if ((GLint64)objects.size() * OBJECT_TEXELS > maxTexels) {
+        cerr << "object table exceeds GL_MAX_TEXTURE_BUFFER_SIZE (" << maxTexels << " texels)\n";
+    }
+
+    // Frame profiler and its overlay text, refreshed four times a second
+    Profiler profiler;
+    profiler.historyFrames = traceFrames;
+    double overlayTime = -1.0;
+    int overlayW = 0, overlayH = 0;
+    GLuint overlayTex = 0;
+    glGenTextures(1, &overlayTex);
+    glBindTexture(GL_TEXTURE_2D, overlayTex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    // Draw calls submitted this frame and the CPU time spent submitting them
+    int drawCalls = 0;
+    double submitSeconds = 0.0;
+    int submitFrames = 0;
+    int statsDrawCalls = 0;
+
+    // Per-frame draw lists: visible objects grouped by mesh into commands,
+    // whose baseInstance points into frameDrawIDs
+    struct DrawList { int first = 0, count = 0; };
+    vector<DrawCommand> frameCommands;
+    vector<GLint> frameDrawIDs;
+    vector<GLuint> meshCursor;
+    auto appendDrawList = [&](const vector<uint32_t>& ids) {
+        DrawList list;
+        list.first = int(frameCommands.size());
+        meshCursor.assign(meshes.size(), 0);
+        for (uint32_t id : ids) meshCursor[objectMesh[id]]++;
+        GLuint base = GLuint(frameDrawIDs.size());
+        for (size_t mi = 0; mi < meshes.size(); ++mi) {
+            GLuint n = meshCursor[mi];
+            if (!n) continue;
+            frameCommands.push_back({GLuint(meshes[mi].count), n, GLuint(meshes[mi].first), base});
+            meshCursor[mi] = base;
+            base += n;
+        }
+        frameDrawIDs.resize(base);
+        for (uint32_t id : ids) frameDrawIDs[meshCursor[objectMesh[id]]++] = GLint(id);
+        list.count = int(frameCommands.size()) - list.first;
+        return list;
+    };
+
+    // One culling query, straight into a draw list
+    vector<uint32_t> visible;
+    auto cullDrawList = [&](const CullVolume& vol, uint32_t mask, CullStats& stats) {
+        visible.clear();
+        if (g_culling) bvh.query(vol, mask, visible, stats);
+        else bvh.queryAll(mask, visible, stats);
+        return appendDrawList(visible);
+    };
+
+    // Submits a draw list with the bound program
+    auto drawList = [&](const DrawList& list) {
+        if (list.count <= 0) return;
+        glBindVertexArray(sceneVAO);
+        if (multiDrawIndirect) {
+            glMultiDrawArraysIndirect(GL_TRIANGLES, (const void*)(list.first * sizeof(DrawCommand)), list.count, 0);
+            drawCalls++;
+            return;
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, drawIDBuffer);
+        for (int i = list.first; i < list.first + list.count; ++i) {
+            const DrawCommand& c = frameCommands[i];
+            glVertexAttribIPointer(2, 1, GL_INT, 0, (const void*)(c.baseInstance * sizeof(GLint)));
+            glDrawArraysInstanced(GL_TRIANGLES, c.first, c.count, c.instanceCount);
+            drawCalls++;
+        }
+    };
+    DrawList skyList;
+    auto drawSky = [&]() {
+        profiler.beginGpu("sky");
+        glUseProgram(simpleProg);
+        drawList(skyList);
+        profiler.endGpu();
+    };
+
+    // Culling time and the last counters of each view
+    double cullSeconds = 0.0;
+    CullStats statsCamera, statsLight;
+
+    // Render targets for the deferred volumetric pass, (re)built on resize
+    // or when the downsample factor changes
+    GLuint sceneFBO = 0, sceneColorTex = 0, sceneDepthTex = 0;
+    GLuint volumeFBO = 0, volumeTex = 0;
+    GLuint historyFBO[2] = {0, 0}, historyTex[2] = {0, 0};
+    int sceneW = 0, sceneH = 0, volumeW = 0, volumeH = 0, volumeDS = 0;
+    bool historyValid = false;
+    auto ensureVolumeTargets = [&](int w, int h, int downsample) {
+        if (w != sceneW || h != sceneH) {
+            if (!sceneFBO) {
+                glGenFramebuffers(1, &sceneFBO);
+                glGenTextures(1, &sceneColorTex);
+                glGenTextures(1, &sceneDepthTex);
+            }
+            glBindTexture(GL_TEXTURE_2D, sceneColorTex);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, w, h, 0, GL_RGBA, GL_FLOAT, nullptr);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glBindTexture(GL_TEXTURE_2D, sceneDepthTex);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, w, h, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glBindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, sceneColorTex, 0);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, sceneDepthTex, 0);
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+                cerr << "Scene FBO incomplete\n";
+            }
+            sceneW = w; sceneH = h;
+            volumeDS = 0;
+        }
+        if (downsample != volumeDS) {
+            if (!volumeFBO) {
+                glGenFramebuffers(1, &volumeFBO);
+                glGenTextures(1, &volumeTex);
+            }
+            volumeW = (w + downsample - 1) / downsample;
+            volumeH = (h + downsample - 1) / downsample;
+            glBindTexture(GL_TEXTURE_2D, volumeTex);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R11F_G11F_B10F, volumeW, volumeH, 0, GL_RGB, GL_FLOAT, nullptr);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glBindFramebuffer(GL_FRAMEBUFFER, volumeFBO);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, volumeTex, 0);
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+                cerr << "Volume FBO incomplete\n";
+            }
+
+            // Temporal history, ping-ponged; RGBA16F so small increments survive
+            if (!historyFBO[0]) {
+                glGenFramebuffers(2, historyFBO);
+                glGenTextures(2, historyTex);
+            }
+            for (int i = 0; i < 2; ++i) {
+                glBindTexture(GL_TEXTURE_2D, historyTex[i]);
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, volumeW, volumeH, 0, GL_RGBA, GL_FLOAT, nullptr);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+                glBindFramebuffer(GL_FRAMEBUFFER, historyFBO[i]);
+                glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, historyTex[i], 0);
+            }
+            historyValid = false;
+            volumeDS = downsample;
+        }
+    };
+
+    // Samples that reach the fog shader in the colour pass. Two queries so we
+    // read last frame's result instead of stalling on this one.
+    GLuint shadedQuery[2];
+    glGenQueries(2, shadedQuery);
+    int frameIndex = 0;
+    GLuint64 shadedFragments = 0;
+    double statsTime = 0.0;
+
+    // GPU time per pass, armed by the benchmark. A pass can be entered more
+    // than once a frame (the scene pass is split by the froxel dispatch);
+    // its intervals add up.
+    const int MAX_PASS_QUERIES = 16;
+    GLuint passQueries[MAX_PASS_QUERIES];
+    FramePass passQueryPass[MAX_PASS_QUERIES];
+    int passQueryCount = 0;
+    bool timePasses = benchmark;
+    double framePassMs[PASS_COUNT] = {};
+    auto passStart = std::chrono::steady_clock::now();
+    glGenQueries(MAX_PASS_QUERIES, passQueries);
+    auto beginPass = [&](FramePass pass) {
+        if (!timePasses || passQueryCount == MAX_PASS_QUERIES) return;
+        passQueryPass[passQueryCount] = pass;
+        if (benchSyncPasses) {
+            glFinish();
+            passStart = std::chrono::steady_clock::now();
+        } else {
+            glBeginQuery(GL_TIME_ELAPSED, passQueries[passQueryCount]);
+        }
+    };
+    auto endPass = [&]() {
+        if (!timePasses || passQueryCount == MAX_PASS_QUERIES) return;
+        if (benchSyncPasses) {
+            glFinish();
+            framePassMs[passQueryPass[passQueryCount]] += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - passStart).count();
+        } else {
+            glEndQuery(GL_TIME_ELAPSED);
+        }
+        passQueryCount++;
+    };
+
+    // Benchmark script: every sweep config runs each camera preset for
+    // benchWarmup + benchFrames frames on a fixed 60 Hz clock restarted at
+    // 0, so every config sees the same camera and light motion. Map modes 3
+    // and 4 always take the per-fragment march, so the default crosses the
+    // fog modes too to time the froxel and epipolar engines.
+    vector<BenchConfig> benchConfigs = expandSweep(benchSweeps.empty()
+        ? vector<string>{"numSamples=16,64,128", "dithering=0,1", "fogMode=0,1,2", "showMapMode=0,1,2,3,4"} : benchSweeps);
+    vector<BenchResult> benchResults;
+    size_t benchConfig = 0;
+    int benchPreset = 0, benchFrame = 0;
+    vector<double> benchFrameMs;
+    double benchPassMs[PASS_COUNT] = {};
+    auto applyConfig = [&](const BenchConfig& config) {
+        for (const auto& setting : config.settings) {
+            if (!setParam(setting.first, setting.second)) cerr << "Unknown setting " << setting.first << endl;
+        }
+    };
+    if (benchmark) {
+        cout << "benchmark: " << benchConfigs.size() << " configs x 3 presets x " << benchFrames << " frames, "
+             << outputW << "x" << outputH << " on " << (const char*)glGetString(GL_RENDERER) << endl;
+        applyConfig(benchConfigs[benchConfig]);
+    }
+
+    // Offline rendering: frames land in outputFBO instead of the window,
+    // are copied into a ring of pixel buffers and picked up once their
+    // fence has passed, so the loop only waits on a readback when the
+    // whole ring is still in flight. The copies go to the encoder threads.
+    GLuint outputFBO = 0;
+    vector<BenchConfig> renderConfigs = expandSweep(benchSweeps);
+    size_t renderConfig = 0;
+    int renderFrame = 0;
+    uint64_t renderIssued = 0, readbackStalls = 0, readbackInFlight = 0;
+    double readbackWaitSeconds = 0.0;
+    struct Readback { GLuint pbo = 0; GLsync fence = nullptr; string path; };
+    vector<Readback> readbacks;
+    FrameWriter frameWriter;
+    ofstream renderIndex;
+    size_t frameBytes = size_t(outputW) * outputH * framePixelBytes(renderFormat);
+    auto renderStart = std::chrono::steady_clock::now();
+    auto collectReadback = [&](Readback& r) {
+        auto waitStart = std::chrono::steady_clock::now();
+        glClientWaitSync(r.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GLuint64(10000000000)); // 10 s
+        readbackWaitSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - waitStart).count();
+        glDeleteSync(r.fence);
+        r.fence = nullptr;
+        FrameWriter::Job job;
+        job.path = r.path;
+        job.width = outputW;
+        job.height = outputH;
+        job.format = renderFormat;
+        job.pixels = frameWriter.buffer(frameBytes);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, r.pbo);
+        if (const void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frameBytes, GL_MAP_READ_BIT)) {
+            memcpy(job.pixels.data(), mapped, frameBytes);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            frameWriter.submit(move(job));
+        } else {
+            cerr << "Failed to map the readback of " << r.path << endl;
+            frameWriter.failed++;
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
     };
+    if (offline) {
+        error_code ec;
+        filesystem::create_directories(renderDir, ec);
+        renderIndex.open(renderDir + "/frames.csv");
+        if (!renderIndex) {
+            cerr << "Failed to write " << renderDir << "/frames.csv" << endl;
+            glfwTerminate();
+            return -1;
+        }
+        renderIndex << "frame,config,time,file\n";
+    }
+    if (offline || quality) {
+        GLuint outputRB[2] = {0, 0}; // colour, depth
+        glGenFramebuffers(1, &outputFBO);
+        glGenRenderbuffers(2, outputRB);
+        glBindRenderbuffer(GL_RENDERBUFFER, outputRB[0]);
+        glRenderbufferStorage(GL_RENDERBUFFER, renderFormat == FRAME_PFM ? GL_RGBA32F : GL_RGBA8, outputW, outputH);
+        glBindRenderbuffer(GL_RENDERBUFFER, outputRB[1]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, outputW, outputH);
+        glBindFramebuffer(GL_FRAMEBUFFER, outputFBO);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, outputRB[0]);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, outputRB[1]);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            cerr << "Output FBO incomplete\n";
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    if (offline) {
+        readbacks.resize(renderRing);
+        for (Readback& r : readbacks) {
+            glGenBuffers(1, &r.pbo);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, r.pbo);
+            glBufferData(GL_PIXEL_PACK_BUFFER, frameBytes, nullptr, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        frameWriter.start(renderEncoders, 2 * size_t(renderEncoders));
+        cout << "render: " << renderConfigs.size() << " configs x " << renderFrames << " frames, " << outputW << "x" << outputH
+             << " " << FRAME_FORMAT_NAMES[renderFormat] << " -> " << renderDir << ", " << renderRing << " readback buffers, "
+             << renderEncoders << " encoders on " << (const char*)glGetString(GL_RENDERER) << endl;
+        applyConfig(renderConfigs[renderConfig]);
+        renderStart = std::chrono::steady_clock::now();
+    }
+
+    // Quality suite: every view as ground truth first, then each sweep
+    // config over the same views. A view holds the clock still, so the
+    // last of its frames (the one read back) has had the warmup frames to
+    // settle temporal history and shadow caches. The truth keeps no history
+    // and is rendered once per view, after one frame with the spotlight's
+    // power at zero: the marched beam is all the configs differ in, so a
+    // view where that frame matches the truth cannot tell them apart.
+    vector<BenchConfig> qualityConfigs = expandSweep(benchSweeps.empty()
+        ? vector<string>{"numSamples=16,32,64,128", "dithering=0,1", "fogMode=0,1,2"} : benchSweeps);
+    int qualityViews = int(size(QUALITY_VIEWS) * qualityPhases.size());
+    int qualityConfig = -1, qualityView = 0, qualityFrame = 0; // config -1 is the truth
+    float qualityLightPower = lightPower;
+    vector<pair<string, string>> qualityBase; // settings the truth overrides, as they were
+    vector<FlipImage> qualityTruth(qualityViews);
+    vector<vector<uint8_t>> qualityTruthPixels(qualityViews);
+    vector<double> qualityFrameMs;
+    vector<QualityResult> qualityResults;
+    vector<uint8_t> qualityBeamless;
+    if (quality) {
+        cout << "quality: " << qualityConfigs.size() << " configs x " << qualityViews << " views against " << QUALITY_TRUTH_SAMPLES
+             << "-sample truth (one frame each), " << qualityWarmup << " + " << qualityFrames << " frames per config and view, " << outputW << "x" << outputH
+             << " on " << (const char*)glGetString(GL_RENDERER) << endl;
+        for (const auto& setting : QUALITY_TRUTH) {
+            qualityBase.push_back({setting.first, getParam(setting.first)});
+            setParam(setting.first, setting.second);
+        }
+    }
+
+    glm::mat4 prevViewProj(1.0f);
+    glm::vec3 prevLightAxis(0.0f, -1.0f, 0.0f);
+    bool temporalWasOn = false;
+
+    // The stream's reader thread owns all the I/O; the loop only picks up
+    // the latest window, so a stalled source never stalls a frame
+    EnvironmentStream envStream;
+    bool envActive = false;
+    float envDensityPerExtinction = g_fogDensity / max(g_extinction, 1e-6f);
+    EnvironmentRecord envCurrent;
+    if (!envSource.empty()) {
+        envActive = envStream.open(envSource, envSpeed);
+        if (!envActive) cerr << "Failed to open environment stream " << envSource << endl;
+    }
+
+    // Quality governor, fed from the profiler's GPU scopes; the profiler
+    // runs (without its overlay) whenever the governor is on
+    QualityGovernor governor;
+    bool governorWasOn = false;
+    float governorBudget = g_frameBudgetMs;
+    uint64_t governorGpuFrame = UINT64_MAX;
+    double governorGpuMs = 0.0, governorFogMs = 0.0, governorShadowMs = 0.0;
+    if (!governorLogPath.empty()) {
+        governor.log.open(governorLogPath);
+        if (!governor.log) cerr << "Failed to write " << governorLogPath << endl;
+    }
+
+    // The render loop's programs, looked up again only when the fog
+    // variant changes (key 0 has no defines)
+    uint64_t variantKey = 0;
+    string variantDefines;
+    ProgramCache::Slot fogSlot, froxelInjectSlot, froxelIntegrateSlot, epiCoordSlot, epiMarchSlot, epiInterpSlot,
+                       epiCompositeSlot, volumeSlot, temporalSlot, volumeCompositeSlot, terrainSlot, overlaySlot;
 
     double lastTime = glfwGetTime(); 
     bool wire = false; 
 
     while (!glfwWindowShouldClose(w1)) 
     {
-        double now = glfwGetTime();
+        auto frameStart = std::chrono::steady_clock::now();
+        double now = benchmark ? benchFrame / 60.0
+                   : quality ? qualityPhases[qualityView % qualityPhases.size()]
+                   : offline ? referenceTime + renderFrame / 60.0 : glfwGetTime();
         float dt = float(now-lastTime);
         lastTime=now;
+        passQueryCount = 0;
+        fill(framePassMs, framePassMs + PASS_COUNT, 0.0);
+        profiler.setEnabled(g_profiler || g_governor);
+        profiler.beginFrame(frameIndex);
 
+        profiler.beginCpu("input");
         if (glfwGetKey(w1, GLFW_KEY_F) == GLFW_PRESS) wire = true;
         if (glfwGetKey(w1, GLFW_KEY_G) == GLFW_PRESS) wire = false;
         glPolygonMode(GL_FRONT_AND_BACK, wire ? GL_LINE : GL_FILL);
 
-        glm::vec3 front;
-        front.x = cos(glm::radians(cam.yaw)) * cos(glm::radians(cam.pitch));
-        front.y = sin(glm::radians(cam.pitch));
-        front.z = sin(glm::radians(cam.yaw)) * cos(glm::radians(cam.pitch));
-        front = glm::normalize(front);
+        glm::vec3 front = cameraFront();
         glm::vec3 right = glm::normalize(glm::cross(front, {0,1,0}));
         glm::vec3 up = glm::normalize(glm::cross(right, front));
 
@@ -490,133 +6156,831 @@ int main() {
         if (glfwGetKey(w1, GLFW_KEY_Q) == GLFW_PRESS) cam.pos -= up * cam.speed * dt;
         if (glfwGetKey(w1, GLFW_KEY_E) == GLFW_PRESS) cam.pos += up * cam.speed * dt;
 
-        if (glfwGetKey(w1, GLFW_KEY_1) == GLFW_PRESS) cam.pos = {0,1.3f,7.0f};
-        if (glfwGetKey(w1, GLFW_KEY_2) == GLFW_PRESS) cam.pos = {0,1.3f,3.0f};
-        if (glfwGetKey(w1, GLFW_KEY_3) == GLFW_PRESS) cam.pos = {0,1.3f,0.4f};
+        // Camera cuts invalidate the temporal history
+        bool cameraCut = false;
+        if (glfwGetKey(w1, GLFW_KEY_1) == GLFW_PRESS) { cam.pos = cameraPresets[0]; cameraCut = true; }
+        if (glfwGetKey(w1, GLFW_KEY_2) == GLFW_PRESS) { cam.pos = cameraPresets[1]; cameraCut = true; }
+        if (glfwGetKey(w1, GLFW_KEY_3) == GLFW_PRESS) { cam.pos = cameraPresets[2]; cameraCut = true; }
+
+        // Scripted camera: a slow dolly and pan around the preset
+        if (benchmark) {
+            float phase = float(now);
+            cam.pos = cameraPresets[benchPreset] + glm::vec3(0.3f * sin(phase * 0.9f), 0.1f * sin(phase * 1.7f), 0.2f * sin(phase * 0.5f));
+            cam.yaw = -90.0f + 15.0f * sin(phase * 0.6f);
+            cam.pitch = -15.0f + 10.0f * sin(phase * 0.8f);
+            front = cameraFront();
+            right = glm::normalize(glm::cross(front, {0,1,0}));
+            up = glm::normalize(glm::cross(right, front));
+            cameraCut = benchFrame == 0;
+        }
+        if (offline && renderFrame == 0) cameraCut = true;
+        if (quality) {
+            cam.pos = QUALITY_VIEWS[qualityView / qualityPhases.size()];
+            glm::vec3 aim = glm::normalize(QUALITY_AIM - cam.pos);
+            cam.yaw = glm::degrees(atan2(aim.z, aim.x));
+            cam.pitch = glm::degrees(asin(aim.y));
+            front = cameraFront();
+            right = glm::normalize(glm::cross(front, {0,1,0}));
+            up = glm::normalize(glm::cross(right, front));
+            cameraCut = qualityFrame == 0;
+            if (qualityConfig < 0) lightPower = qualityFrame == 0 ? 0.0f : qualityLightPower;
+        }
+        profiler.endCpu();
 
+        profiler.beginCpu("matrices");
         glm::mat4 view = glm::lookAt(cam.pos, cam.pos + front, up);
 
-        float timeF = (float)now;
-        float targetX = sin(timeF * g_orbitSpeed) * orbitRadius;
-        float targetZ = cos(timeF * g_orbitSpeed) * orbitRadius;
-        rotatingTarget = {targetX, 0.0f, targetZ};
+        // Dynamic objects are re-drawn into the shadow map whenever they exist
+        animate((float)now);
+        if (envActive && envStream.sample(steadySeconds(), envCurrent)) applyEnvironment(envCurrent, envDensityPerExtinction);
+        g_shadowRes = roundShadowRes(g_shadowRes);
+        if (g_shadowRes != shadowRes) allocateShadowMaps(g_shadowRes);
+        glm::mat4 lightVP = lightViewProj();
 
-        glm::mat4 lightProj = glm::perspective(glm::radians(45.0f), 1.0f, 0.1f, 50.0f);
-        glm::mat4 lightView = glm::lookAt(lightPos, rotatingTarget, glm::vec3(0,1,0));
-        glm::mat4 lightVP = lightProj * lightView;
-
-        glViewport(0, 0, SHADOW_RES, SHADOW_RES);
-        glBindFramebuffer(GL_FRAMEBUFFER, shadowFBO);
-        glClear(GL_DEPTH_BUFFER_BIT);
-        glCullFace(GL_BACK);
-        glEnable(GL_DEPTH_TEST);
-
-        glUseProgram(depthProg);
-        GLint d_locLightVP = glGetUniformLocation(depthProg, "uLightVP");
-        glUniformMatrix4fv(d_locLightVP, 1, GL_FALSE, glm::value_ptr(lightVP));
-
-        auto drawDepth = [&](const Mesh& m, const glm::mat4& model) {
-            GLint locM = glGetUniformLocation(depthProg, "uModel");
-            if (locM >= 0) glUniformMatrix4fv(locM, 1, GL_FALSE, glm::value_ptr(model));
-            glBindVertexArray(m.vao);
-            glDrawArrays(m.mode, 0, m.count);
-        };
+        // Dirty flags: the static layer follows the light, the final map
+        // follows the static layer and the dynamic objects
+        bool staticDirty = !g_shadowCache || !staticShadowValid || lightVP != staticShadowVP;
+        bool shadowDirty = staticDirty || !shadowValid || g_movingCube || shadowHadDynamic;
+        bool updateDue = !g_shadowCache || !shadowValid || g_shadowUpdateHz <= 0.0f ||
+                         now - lastShadowUpdate >= 1.0 / g_shadowUpdateHz;
 
-        glm::mat4 identity = glm::mat4(1.0f);
-        drawDepth(floorM, identity);
-        drawDepth(cwTop, identity); drawDepth(cwBot, identity); drawDepth(cwLft, identity); drawDepth(cwRgt, identity);
-        drawDepth(backM, identity); drawDepth(leftM, identity); drawDepth(rightM, identity);
-        drawDepth(sky, identity);
-        
-        for (auto &m : cubeModels) {
-            drawDepth(cubeMesh, m);
-        }
+        bool shadowUpdated = shadowDirty && updateDue && !g_terrain; // the room's passes sit out in terrain view
+        if (shadowUpdated) shadowVP = lightVP;
+        profiler.endCpu();
 
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        // Culling: one query per pass against that pass's view. The light
+        // pass uses the spotlight cone; when cached, the cone around the
+        // whole orbit, which is what the fixed frustum covers.
+        profiler.beginCpu("culling");
+        auto cullStart = std::chrono::steady_clock::now();
+        frameCommands.clear();
+        frameDrawIDs.clear();
+        skyList = appendDrawList({skyObject});
+        statsCamera = CullStats();
+        DrawList cameraList = g_terrain ? DrawList{} : cullDrawList(CullVolume(proj * view), OBJ_STATIC | OBJ_DYNAMIC, statsCamera);
+        DrawList staticShadowList, dynamicShadowList;
+        if (shadowUpdated) {
+            CullVolume lightVolume = lightCullVolume(lightVP);
+            statsLight = CullStats();
+            if (staticDirty) staticShadowList = cullDrawList(lightVolume, OBJ_STATIC, statsLight);
+            dynamicShadowList = cullDrawList(lightVolume, OBJ_DYNAMIC, statsLight);
+        }
+        cullSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - cullStart).count();
+        profiler.endCpu();
 
         int winW, winH;
         glfwGetFramebufferSize(w1, &winW, &winH);
+        if (offline || quality) {
+            winW = outputW;
+            winH = outputH;
+        }
+
+        // Deferred fog: surfaces go to sceneFBO, fog is marched at reduced
+        // resolution and composited on the way to the window
+        bool froxelFog = g_fogMode == 1 && g_hasCompute && !g_terrain;
+        bool epipolarFog = g_fogMode == 2 && !g_terrain;
+        bool deferredFog = (g_volumeDownsample > 1 || g_temporal || epipolarFog) && !froxelFog && !g_terrain;
+
+        // Everything the shaders read this frame, uploaded before the first draw
+        profiler.beginCpu("upload");
+        if (!(heightFogSettings() == heightFogProfile)) {
+            heightFogProfile = heightFogSettings();
+            heightFogLUT = buildHeightFogLUT(heightFogProfile, heightFogRange);
+            glActiveTexture(GL_TEXTURE0 + UNIT_HEIGHT_FOG_LUT);
+            glBindTexture(GL_TEXTURE_2D, heightFogTex);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, HEIGHT_FOG_LUT_SIZE, HEIGHT_FOG_LUT_SIZE, GL_RED, GL_FLOAT, heightFogLUT.data());
+        }
+        if (!(phaseSettings() == phase)) {
+            phase = phaseSettings();
+            buildPhaseLUT(phase, phaseLUT);
+            glActiveTexture(GL_TEXTURE0 + UNIT_PHASE_LUT);
+            glBindTexture(GL_TEXTURE_2D, phaseTex);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, PHASE_LUT_SIZE, PHASE_LUT_OCTAVES, GL_RED, GL_FLOAT, phaseLUT.data());
+        }
+        // Terrain tiles: a new wanted list whenever the camera crosses into
+        // another tile, and the first few finished tiles into the map
+        if (g_terrain) {
+            float tileSize = TERRAIN_TILE * TERRAIN_SPACING;
+            int centerX = int(floor((cam.pos.x - TERRAIN_ORIGIN) / tileSize)), centerZ = int(floor((cam.pos.z - TERRAIN_ORIGIN) / tileSize));
+            if (centerX != terrainCenterX || centerZ != terrainCenterZ) {
+                terrainCenterX = centerX;
+                terrainCenterZ = centerZ;
+                TerrainMap::wantedTiles(cam.pos.x, cam.pos.z, terrainWanted);
+                terrainWanted.erase(remove_if(terrainWanted.begin(), terrainWanted.end(),
+                                              [&](const pair<int, int>& t) { return terrainMap.isResident(t.first, t.second); }),
+                                    terrainWanted.end());
+                terrainStreamer.want(terrainWanted);
+            }
+            TerrainTile tile;
+            for (int n = 0; n < TERRAIN_UPLOADS && terrainStreamer.take(tile); ++n) uploadTerrainTile(tile, cam.pos);
+        }
+        glActiveTexture(GL_TEXTURE0);
+        FrameData frame = frameDataFor(view, shadowVP, winW, winH);
+        frame.jitterFrame = g_temporal ? frameIndex % 64 : 0;
+        frame.froxelNearFar[0] = FROXEL_NEAR;
+        frame.froxelNearFar[1] = FROXEL_FAR;
+        frame.froxelSlices = FROXEL_D;
+        frame.shadowMinMaxLevels = shadowMinMaxLevels;
+        frame.fogMode = froxelFog ? 1 : 0;
+        frame.deferredFog = deferredFog;
+        glBindBuffer(GL_UNIFORM_BUFFER, frameUBO);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameData), &frame);
+        uint64_t variant = fogVariant(frame);
+        if (variant != variantKey) {
+            variantKey = variant;
+            variantDefines = fogDefines(frame);
+        }
+        GLuint fogProg = programs.get(fogSlot, "fog", variant, variantDefines).id;
+
+        // Dynamic object data into this frame's ring region, once the GPU
+        // has finished the frame that last used it
+        glActiveTexture(GL_TEXTURE0 + UNIT_OBJECTS);
+        glBindTexture(GL_TEXTURE_BUFFER, objectTex);
+        if (objectMapped) {
+            int region = frameIndex % OBJECT_RING;
+            if (objectFences[region]) {
+                glClientWaitSync(objectFences[region], GL_SYNC_FLUSH_COMMANDS_BIT, GLuint64(1000000000));
+                glDeleteSync(objectFences[region]);
+                objectFences[region] = 0;
+            }
+            memcpy(objectMapped + region * objectRegion + dynamicObjectOffset, &objects[movingCubeObject], dynamicObjectBytes);
+            glTexBufferRange(GL_TEXTURE_BUFFER, GL_RGBA32F, objectBuffer, region * objectRegion, objectBytes);
+        } else {
+            glBindBuffer(GL_TEXTURE_BUFFER, objectBuffer);
+            glBufferSubData(GL_TEXTURE_BUFFER, dynamicObjectOffset, dynamicObjectBytes, &objects[movingCubeObject]);
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, drawIDBuffer);
+        glBufferData(GL_ARRAY_BUFFER, frameDrawIDs.size() * sizeof(GLint), frameDrawIDs.data(), GL_STREAM_DRAW);
+        if (multiDrawIndirect) {
+            glBufferData(GL_DRAW_INDIRECT_BUFFER, frameCommands.size() * sizeof(DrawCommand), frameCommands.data(), GL_STREAM_DRAW);
+        }
+
+        profiler.endCpu();
+
+        profiler.beginCpu("submit");
+        auto submitStart = std::chrono::steady_clock::now();
+        drawCalls = 0;
+
+        if (shadowUpdated) {
+            beginPass(PASS_SHADOW);
+            profiler.beginGpu("shadow");
+            glViewport(0, 0, shadowRes, shadowRes);
+            glCullFace(GL_BACK);
+            glEnable(GL_DEPTH_TEST);
+
+            glUseProgram(depthProg);
+
+            if (staticDirty) {
+                glBindFramebuffer(GL_FRAMEBUFFER, g_shadowCache ? staticShadowFBO : shadowFBO);
+                glClear(GL_DEPTH_BUFFER_BIT);
+                drawList(staticShadowList);
+                staticShadowValid = g_shadowCache;
+                staticShadowVP = lightVP;
+            }
+
+            if (g_shadowCache) {
+                glBindFramebuffer(GL_READ_FRAMEBUFFER, staticShadowFBO);
+                glBindFramebuffer(GL_DRAW_FRAMEBUFFER, shadowFBO);
+                glBlitFramebuffer(0, 0, shadowRes, shadowRes, 0, 0, shadowRes, shadowRes, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+            }
+            glBindFramebuffer(GL_FRAMEBUFFER, shadowFBO);
+            drawList(dynamicShadowList);
+
+            shadowValid = true;
+            shadowHadDynamic = g_movingCube;
+            shadowMinMaxValid = false;
+            lastShadowUpdate = now;
+            shadowUpdates++;
+            profiler.endGpu();
+            endPass();
+        }
+
+        if (g_shadowHierarchy && !shadowMinMaxValid && !g_terrain) {
+            // Each level reads only the one above it (base = max = source),
+            // so rendering into the next level is not a feedback loop
+            beginPass(PASS_SHADOW_MINMAX);
+            profiler.beginGpu("shadow minmax");
+            glDisable(GL_DEPTH_TEST);
+            glUseProgram(shadowMinMaxProg.id);
+            glBindVertexArray(fullscreenVAO);
+            glBindFramebuffer(GL_FRAMEBUFFER, shadowMinMaxFBO);
+            glActiveTexture(GL_TEXTURE0);
+            for (int level = 0; level < shadowMinMaxLevels; ++level) {
+                int s = (shadowRes / 2) >> level;
+                glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, shadowMinMaxTex, level);
+                glViewport(0, 0, s, s);
+                if (level == 0) {
+                    glBindTexture(GL_TEXTURE_2D, shadowTex);
+                } else {
+                    glBindTexture(GL_TEXTURE_2D, shadowMinMaxTex);
+                    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level - 1);
+                    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level - 1);
+                }
+                glUniform1i(shadowMinMaxProg.uniforms[U_FROM_DEPTH], level == 0);
+                glDrawArrays(GL_TRIANGLES, 0, 3);
+            }
+            glBindTexture(GL_TEXTURE_2D, shadowMinMaxTex);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, shadowMinMaxLevels - 1);
+            glEnable(GL_DEPTH_TEST);
+            shadowMinMaxValid = true;
+            profiler.endGpu();
+            endPass();
+        }
+
+        // Fog inputs stay on their reserved units for the rest of the frame
+        glActiveTexture(GL_TEXTURE0 + UNIT_SHADOW_MAP);
+        glBindTexture(GL_TEXTURE_2D, shadowTex);
+        glActiveTexture(GL_TEXTURE0 + UNIT_SHADOW_MINMAX);
+        glBindTexture(GL_TEXTURE_2D, shadowMinMaxTex);
+        glActiveTexture(GL_TEXTURE0 + UNIT_FROXEL_VOLUME);
+        glBindTexture(GL_TEXTURE_3D, froxelIntegratedTex);
+        glActiveTexture(GL_TEXTURE0 + UNIT_NOISE_VOLUME);
+        glBindTexture(GL_TEXTURE_3D, noiseTex);
+        glActiveTexture(GL_TEXTURE0 + UNIT_HEIGHT_FOG_LUT);
+        glBindTexture(GL_TEXTURE_2D, heightFogTex);
+        glActiveTexture(GL_TEXTURE0 + UNIT_PHASE_LUT);
+        glBindTexture(GL_TEXTURE_2D, phaseTex);
+        glActiveTexture(GL_TEXTURE0 + UNIT_TERRAIN_HEIGHTS);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, terrainTex[0]);
+        glActiveTexture(GL_TEXTURE0 + UNIT_TERRAIN_MAXIMA);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, terrainTex[1]);
+        glActiveTexture(GL_TEXTURE0 + UNIT_TERRAIN_PAGES);
+        glBindTexture(GL_TEXTURE_2D, terrainTex[2]);
+        glActiveTexture(GL_TEXTURE0 + UNIT_TERRAIN_COARSE);
+        glBindTexture(GL_TEXTURE_2D, terrainTex[3]);
+        // Render targets created later in the frame bind on the active unit
+        glActiveTexture(GL_TEXTURE0);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, outputFBO);
+
+        beginPass(PASS_SCENE);
+        if (deferredFog) {
+            ensureVolumeTargets(winW, winH, g_volumeDownsample);
+            glBindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+        }
+
         glViewport(0, 0, winW, winH);
         glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        drawMesh(sky, simpleProg, lightColor, view, proj);
+        // Sky is unfogged; in deferred mode it goes on after the composite
+        if (!deferredFog && !g_terrain) drawSky();
+
+        if (g_depthPrepass) {
+            profiler.beginGpu("prepass");
+            glUseProgram(prepassProg);
+            glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+            drawList(cameraList);
+            glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+            profiler.endGpu();
+
+            // Colour pass only shades the fragment that won the depth test
+            glDepthFunc(GL_EQUAL);
+            glDepthMask(GL_FALSE);
+        }
+
+        endPass();
+
+        if (froxelFog) {
+            // Inject once per froxel, then integrate each column front to back
+            beginPass(PASS_FROXEL);
+            profiler.beginGpu("froxel");
+            glUseProgram(programs.get(froxelInjectSlot, "froxel inject").id);
+            glBindImageTexture(0, froxelScatterTex, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+            glDispatchCompute((FROXEL_W + 7) / 8, (FROXEL_H + 7) / 8, FROXEL_D);
+            glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+            glUseProgram(programs.get(froxelIntegrateSlot, "froxel integrate").id);
+            glBindImageTexture(0, froxelScatterTex, 0, GL_TRUE, 0, GL_READ_ONLY, GL_RGBA16F);
+            glBindImageTexture(1, froxelIntegratedTex, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+            glDispatchCompute((FROXEL_W + 7) / 8, (FROXEL_H + 7) / 8, 1);
+            glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+            profiler.endGpu();
+            endPass();
+        }
 
+        beginPass(PASS_SCENE);
+        profiler.beginGpu("fog");
         glUseProgram(fogProg);
-        GLint locProj = glGetUniformLocation(fogProg, "uProj");
-        GLint locView = glGetUniformLocation(fogProg, "uView");
-        if (locProj >= 0) glUniformMatrix4fv(locProj, 1, GL_FALSE, glm::value_ptr(proj));
-        if (locView >= 0) glUniformMatrix4fv(locView, 1, GL_FALSE, glm::value_ptr(view));
-
-        GLint locViewPos = glGetUniformLocation(fogProg, "uViewPos");
-        GLint locLightPos = glGetUniformLocation(fogProg, "uLightPos");
-        GLint locLightColor = glGetUniformLocation(fogProg, "uLightColor");
-        GLint locLightPower = glGetUniformLocation(fogProg, "uLightPower");
-        GLint locFogDensity = glGetUniformLocation(fogProg, "uFogDensity");
-        GLint locExtinction = glGetUniformLocation(fogProg, "uExtinction");
-        GLint locNumSamples = glGetUniformLocation(fogProg, "uNumSamples");
-        GLint locConeInner = glGetUniformLocation(fogProg, "uConeAngleInner");
-        GLint locConeOuter = glGetUniformLocation(fogProg, "uConeAngleOuter");
-        GLint locWindowCenter = glGetUniformLocation(fogProg, "uWindowCenter");
-        GLint locLightVP = glGetUniformLocation(fogProg, "uLightVP");
-        GLint locShadowBias = glGetUniformLocation(fogProg, "uShadowBias");
-        
-        // Send Toggles
-        GLint locDither = glGetUniformLocation(fogProg, "uDither");
-        if (locDither >= 0) glUniform1i(locDither, g_useDithering);
-        
-        //Send Map Mode
-        GLint locShowMapMode = glGetUniformLocation(fogProg, "uShowMapMode");
-        if (locShowMapMode >= 0) glUniform1i(locShowMapMode, g_showMapMode);
-
-        //Send Ambient
-        GLint locFogAmbient = glGetUniformLocation(fogProg, "uFogAmbient");
-        if(locFogAmbient >= 0) glUniform1f(locFogAmbient, g_fogAmbient);
-
-        if (locViewPos >= 0) glUniform3fv(locViewPos, 1, glm::value_ptr(cam.pos));
-        if (locLightPos >= 0) glUniform3fv(locLightPos, 1, glm::value_ptr(lightPos));
-        if (locLightColor >= 0) glUniform3fv(locLightColor, 1, glm::value_ptr(lightColor));
-        if (locLightPower >= 0) glUniform1f(locLightPower, lightPower);
-        if (locFogDensity >= 0) glUniform1f(locFogDensity, g_fogDensity); 
-        if (locExtinction >= 0) glUniform1f(locExtinction, extinctionCoeff);
-        if (locNumSamples >= 0) glUniform1i(locNumSamples, g_numSamples); 
-        if (locConeInner >= 0) glUniform1f(locConeInner, coneInnerCos);
-        if (locConeOuter >= 0) glUniform1f(locConeOuter, coneOuterCos);
-        if (locWindowCenter >= 0) glUniform3fv(locWindowCenter, 1, glm::value_ptr(rotatingTarget));
-        if (locLightVP >= 0) glUniformMatrix4fv(locLightVP, 1, GL_FALSE, glm::value_ptr(lightVP));
-        if (locShadowBias >= 0) glUniform1f(locShadowBias, 0.005f);
-
-        glActiveTexture(GL_TEXTURE3);
-        glBindTexture(GL_TEXTURE_2D, shadowTex);
-        GLint locShadowSampler = glGetUniformLocation(fogProg, "uShadowMap");
-        if (locShadowSampler >= 0) glUniform1i(locShadowSampler, 3);
-
-        auto drawFog = [&](const Mesh& m, const glm::vec3& color, const glm::mat4& model =glm::mat4(1.0f)) {
-            GLint locM = glGetUniformLocation(fogProg, "uModel");
-            if (locM >= 0) glUniformMatrix4fv(locM, 1, GL_FALSE, glm::value_ptr(model));
-            GLint locC = glGetUniformLocation(fogProg, "uColor");
-            if (locC >= 0) glUniform3f(locC, color.r, color.g, color.b);
-            glBindVertexArray(m.vao);
-            glDrawArrays(m.mode, 0, m.count);
-        };
+        glBeginQuery(GL_SAMPLES_PASSED, shadedQuery[frameIndex & 1]);
+
+        drawList(cameraList);
+
+        glEndQuery(GL_SAMPLES_PASSED);
+        profiler.endGpu();
+        endPass();
+        glDepthFunc(GL_LESS);
+        glDepthMask(GL_TRUE);
+        submitSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - submitStart).count();
+        submitFrames++;
+        statsDrawCalls = drawCalls;
+
+        beginPass(PASS_RESOLVE);
+        if (epipolarFog || deferredFog) profiler.beginGpu(epipolarFog ? "epipolar" : "volume");
+        if (epipolarFog) {
+            const Program& epiCoordProg = programs.get(epiCoordSlot, "epipolar coords");
+            const Program& epiMarchProg = programs.get(epiMarchSlot, "epipolar march", variant, variantDefines);
+            const Program& epiInterpProg = programs.get(epiInterpSlot, "epipolar interp");
+            const Program& epiCompositeProg = programs.get(epiCompositeSlot, "epipolar composite", variant, variantDefines);
+            glm::mat4 invViewProj = glm::inverse(proj * view);
+
+            // Light in screen pixels; behind the camera this is the point the
+            // shafts converge to, which is where the lines meet all the same
+            glm::vec4 lightClip = proj * view * glm::vec4(lightPos, 1.0f);
+            if (fabs(lightClip.w) < 1e-4f) lightClip.w = lightClip.w < 0.0f ? -1e-4f : 1e-4f;
+            glm::vec2 lightScreen = (glm::vec2(lightClip.x, lightClip.y) / lightClip.w * 0.5f + 0.5f) * glm::vec2((float)winW, (float)winH);
+
+            auto setEpipolarUniforms = [&](const Program& prog) {
+                glUseProgram(prog.id);
+                glUniform2fv(prog.uniforms[U_EPI_LIGHT], 1, glm::value_ptr(lightScreen));
+                glUniform2f(prog.uniforms[U_EPI_SCREEN], (float)winW, (float)winH);
+                glUniformMatrix4fv(prog.uniforms[U_INV_VIEW_PROJ], 1, GL_FALSE, glm::value_ptr(invViewProj));
+            };
+
+            glDisable(GL_DEPTH_TEST);
+            glBindVertexArray(fullscreenVAO);
+            glViewport(0, 0, EPI_SAMPLES, EPI_LINES);
+
+            glBindFramebuffer(GL_FRAMEBUFFER, epiFBO[0]);
+            setEpipolarUniforms(epiCoordProg);
+            glUniform3fv(epiCoordProg.uniforms[U_VIEW_POS], 1, glm::value_ptr(cam.pos));
+            glActiveTexture(GL_TEXTURE0 + UNIT_PASS_DEPTH);
+            glBindTexture(GL_TEXTURE_2D, sceneDepthTex);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+
+            glBindFramebuffer(GL_FRAMEBUFFER, epiFBO[1]);
+            setEpipolarUniforms(epiMarchProg);
+            glActiveTexture(GL_TEXTURE0 + UNIT_PASS_AUX);
+            glBindTexture(GL_TEXTURE_2D, epiTex[0]);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+
+            glBindFramebuffer(GL_FRAMEBUFFER, epiFBO[2]);
+            glUseProgram(epiInterpProg.id);
+            glActiveTexture(GL_TEXTURE0 + UNIT_PASS_COLOR);
+            glBindTexture(GL_TEXTURE_2D, epiTex[1]);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+
+            // Unwarp + composite, restoring scene depth for the sky like the volume path
+            glBindFramebuffer(GL_FRAMEBUFFER, outputFBO);
+            glViewport(0, 0, winW, winH);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            glEnable(GL_DEPTH_TEST);
+            glDepthFunc(GL_ALWAYS);
+            setEpipolarUniforms(epiCompositeProg);
+            glActiveTexture(GL_TEXTURE0 + UNIT_PASS_COLOR);
+            glBindTexture(GL_TEXTURE_2D, sceneColorTex);
+            glActiveTexture(GL_TEXTURE0 + UNIT_PASS_DEPTH);
+            glBindTexture(GL_TEXTURE_2D, sceneDepthTex);
+            glActiveTexture(GL_TEXTURE0 + UNIT_PASS_AUX);
+            glBindTexture(GL_TEXTURE_2D, epiTex[0]);
+            glActiveTexture(GL_TEXTURE0 + UNIT_PASS_FOG);
+            glBindTexture(GL_TEXTURE_2D, epiTex[2]);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            glDepthFunc(GL_LESS);
+
+            drawSky();
+            temporalWasOn = false;
+        } else if (deferredFog) {
+            const Program& volumeProg = programs.get(volumeSlot, "volume", variant, variantDefines);
+            const Program& temporalProg = programs.get(temporalSlot, "temporal");
+            const Program& compositeProg = programs.get(volumeCompositeSlot, "volume composite");
+            glm::mat4 invViewProj = glm::inverse(proj * view);
+
+            // Volumetric pass at 1/g_volumeDownsample resolution
+            glBindFramebuffer(GL_FRAMEBUFFER, volumeFBO);
+            glViewport(0, 0, volumeW, volumeH);
+            glDisable(GL_DEPTH_TEST);
+            glUseProgram(volumeProg.id);
+            glActiveTexture(GL_TEXTURE0 + UNIT_PASS_DEPTH);
+            glBindTexture(GL_TEXTURE_2D, sceneDepthTex);
+            glUniform1i(volumeProg.uniforms[U_DOWNSAMPLE], g_volumeDownsample);
+            glBindVertexArray(fullscreenVAO);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+
+            GLuint fogTex = volumeTex;
+            if (g_temporal) {
+                // Light motion the reprojection can't follow: fade history out
+                glm::vec3 lightAxis = glm::normalize(rotatingTarget - lightPos);
+                float lightMotion = acos(glm::clamp(glm::dot(lightAxis, prevLightAxis), -1.0f, 1.0f));
+                if (!temporalWasOn || cameraCut) historyValid = false;
+                float blend = historyValid ? glm::clamp(g_temporalBlend + lightMotion / g_temporalLightReject, g_temporalBlend, 1.0f) : 1.0f;
+
+                int cur = frameIndex & 1;
+                glBindFramebuffer(GL_FRAMEBUFFER, historyFBO[cur]);
+                glUseProgram(temporalProg.id);
+                glActiveTexture(GL_TEXTURE0 + UNIT_PASS_COLOR);
+                glBindTexture(GL_TEXTURE_2D, volumeTex);
+                glActiveTexture(GL_TEXTURE0 + UNIT_PASS_DEPTH);
+                glBindTexture(GL_TEXTURE_2D, sceneDepthTex);
+                glActiveTexture(GL_TEXTURE0 + UNIT_PASS_AUX);
+                glBindTexture(GL_TEXTURE_2D, historyTex[cur ^ 1]);
+                glUniformMatrix4fv(temporalProg.uniforms[U_INV_VIEW_PROJ], 1, GL_FALSE, glm::value_ptr(invViewProj));
+                glUniformMatrix4fv(temporalProg.uniforms[U_PREV_VIEW_PROJ], 1, GL_FALSE, glm::value_ptr(prevViewProj));
+                glUniform1i(temporalProg.uniforms[U_DOWNSAMPLE], g_volumeDownsample);
+                glUniform1f(temporalProg.uniforms[U_BLEND], blend);
+                glDrawArrays(GL_TRIANGLES, 0, 3);
+
+                fogTex = historyTex[cur];
+                historyValid = true;
+                prevLightAxis = lightAxis;
+            }
+            temporalWasOn = g_temporal;
 
-        drawFog(floorM, {0.35f,0.35f,0.4f});
-        drawFog(cwTop, {0.35f,0.35f,0.4f});
-        drawFog(cwBot, {0.35f,0.35f,0.4f});
-        drawFog(cwLft, {0.35f,0.35f,0.4f});
-        drawFog(cwRgt, {0.35f,0.35f,0.4f});
-        drawFog(backM, {0.4f,0.4f,0.45f});
-        drawFog(leftM, {0.4f,0.4f,0.45f});
-        drawFog(rightM,{0.4f,0.4f,0.45f});
+            // Composite also restores scene depth so the sky can be tested against it
+            glBindFramebuffer(GL_FRAMEBUFFER, outputFBO);
+            glViewport(0, 0, winW, winH);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            glEnable(GL_DEPTH_TEST);
+            glDepthFunc(GL_ALWAYS);
+            glUseProgram(compositeProg.id);
+            glActiveTexture(GL_TEXTURE0 + UNIT_PASS_COLOR);
+            glBindTexture(GL_TEXTURE_2D, sceneColorTex);
+            glActiveTexture(GL_TEXTURE0 + UNIT_PASS_DEPTH);
+            glBindTexture(GL_TEXTURE_2D, sceneDepthTex);
+            glActiveTexture(GL_TEXTURE0 + UNIT_PASS_AUX);
+            glBindTexture(GL_TEXTURE_2D, fogTex);
+            glUniform1i(compositeProg.uniforms[U_DOWNSAMPLE], g_volumeDownsample);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            glDepthFunc(GL_LESS);
 
-        for (size_t i = 0; i < cubeModels.size(); ++i) {
-            drawFog(cubeMesh, cubeColors[i], cubeModels[i]);
+            drawSky();
+        } else {
+            temporalWasOn = false;
         }
+        if (epipolarFog || deferredFog) profiler.endGpu();
+        endPass();
 
-        glfwSwapBuffers(w1);
+        // Terrain view: every pixel is a ray through the heightfield
+        if (g_terrain) {
+            beginPass(PASS_SCENE);
+            profiler.beginGpu("terrain");
+            const Program& terrainProg = programs.get(terrainSlot, "terrain");
+            glBindFramebuffer(GL_FRAMEBUFFER, outputFBO);
+            glViewport(0, 0, winW, winH);
+            glDisable(GL_DEPTH_TEST);
+            glUseProgram(terrainProg.id);
+            glUniform1i(terrainProg.uniforms[U_TERRAIN_TRAVERSAL], g_terrainTraversal);
+            glBindVertexArray(fullscreenVAO);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            glEnable(GL_DEPTH_TEST);
+            profiler.endGpu();
+            endPass();
+        }
+        prevViewProj = proj * view;
+        profiler.endCpu();
+
+        if (g_profiler) {
+            profiler.beginCpu("overlay");
+            profiler.beginGpu("overlay");
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, overlayTex);
+            if (now - overlayTime >= 0.25 || now < overlayTime) {
+                overlayTime = now;
+                vector<uint8_t> text = rasterizeText(profiler.summary(60), overlayW, overlayH);
+                glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, overlayW, overlayH, 0, GL_RED, GL_UNSIGNED_BYTE, text.data());
+                glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+            }
+            glBindFramebuffer(GL_FRAMEBUFFER, outputFBO);
+            glViewport(8, winH - 8 - 2 * overlayH, 2 * overlayW, 2 * overlayH);
+            glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+            glDisable(GL_DEPTH_TEST);
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+            glUseProgram(programs.get(overlaySlot, "overlay").id);
+            glBindVertexArray(fullscreenVAO);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            glDisable(GL_BLEND);
+            glEnable(GL_DEPTH_TEST);
+            profiler.endGpu();
+            profiler.endCpu();
+        }
+
+        profiler.beginCpu("stats");
+
+        if (frameIndex > 0) {
+            GLuint prevQuery = shadedQuery[(frameIndex - 1) & 1];
+            GLint available = 0;
+            glGetQueryObjectiv(prevQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (available) glGetQueryObjectui64v(prevQuery, GL_QUERY_RESULT, &shadedFragments);
+        }
+        if (objectMapped) objectFences[frameIndex % OBJECT_RING] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        frameIndex++;
+
+        if (g_showStats && now - statsTime >= 1.0) {
+            statsTime = now;
+            GLuint64 pixels = (GLuint64)winW * (GLuint64)winH;
+            cout << "fog fragments shaded " << shadedFragments << " / " << pixels << " pixels ("
+                 << (pixels ? double(shadedFragments) / double(pixels) : 0.0) << "x)"
+                 << (g_depthPrepass ? " [pre-pass]" : "") << endl;
+            cout << "shadow map renders " << shadowUpdates << " in the last second"
+                 << (g_shadowCache ? " [cached]" : "") << endl;
+            shadowUpdates = 0;
+            cout << "draw submission " << (submitFrames ? 1000.0 * submitSeconds / submitFrames : 0.0)
+                 << " ms/frame CPU, " << statsDrawCalls << " draw calls"
+                 << (multiDrawIndirect ? " [multi-draw indirect]" : "") << endl;
+            auto printCull = [](const char* name, const CullStats& c) {
+                cout << name << " " << c.tested << " tested, " << c.culled << " culled, " << c.drawn << " drawn";
+            };
+            cout << "culling " << (submitFrames ? 1000.0 * cullSeconds / submitFrames : 0.0) << " ms/frame"
+                 << (g_culling ? "" : " [off]") << ": ";
+            printCull("camera", statsCamera);
+            printCull("; light", statsLight);
+            cout << endl;
+            cout << "programs " << programs.built << " built, " << programs.loaded << " from cache" << endl;
+            if (g_terrain) {
+                cout << "terrain " << terrainMap.resident << " / " << TERRAIN_POOL << " tiles resident, "
+                     << terrainStreamer.baked.load() << " baked, " << terrainStreamer.pending() << " pending"
+                     << (g_terrainTraversal ? " [quadtree]" : " [fixed-step]") << endl;
+            }
+            if (envActive) {
+                cout << "environment " << envStream.records << " records (" << envStream.malformed << " malformed)"
+                     << (envStream.finished() ? " [ended]" : "") << ": t " << envCurrent.time << " s, visibility "
+                     << envCurrent.visibility << " m, humidity " << envCurrent.humidity << "%, sun "
+                     << envCurrent.sunElevation << " deg" << endl;
+            }
+            submitSeconds = 0.0;
+            cullSeconds = 0.0;
+            submitFrames = 0;
+        }
+        profiler.endCpu();
+
+        double cpuFrameMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count();
+        if (offline) {
+            // This frame into the next slot of the ring, waiting on that
+            // slot's previous frame only if its copy has not landed yet
+            profiler.beginCpu("readback");
+            Readback& slot = readbacks[renderIssued % readbacks.size()];
+            if (slot.fence) {
+                if (glClientWaitSync(slot.fence, 0, 0) == GL_TIMEOUT_EXPIRED) readbackStalls++;
+                collectReadback(slot);
+            }
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, outputFBO);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+            glReadPixels(0, 0, outputW, outputH, GL_RGBA, renderFormat == FRAME_PFM ? GL_FLOAT : GL_UNSIGNED_BYTE, nullptr);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            glFlush();
+            char name[32];
+            snprintf(name, sizeof(name), "frame_%06llu.%s", (unsigned long long)renderIssued, FRAME_FORMAT_NAMES[renderFormat]);
+            slot.path = renderDir + "/" + name;
+            renderIndex << renderIssued << "," << renderConfigs[renderConfig].name << "," << now << "," << name << "\n";
+            renderIssued++;
+            // Older copies that have landed meanwhile go to the encoders now
+            for (Readback& r : readbacks) {
+                if (&r != &slot && r.fence && glClientWaitSync(r.fence, 0, 0) != GL_TIMEOUT_EXPIRED) collectReadback(r);
+            }
+            for (const Readback& r : readbacks) readbackInFlight += r.fence != nullptr;
+            profiler.endCpu();
+        } else if (!quality) {
+            profiler.beginCpu("swap");
+            glfwSwapBuffers(w1);
+            profiler.endCpu();
+        }
+        profiler.beginCpu("input");
         glfwPollEvents();
+        profiler.endCpu();
+        profiler.endFrame();
+
+        // Governor: the CPU time to the swap against the newest frame whose
+        // GPU scopes the profiler has read back, which is a few frames old
+        // but never waited for
+        if (g_governor != governorWasOn) {
+            governorWasOn = g_governor;
+            if (g_governor) governor.start(now);
+            else governor.stop(now);
+            governorBudget = g_frameBudgetMs;
+        }
+        if (g_governor) {
+            if (g_frameBudgetMs != governorBudget) {
+                governorBudget = g_frameBudgetMs;
+                governor.restart();
+            }
+            for (auto f = profiler.history.rbegin(); f != profiler.history.rend(); ++f) {
+                if (!f->gpuDone) continue;
+                if (f->index != governorGpuFrame) {
+                    governorGpuFrame = f->index;
+                    governorGpuMs = governorFogMs = governorShadowMs = 0.0;
+                    for (const Profiler::Event& e : f->gpu) {
+                        double ms = e.end - e.start;
+                        if (e.depth == 0) governorGpuMs += ms;
+                        if (!strcmp(e.name, "shadow") || !strcmp(e.name, "shadow minmax")) governorShadowMs += ms;
+                        else if (!strcmp(e.name, "fog") || !strcmp(e.name, "froxel") || !strcmp(e.name, "volume") || !strcmp(e.name, "epipolar")) governorFogMs += ms;
+                    }
+                }
+                break;
+            }
+            governor.update(now, max(cpuFrameMs, governorGpuMs), governorFogMs, governorShadowMs);
+        }
+
+        if (g_profilerDump) {
+            g_profilerDump = false;
+            if (!profiler.enabled()) {
+                cout << "profiler is off (O)" << endl;
+            } else {
+                profiler.collectAll();
+                if (profiler.writeTrace(tracePath)) cout << "trace of " << profiler.history.size() << " frames written to " << tracePath << endl;
+                else cerr << "Failed to write " << tracePath << endl;
+            }
+        }
+
+        if (benchmark) {
+            // Synchronous, so the frame time covers the GPU work and the
+            // pass queries are ready
+            glFinish();
+            double frameMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count();
+            if (benchFrame >= benchWarmup) {
+                benchFrameMs.push_back(frameMs);
+                for (int q = 0; q < passQueryCount && !benchSyncPasses; ++q) {
+                    GLuint64 ns = 0;
+                    glGetQueryObjectui64v(passQueries[q], GL_QUERY_RESULT, &ns);
+                    framePassMs[passQueryPass[q]] += double(ns) * 1e-6;
+                }
+                for (int p = 0; p < PASS_COUNT; ++p) benchPassMs[p] += framePassMs[p];
+            }
+            if (++benchFrame == benchWarmup + benchFrames) {
+                BenchResult r;
+                r.config = benchConfigs[benchConfig].name;
+                r.preset = benchPreset + 1;
+                r.frames = int(benchFrameMs.size());
+                r.mean = accumulate(benchFrameMs.begin(), benchFrameMs.end(), 0.0) / max(r.frames, 1);
+                r.p50 = percentile(benchFrameMs, 50.0);
+                r.p95 = percentile(benchFrameMs, 95.0);
+                r.p99 = percentile(benchFrameMs, 99.0);
+                for (int p = 0; p < PASS_COUNT; ++p) r.passMean[p] = benchPassMs[p] / max(r.frames, 1);
+                cout << r.config << ", preset " << r.preset << ": p50 " << r.p50 << " ms, p95 " << r.p95
+                     << " ms, p99 " << r.p99 << " ms" << endl;
+                benchResults.push_back(r);
+                benchFrameMs.clear();
+                fill(benchPassMs, benchPassMs + PASS_COUNT, 0.0);
+                benchFrame = 0;
+                if (++benchPreset == 3) {
+                    benchPreset = 0;
+                    if (++benchConfig == benchConfigs.size()) break;
+                    applyConfig(benchConfigs[benchConfig]);
+                }
+            }
+        }
+        if (quality) {
+            // Timed like the benchmark; the truth's frame is timed too, as
+            // the cost every config is saving against
+            glFinish();
+            double frameMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count();
+            bool truth = qualityConfig < 0;
+            int warmup = truth ? 1 : qualityWarmup, frames = truth ? 1 : qualityFrames;
+            if (truth && qualityFrame == 0) {
+                qualityBeamless.resize(size_t(outputW) * outputH * 4);
+                glBindFramebuffer(GL_READ_FRAMEBUFFER, outputFBO);
+                glReadPixels(0, 0, outputW, outputH, GL_RGBA, GL_UNSIGNED_BYTE, qualityBeamless.data());
+            }
+            if (qualityFrame >= warmup) qualityFrameMs.push_back(frameMs);
+            if (++qualityFrame == warmup + frames) {
+                vector<uint8_t> pixels(size_t(outputW) * outputH * 4);
+                glBindFramebuffer(GL_READ_FRAMEBUFFER, outputFBO);
+                glReadPixels(0, 0, outputW, outputH, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+                QualityResult r;
+                r.config = qualityConfig < 0 ? "truth" : qualityConfigs[qualityConfig].name;
+                r.view = qualityView / int(qualityPhases.size()) + 1;
+                r.phase = qualityPhases[qualityView % qualityPhases.size()];
+                r.ms = percentile(qualityFrameMs, 50.0);
+                if (truth) {
+                    double beamRmse, beamPsnr;
+                    rmsePSNR(qualityBeamless.data(), pixels.data(), outputW, outputH, beamRmse, beamPsnr);
+                    if (beamRmse < QUALITY_MIN_BEAM_RMSE) {
+                        cerr << "quality: view " << r.view << ", t " << r.phase << " barely shows the beam (RMSE " << beamRmse
+                             << " without it); every config will score near zero there" << endl;
+                    }
+                    qualityTruth[qualityView] = flipPrepare(pixels.data(), outputW, outputH, referenceThreads);
+                    qualityTruthPixels[qualityView].swap(pixels);
+                    r.psnr = 99.0;
+                } else {
+                    rmsePSNR(qualityTruthPixels[qualityView].data(), pixels.data(), outputW, outputH, r.rmse, r.psnr);
+                    r.flip = flipMean(qualityTruth[qualityView], flipPrepare(pixels.data(), outputW, outputH, referenceThreads));
+                }
+                cout << r.config << ", view " << r.view << ", t " << r.phase << ": " << r.ms << " ms, RMSE " << r.rmse
+                     << ", PSNR " << r.psnr << " dB, FLIP " << r.flip << endl;
+                qualityResults.push_back(r);
+                qualityFrameMs.clear();
+                qualityFrame = 0;
+                if (++qualityView == qualityViews) {
+                    qualityView = 0;
+                    if (truth) {
+                        for (const auto& setting : qualityBase) setParam(setting.first, setting.second);
+                    }
+                    if (++qualityConfig == int(qualityConfigs.size())) break;
+                    applyConfig(qualityConfigs[qualityConfig]);
+                }
+            }
+        }
+        if (offline && ++renderFrame == renderFrames) {
+            renderFrame = 0;
+            if (++renderConfig == renderConfigs.size()) break;
+            applyConfig(renderConfigs[renderConfig]);
+        }
+    }
+
+    int exitCode = 0;
+    if (envActive) {
+        envStream.close();
+        double seconds = envStream.elapsed();
+        cout << "environment: " << envStream.records << " records (" << envStream.malformed << " malformed) in "
+             << seconds << " s, " << (seconds > 0.0 ? double(envStream.records) / seconds : 0.0) << " records/s" << endl;
+    }
+    if (quality) {
+        if (qualityConfig < int(qualityConfigs.size())) cerr << "quality suite interrupted" << endl;
+        vector<QualitySummary> summaries = summarizeQuality(qualityResults);
+        cout << "quality: mean over " << qualityViews << " views, fastest first (* = Pareto front, frame time against FLIP)" << endl;
+        size_t width = 6;
+        for (const QualitySummary& q : summaries) width = max(width, q.config.size());
+        char row[256];
+        snprintf(row, sizeof(row), "  %-*s %10s %8s %8s %8s", int(width), "config", "ms", "RMSE", "PSNR", "FLIP");
+        cout << row << endl;
+        for (const QualitySummary& q : summaries) {
+            snprintf(row, sizeof(row), "%c %-*s %10.3f %8.3f %8.2f %8.4f", q.pareto ? '*' : ' ', int(width), q.config.c_str(),
+                     q.ms, q.rmse, q.psnr, q.flip);
+            cout << row << endl;
+        }
+        if (!writeQualityResults(qualityPath, (const char*)glGetString(GL_RENDERER), outputW, outputH, qualityResults, summaries)) {
+            cerr << "Failed to write " << qualityPath << ".csv/.json" << endl;
+            exitCode = 1;
+        }
+        if (!qualityBaselinePath.empty()) {
+            // A regression is a FLIP above the baseline's by more than the
+            // tolerance, for the same config and view; frame times are the
+            // benchmark's to gate
+            vector<QualityResult> baseline = readQualityBaseline(qualityBaselinePath);
+            int compared = 0, regressions = 0;
+            for (const QualityResult& r : qualityResults) {
+                for (const QualityResult& b : baseline) {
+                    if (b.config != r.config || b.view != r.view || fabs(b.phase - r.phase) > 1e-6) continue;
+                    compared++;
+                    if (r.flip > b.flip * (1.0 + qualityTolerance) + 1e-4) {
+                        regressions++;
+                        cout << "REGRESSION " << r.config << ", view " << r.view << ", t " << r.phase << ": FLIP " << r.flip
+                             << " vs " << b.flip << endl;
+                    }
+                }
+            }
+            cout << "baseline: " << compared << " results compared, " << regressions << " FLIP regressions over "
+                 << 100.0 * qualityTolerance << "%" << endl;
+            if (regressions > 0 || compared == 0) exitCode = 1;
+        }
+    }
+    if (offline) {
+        for (Readback& r : readbacks) {
+            if (r.fence) collectReadback(r);
+        }
+        frameWriter.finish();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - renderStart).count();
+        if (renderConfig < renderConfigs.size()) cerr << "render interrupted" << endl;
+        cout << "render: " << frameWriter.written << " frames in " << seconds << " s, "
+             << (seconds > 0.0 ? double(frameWriter.written) / seconds : 0.0) << " frames/s" << endl;
+        cout << "  readback: " << (renderIssued ? double(readbackInFlight) / double(renderIssued) : 0.0) << " of "
+             << readbacks.size() << " buffers in flight on average, " << readbackStalls << " stalls, "
+             << 1000.0 * readbackWaitSeconds << " ms waiting on fences" << endl;
+        cout << "  encoders: " << frameWriter.threads() << " threads "
+             << (seconds > 0.0 ? 100.0 * frameWriter.busySeconds / (frameWriter.threads() * seconds) : 0.0) << "% busy, peak "
+             << frameWriter.peakQueued << " queued, render loop blocked " << 1000.0 * frameWriter.blockedSeconds << " ms" << endl;
+        if (frameWriter.failed > 0 || !renderIndex) exitCode = 1;
+    }
+    if (traceOnExit) {
+        profiler.collectAll();
+        if (!profiler.writeTrace(tracePath)) {
+            cerr << "Failed to write " << tracePath << endl;
+            exitCode = 1;
+        }
+    }
+    if (benchmark) {
+        if (benchConfig < benchConfigs.size()) cerr << "benchmark interrupted" << endl;
+        if (!writeBenchResults(benchPath, (const char*)glGetString(GL_RENDERER), outputW, outputH, benchResults)) {
+            cerr << "Failed to write " << benchPath << ".csv/.json" << endl;
+            exitCode = 1;
+        }
+        if (!benchBaselinePath.empty()) {
+            // A regression is a p95 above the baseline's by more than the
+            // tolerance, for the same config and preset
+            vector<BenchResult> baseline = readBenchBaseline(benchBaselinePath);
+            int compared = 0, regressions = 0;
+            for (const BenchResult& r : benchResults) {
+                for (const BenchResult& b : baseline) {
+                    if (b.config != r.config || b.preset != r.preset) continue;
+                    compared++;
+                    double change = b.p95 > 0.0 ? r.p95 / b.p95 - 1.0 : 0.0;
+                    if (change > benchTolerance) {
+                        regressions++;
+                        cout << "REGRESSION " << r.config << ", preset " << r.preset << ": p95 " << r.p95
+                             << " ms vs " << b.p95 << " ms (+" << 100.0 * change << "%)" << endl;
+                    }
+                }
+            }
+            cout << "baseline: " << compared << " results compared, " << regressions << " regressions over "
+                 << 100.0 * benchTolerance << "%" << endl;
+            if (regressions > 0 || compared == 0) exitCode = 1;
+        }
     }
 
     glfwTerminate();
-    return 0;
+    return exitCode;
 }